@@ -0,0 +1,562 @@
+#pragma once
+
+// Local dependencies.
+#include "audio.hpp"
+
+// External dependencies.
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Standard C++ libraries.
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Standard C libraries.
+#include <cassert>
+#include <cstddef>
+
+namespace audio {
+
+/** \brief Name of the vector instructions the kernels were built for.
+ *
+ *  The choice is made at compile time,
+ *  so building with, say, `-mavx2` or `-march=native`
+ *  is what enables the wider kernels.
+ */
+constexpr char const* simd_name() {
+#if defined(__AVX2__)
+  return "AVX2";
+#elif defined(__SSE2__)
+  return "SSE2";
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  return "NEON";
+#else
+  return "scalar";
+#endif
+}
+
+/** \brief Converts `count` samples to floats, multiplied by `scale`.
+ *
+ *  A `scale` of `1 / 32768` maps the full 16-bit range to `[-1, 1)`.
+ */
+inline void convert_s16_to_f32(
+    short const* input, float* output, std::size_t count, float scale) {
+  std::size_t index = 0u;
+#if defined(__AVX2__)
+  auto const scale_vector = _mm256_set1_ps(scale);
+  for (; index + 8u <= count; index += 8u) {
+    auto const samples = _mm256_cvtepi16_epi32(_mm_loadu_si128(
+        reinterpret_cast<__m128i const*>(input + index)));
+    _mm256_storeu_ps(
+        output + index,
+        _mm256_mul_ps(_mm256_cvtepi32_ps(samples), scale_vector));
+  }
+#elif defined(__SSE2__)
+  auto const scale_vector = _mm_set1_ps(scale);
+  for (; index + 8u <= count; index += 8u) {
+    auto const samples = _mm_loadu_si128(
+        reinterpret_cast<__m128i const*>(input + index));
+    // Sign-extend by unpacking into the high halves and shifting down.
+    auto const low =
+        _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+    auto const high =
+        _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+    _mm_storeu_ps(
+        output + index, _mm_mul_ps(_mm_cvtepi32_ps(low), scale_vector));
+    _mm_storeu_ps(
+        output + index + 4u,
+        _mm_mul_ps(_mm_cvtepi32_ps(high), scale_vector));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; index + 8u <= count; index += 8u) {
+    auto const samples = vld1q_s16(input + index);
+    vst1q_f32(
+        output + index,
+        vmulq_n_f32(
+            vcvtq_f32_s32(vmovl_s16(vget_low_s16(samples))), scale));
+    vst1q_f32(
+        output + index + 4u,
+        vmulq_n_f32(vcvtq_f32_s32(vmovl_high_s16(samples)), scale));
+  }
+#endif
+  for (; index < count; ++index) {
+    output[index] = static_cast<float>(input[index]) * scale;
+  }
+}
+
+/** \brief Converts `count` floats in `[-1, 1)` to 16-bit samples.
+ *
+ *  Values are rounded to the nearest sample,
+ *  and values outside the range saturate instead of wrapping.
+ */
+inline void convert_f32_to_s16(
+    float const* input, short* output, std::size_t count) {
+  constexpr float scale = 32768.0f;
+  constexpr float minimum = -32768.0f;
+  constexpr float maximum = 32767.0f;
+  std::size_t index = 0u;
+#if defined(__AVX2__)
+  auto const scale_vector = _mm256_set1_ps(scale);
+  auto const minimum_vector = _mm256_set1_ps(minimum);
+  auto const maximum_vector = _mm256_set1_ps(maximum);
+  auto const to_integers = [&](float const* values) {
+    auto const scaled =
+        _mm256_mul_ps(_mm256_loadu_ps(values), scale_vector);
+    return _mm256_cvtps_epi32(_mm256_min_ps(
+        _mm256_max_ps(scaled, minimum_vector), maximum_vector));
+  };
+  for (; index + 16u <= count; index += 16u) {
+    auto const packed = _mm256_packs_epi32(
+        to_integers(input + index), to_integers(input + index + 8u));
+    // Packing works within 128-bit lanes, so put the halves in order.
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(output + index),
+        _mm256_permute4x64_epi64(packed, 0xd8));
+  }
+#elif defined(__SSE2__)
+  auto const scale_vector = _mm_set1_ps(scale);
+  auto const minimum_vector = _mm_set1_ps(minimum);
+  auto const maximum_vector = _mm_set1_ps(maximum);
+  auto const to_integers = [&](float const* values) {
+    auto const scaled = _mm_mul_ps(_mm_loadu_ps(values), scale_vector);
+    return _mm_cvtps_epi32(
+        _mm_min_ps(_mm_max_ps(scaled, minimum_vector), maximum_vector));
+  };
+  for (; index + 8u <= count; index += 8u) {
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i*>(output + index),
+        _mm_packs_epi32(
+            to_integers(input + index),
+            to_integers(input + index + 4u)));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; index + 8u <= count; index += 8u) {
+    // Conversion rounds to nearest and saturates.
+    auto const low = vcvtnq_s32_f32(
+        vmulq_n_f32(vld1q_f32(input + index), scale));
+    auto const high = vcvtnq_s32_f32(
+        vmulq_n_f32(vld1q_f32(input + index + 4u), scale));
+    vst1q_s16(
+        output + index,
+        vcombine_s16(vqmovn_s32(low), vqmovn_s32(high)));
+  }
+#endif
+  for (; index < count; ++index) {
+    auto const scaled = std::min(
+        std::max(input[index] * scale, minimum), maximum);
+    output[index] = static_cast<short>(std::lrint(scaled));
+  }
+}
+
+/** \brief G.711 \f$\mu\f$-law code of one sample.
+ *
+ *  This is the reference algorithm,
+ *  used to fill the table of \ref encode_mu_law.
+ */
+constexpr std::uint8_t mu_law_code(int sample) {
+  // \f$\mu\f$-law works on 14 bits.
+  int magnitude = sample >> 2;
+  int const sign = magnitude < 0 ? 0x80 : 0x00;
+  magnitude = magnitude < 0 ? -magnitude : magnitude;
+  // Biased, and clipped to the largest code.
+  magnitude = magnitude + 0x21 > 0x1fff ? 0x1fff : magnitude + 0x21;
+  int exponent = 0;
+  while ((magnitude >> (exponent + 6)) != 0 && exponent < 7) {
+    ++exponent;
+  }
+  int const mantissa = (magnitude >> (exponent + 1)) & 0x0f;
+  return static_cast<std::uint8_t>(
+      ~(sign | (exponent << 4) | mantissa));
+}
+
+/** \brief G.711 A-law code of one sample.
+ *
+ *  This is the reference algorithm,
+ *  used to fill the table of \ref encode_a_law.
+ */
+constexpr std::uint8_t a_law_code(int sample) {
+  // A-law works on 13 bits.
+  int magnitude = sample >> 3;
+  int const sign = magnitude >= 0 ? 0x80 : 0x00;
+  magnitude = magnitude < 0 ? -magnitude - 1 : magnitude;
+  int code = 0;
+  if (magnitude < 32) {
+    code = magnitude >> 1;
+  } else {
+    int exponent = 1;
+    while (magnitude >= 64 && exponent < 7) {
+      magnitude >>= 1;
+      ++exponent;
+    }
+    code = (exponent << 4) | ((magnitude >> 1) & 0x0f);
+  }
+  return static_cast<std::uint8_t>((sign | code) ^ 0x55);
+}
+
+/** \brief Encodes `count` samples as G.711 \f$\mu\f$-law.
+ *
+ *  The segment search of G.711 has no efficient vector form,
+ *  so this uses a 16 KiB table indexed by the top 14 bits,
+ *  which is all \f$\mu\f$-law keeps and fits in the L1 cache.
+ */
+inline void encode_mu_law(
+    short const* input, std::uint8_t* output, std::size_t count) {
+  static auto const table = [] {
+    std::array<std::uint8_t, 1u << 14> codes{};
+    for (int index = 0; index < (1 << 14); ++index) {
+      codes[static_cast<std::size_t>(index)] =
+          mu_law_code((index - (1 << 13)) * 4);
+    }
+    return codes;
+  }();
+  for (std::size_t index = 0u; index < count; ++index) {
+    output[index] = table[static_cast<std::size_t>(
+        (static_cast<int>(input[index]) >> 2) + (1 << 13))];
+  }
+}
+
+/** \brief Encodes `count` samples as G.711 A-law.
+ *
+ *  Uses an 8 KiB table indexed by the top 13 bits,
+ *  for the same reason as \ref encode_mu_law.
+ */
+inline void encode_a_law(
+    short const* input, std::uint8_t* output, std::size_t count) {
+  static auto const table = [] {
+    std::array<std::uint8_t, 1u << 13> codes{};
+    for (int index = 0; index < (1 << 13); ++index) {
+      codes[static_cast<std::size_t>(index)] =
+          a_law_code((index - (1 << 12)) * 8);
+    }
+    return codes;
+  }();
+  for (std::size_t index = 0u; index < count; ++index) {
+    output[index] = table[static_cast<std::size_t>(
+        (static_cast<int>(input[index]) >> 3) + (1 << 12))];
+  }
+}
+
+/** \brief Streaming rational resampler using a polyphase FIR filter.
+ *
+ *  \par Method
+ *  Resampling from `input_rate` to `output_rate`
+ *  is upsampling by `L` and downsampling by `M`,
+ *  with `L / M` the reduced ratio of the rates.
+ *  The low-pass filter between them is a Blackman-windowed sinc
+ *  of `L * taps_per_phase` coefficients,
+ *  split into `L` phases so that only the coefficients
+ *  contributing to each output sample are ever multiplied.
+ *
+ *  \par Streaming
+ *  The last `taps_per_phase - 1` input samples are kept between calls,
+ *  so that chunks can be resampled one at a time
+ *  with the same result as resampling everything at once.
+ *  Input is converted to floats straight into the filter's window,
+ *  which is the only copy made of it.
+ *  The output is delayed by half the filter length,
+ *  `taps_per_phase / 2` input samples,
+ *  which \ref flush gives out at the end of the input.
+ */
+class polyphase_resampler {
+public:
+  /** \brief Prepares to resample from `input_rate` to `output_rate`.
+   *
+   *  \exception std::invalid_argument
+   *  If either rate is not positive.
+   */
+  polyphase_resampler(
+      int input_rate, int output_rate, std::size_t taps_per_phase = 32u)
+      : taps_per_phase{taps_per_phase} {
+    if (input_rate <= 0 || output_rate <= 0) {
+      throw std::invalid_argument("Sample rates must be positive");
+    }
+    assert(taps_per_phase > 0u);
+    auto const divisor = std::gcd(input_rate, output_rate);
+    up = static_cast<std::size_t>(output_rate / divisor);
+    down = static_cast<std::size_t>(input_rate / divisor);
+    design_filter();
+    window.assign(taps_per_phase - 1u, 0.0f);
+    position = taps_per_phase - 1u;
+  }
+
+  /** \brief Upper bound of output samples for `input_count` inputs. */
+  std::size_t max_output(std::size_t input_count) const {
+    return (input_count * up) / down + 2u;
+  }
+
+  /** \brief Resamples `count` samples of `input`, scaled by `scale`.
+   *
+   *  \return Number of samples written to `output`,
+   *  which must have room for `max_output(count)`.
+   */
+  std::size_t process(
+      short const* input, std::size_t count, float scale,
+      float* output) {
+    auto const history = taps_per_phase - 1u;
+    window.resize(history + count);
+    convert_s16_to_f32(input, window.data() + history, count, scale);
+    return filter(output);
+  }
+
+  /** \brief Number of input samples the output lags behind. */
+  std::size_t delay() const { return taps_per_phase / 2u; }
+
+  /** \brief Resamples the inputs still delayed, as if followed by
+   *  silence.
+   *
+   *  \return Number of samples written to `output`,
+   *  which must have room for `max_output(delay())`.
+   *  Must only be called once, after the last \ref process.
+   */
+  std::size_t flush(float* output) {
+    window.resize(taps_per_phase - 1u + delay(), 0.0f);
+    return filter(output);
+  }
+
+private:
+  /** \brief Resamples the inputs after the history in \ref window,
+   *  keeping the history needed by the next chunk.
+   */
+  std::size_t filter(float* output) {
+    auto const history = taps_per_phase - 1u;
+    std::size_t written = 0u;
+    while (position < window.size()) {
+      auto const* const taps =
+          coefficients.data() + phase * taps_per_phase;
+      auto const* const samples = window.data() + position - history;
+      float sum = 0.0f;
+      for (std::size_t tap = 0u; tap < taps_per_phase; ++tap) {
+        sum += taps[tap] * samples[tap];
+      }
+      output[written++] = sum;
+      phase += down;
+      position += phase / up;
+      phase %= up;
+    }
+
+    // Keep the history needed by the next chunk.
+    auto const kept_from = window.size() - history;
+    std::copy(
+        window.begin() + static_cast<std::ptrdiff_t>(kept_from),
+        window.end(), window.begin());
+    window.resize(history);
+    position -= kept_from;
+    return written;
+  }
+
+  /** \brief Fills \ref coefficients, reversed within each phase.
+   *
+   *  Reversing lets \ref process walk the window forwards.
+   */
+  void design_filter() {
+    constexpr double pi = 3.14159265358979323846;
+    auto const length = up * taps_per_phase;
+    // Cut off just below the lower Nyquist frequency,
+    // in cycles per sample at the upsampled rate.
+    auto const cutoff =
+        0.95 * 0.5 * std::min(1.0, static_cast<double>(up) / down) / up;
+    auto const centre = (static_cast<double>(length) - 1.0) / 2.0;
+    coefficients.assign(length, 0.0f);
+    for (std::size_t index = 0u; index < length; ++index) {
+      auto const offset = static_cast<double>(index) - centre;
+      auto const sinc =
+          offset == 0.0
+              ? 2.0 * cutoff
+              : std::sin(2.0 * pi * cutoff * offset) / (pi * offset);
+      auto const last = static_cast<double>(length - 1u);
+      auto const turn =
+          length > 1u ? static_cast<double>(index) / last : 0.5;
+      auto const blackman = 0.42 - 0.5 * std::cos(2.0 * pi * turn) +
+                            0.08 * std::cos(4.0 * pi * turn);
+      // Upsampling spreads each sample's energy over `up` outputs.
+      auto const value = static_cast<float>(sinc * blackman * up);
+      auto const phase_index = index % up;
+      auto const tap = index / up;
+      coefficients[phase_index * taps_per_phase +
+                   (taps_per_phase - 1u - tap)] = value;
+    }
+  }
+
+  std::size_t const taps_per_phase;
+  /** \brief Upsampling factor `L`. */
+  std::size_t up{1u};
+  /** \brief Downsampling factor `M`. */
+  std::size_t down{1u};
+  /** \brief `up` phases of `taps_per_phase` coefficients each. */
+  std::vector<float> coefficients;
+  /** \brief History followed by the chunk being resampled. */
+  std::vector<float> window;
+  /** \brief Index in \ref window of the last input of the next output.
+   */
+  std::size_t position{0u};
+  /** \brief Phase of the next output, from `0` to `up - 1`. */
+  std::size_t phase{0u};
+};
+
+/** \brief What to convert synthesised samples to. */
+struct conversion {
+  /** \brief Sample rate to resample to, or `0` to keep the input's. */
+  int output_rate{0};
+  /** \brief Encoding of the output. */
+  sample_format format{sample_format::s16};
+  /** \brief Factor all samples are multiplied by. */
+  float gain{1.0f};
+};
+
+/** \brief Converts samples and writes them to a file sink.
+ *
+ *  \par Purpose
+ *  Telephony wants 8 kHz G.711 and WebRTC 48 kHz floats,
+ *  while eSpeak NG produces 16-bit samples at its own rate.
+ *  This sits between the synthesis callback and a file sink,
+ *  converting each chunk as it arrives.
+ *
+ *  \par Copies
+ *  Without resampling, gain or re-encoding,
+ *  chunks are passed straight through.
+ *  Otherwise, each stage writes into buffers kept across chunks,
+ *  so that steady-state conversion does not allocate,
+ *  and uses the vector kernels named by \ref simd_name.
+ */
+class conversion_sink : public sink {
+public:
+  /** \brief Converts samples at `input_rate` and writes to `output`.
+   *
+   *  `output` must expect samples in `settings.format`
+   *  at the output rate.
+   */
+  conversion_sink(
+      conversion const& settings, int input_rate,
+      std::unique_ptr<raw_file_sink> output)
+      : settings{settings}, output{std::move(output)} {
+    if (settings.output_rate != 0 &&
+        settings.output_rate != input_rate) {
+      resampler.emplace(input_rate, settings.output_rate);
+    }
+  }
+
+  void write(short const* samples, std::size_t sample_count) override {
+    auto const is_float_needed = resampler || settings.gain != 1.0f ||
+                                 settings.format == sample_format::f32;
+    if (!is_float_needed) {
+      write_encoded(samples, sample_count);
+      return;
+    }
+    auto const scale = settings.gain / 32768.0f;
+    std::size_t count = sample_count;
+    if (resampler) {
+      floats.resize(resampler->max_output(sample_count));
+      count = resampler->process(
+          samples, sample_count, scale, floats.data());
+    } else {
+      floats.resize(sample_count);
+      convert_s16_to_f32(samples, floats.data(), sample_count, scale);
+    }
+    write_floats(count);
+  }
+
+  /** \brief Writes what the resampler still holds, then finishes. */
+  void finish() override {
+    if (resampler) {
+      floats.resize(resampler->max_output(resampler->delay()));
+      auto const count = resampler->flush(floats.data());
+      write_floats(count);
+    }
+    output->finish();
+  }
+
+private:
+  /** \brief Writes the first `count` of \ref floats. */
+  void write_floats(std::size_t count) {
+    if (settings.format == sample_format::f32) {
+      output->write_bytes(floats.data(), count * sizeof(float));
+      return;
+    }
+    integers.resize(count);
+    convert_f32_to_s16(floats.data(), integers.data(), count);
+    write_encoded(integers.data(), count);
+  }
+
+  /** \brief Writes 16-bit samples in the output format. */
+  void write_encoded(short const* samples, std::size_t count) {
+    switch (settings.format) {
+    case sample_format::s16:
+    // Floats are always written by `write` instead.
+    case sample_format::f32:
+      output->write(samples, count);
+      return;
+    case sample_format::mu_law:
+      codes.resize(count);
+      encode_mu_law(samples, codes.data(), count);
+      break;
+    case sample_format::a_law:
+      codes.resize(count);
+      encode_a_law(samples, codes.data(), count);
+      break;
+    }
+    output->write_bytes(codes.data(), codes.size());
+  }
+
+  conversion const settings;
+  std::unique_ptr<raw_file_sink> const output;
+  std::optional<polyphase_resampler> resampler;
+  /** \brief Reused between chunks. */
+  std::vector<float> floats;
+  std::vector<short> integers;
+  std::vector<std::uint8_t> codes;
+};
+
+/** \brief Parses `s16`, `f32`, `mulaw` or `alaw`.
+ *
+ *  \exception std::invalid_argument
+ *  If `name` is none of those.
+ */
+inline sample_format parse_sample_format(std::string const& name) {
+  if (name == "s16") {
+    return sample_format::s16;
+  }
+  if (name == "f32") {
+    return sample_format::f32;
+  }
+  if (name == "mulaw") {
+    return sample_format::mu_law;
+  }
+  if (name == "alaw") {
+    return sample_format::a_law;
+  }
+  throw std::invalid_argument("Unknown sample format: " + name);
+}
+
+/** \brief Opens a file sink at `path` converting as in `settings`.
+ *
+ *  Samples given to the sink are at `input_rate`.
+ *  The file is chosen as by \ref make_file_sink,
+ *  and has no conversion stage if none is needed.
+ */
+inline std::unique_ptr<sink> make_file_sink(
+    std::string const& path, int input_rate,
+    conversion const& settings) {
+  auto const output_rate =
+      settings.output_rate != 0 ? settings.output_rate : input_rate;
+  auto file = make_file_sink(path, output_rate, settings.format);
+  if (output_rate == input_rate && settings.gain == 1.0f &&
+      settings.format == sample_format::s16) {
+    return file;
+  }
+  return std::make_unique<conversion_sink>(
+      settings, input_rate, std::move(file));
+}
+
+} // namespace audio
@@ -0,0 +1,716 @@
+#pragma once
+
+// Local dependencies.
+#include "boni.hpp"
+
+// Standard C++ libraries.
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Standard C libraries.
+#include <cstddef>
+#include <cstdio>
+
+/** \brief Destinations for synthesised audio.
+ *
+ *  Synthesis produces mono signed 16-bit samples in chunks.
+ *  The sinks here accept those chunks
+ *  without caring where they came from,
+ *  so that synthesis can be played, written to files or kept in memory
+ *  without the synthesis code having to know which.
+ */
+namespace audio {
+
+/** \brief Accepts chunks of samples. */
+class sink {
+public:
+  virtual ~sink() = default;
+
+  /** \brief Takes the next `sample_count` samples.
+   *
+   *  The samples are only valid during the call.
+   */
+  virtual void
+  write(short const* samples, std::size_t sample_count) = 0;
+
+  /** \brief Called once after the last \ref write.
+   *
+   *  Sinks that need to complete their output,
+   *  such as by writing a header or waiting for playback,
+   *  do it here.
+   */
+  virtual void finish() {}
+
+  /** \brief Passes on samples held back, at the end of an utterance.
+   *
+   *  Writing may continue afterwards.
+   *  Sinks that hold nothing back do nothing.
+   */
+  virtual void flush() {}
+
+  /** \brief Drops samples written but not yet output, if it can.
+   *
+   *  Called when the rest of an utterance is abandoned,
+   *  so that it stops being heard as soon as possible.
+   *  Writing may continue afterwards.
+   *  Sinks that output samples as soon as written do nothing.
+   */
+  virtual void discard_pending() {}
+};
+
+/** \brief Samples in each block of a \ref pcm_buffer. */
+constexpr std::size_t block_sample_count = 8192u;
+
+/** \brief Fixed-size storage for part of a \ref pcm_buffer. */
+struct sample_block {
+  /** \brief The following block of the same buffer, if any. */
+  sample_block* next{nullptr};
+  /** \brief Number of leading `samples` in use. */
+  std::size_t used{0u};
+  short samples[block_sample_count];
+};
+
+/** \brief Recycles \ref sample_block storage between buffers.
+ *
+ *  Blocks released by one synthesis are reused by the next,
+ *  so that steady-state synthesis does not allocate at all.
+ *  Up to `max_free_count` released blocks are kept,
+ *  and any more are freed.
+ *  It is safe to use from any thread.
+ */
+class block_pool {
+public:
+  /** \brief Number of free blocks kept for reuse, 8 MiB. */
+  static constexpr std::size_t max_free_count = 512u;
+
+  block_pool() = default;
+  block_pool(block_pool const&) = delete;
+  block_pool& operator=(block_pool const&) = delete;
+
+  ~block_pool() {
+    while (free_blocks != nullptr) {
+      delete std::exchange(free_blocks, free_blocks->next);
+    }
+  }
+
+  /** \brief Returns an empty block, reused if possible. */
+  sample_block* acquire() {
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      if (free_blocks != nullptr) {
+        auto const reused =
+            std::exchange(free_blocks, free_blocks->next);
+        --free_count;
+        reused->next = nullptr;
+        reused->used = 0u;
+        return reused;
+      }
+    }
+    return new sample_block;
+  }
+
+  /** \brief Takes back the list of blocks starting at `first`. */
+  void release(sample_block* first) {
+    std::unique_lock<std::mutex> lock{mutex};
+    while (first != nullptr && free_count < max_free_count) {
+      auto const next = first->next;
+      first->next = free_blocks;
+      free_blocks = first;
+      ++free_count;
+      first = next;
+    }
+    lock.unlock();
+    while (first != nullptr) {
+      delete std::exchange(first, first->next);
+    }
+  }
+
+  /** \brief The pool shared by all buffers of the program. */
+  static block_pool& global() {
+    static block_pool instance;
+    return instance;
+  }
+
+private:
+  std::mutex mutex;
+  /** \brief Singly linked through \ref sample_block::next. */
+  sample_block* free_blocks{nullptr};
+  std::size_t free_count{0u};
+};
+
+/** \brief Samples kept in a linked list of fixed-size blocks.
+ *
+ *  \par Purpose
+ *  Appending synthesis output to a `std::vector`
+ *  reallocates and copies everything received so far
+ *  whenever it outgrows its capacity.
+ *  This instead fills blocks from \ref block_pool::global in turn,
+ *  so each sample is copied once, into its block, and never moved.
+ *  Clearing or destroying the buffer
+ *  hands all of its blocks back to the pool at once.
+ *
+ *  \par Usage
+ *  Consumers receive the samples one contiguous chunk at a time,
+ *  through \ref for_each_chunk, or \ref write_to for a \ref sink,
+ *  instead of as one array.
+ *  ```cpp
+ *  audio::pcm_buffer buffer;
+ *  buffer.append(samples, sample_count);
+ *  buffer.for_each_chunk([](short const* chunk, std::size_t count) {
+ *    send(chunk, count);
+ *  });
+ *  ```
+ */
+class pcm_buffer {
+public:
+  pcm_buffer() = default;
+  pcm_buffer(pcm_buffer const&) = delete;
+  pcm_buffer& operator=(pcm_buffer const&) = delete;
+
+  pcm_buffer(pcm_buffer&& other) noexcept
+      : first{std::exchange(other.first, nullptr)},
+        last{std::exchange(other.last, nullptr)},
+        sample_count{std::exchange(other.sample_count, 0u)} {}
+
+  pcm_buffer& operator=(pcm_buffer&& other) noexcept {
+    if (this != &other) {
+      clear();
+      first = std::exchange(other.first, nullptr);
+      last = std::exchange(other.last, nullptr);
+      sample_count = std::exchange(other.sample_count, 0u);
+    }
+    return *this;
+  }
+
+  ~pcm_buffer() { clear(); }
+
+  /** \brief Copies `count` samples to the end of the buffer. */
+  void append(short const* samples, std::size_t count) {
+    sample_count += count;
+    while (count > 0u) {
+      if (last == nullptr || last->used == block_sample_count) {
+        auto const block = block_pool::global().acquire();
+        (last == nullptr ? first : last->next) = block;
+        last = block;
+      }
+      auto const copied =
+          std::min(count, block_sample_count - last->used);
+      std::copy(samples, samples + copied, last->samples + last->used);
+      last->used += copied;
+      samples += copied;
+      count -= copied;
+    }
+  }
+
+  /** \brief Removes all samples, returning their blocks to the pool. */
+  void clear() {
+    if (first != nullptr) {
+      block_pool::global().release(first);
+    }
+    first = nullptr;
+    last = nullptr;
+    sample_count = 0u;
+  }
+
+  /** \brief Number of samples in the buffer. */
+  std::size_t size() const { return sample_count; }
+
+  bool empty() const { return sample_count == 0u; }
+
+  /** \brief Bytes of blocks held, including unused parts. */
+  std::size_t capacity_in_bytes() const {
+    std::size_t block_count = 0u;
+    for (auto block = first; block != nullptr; block = block->next) {
+      ++block_count;
+    }
+    return block_count * sizeof(sample_block);
+  }
+
+  /** \brief Calls `on_chunk(samples, count)` for each block in order.
+   *
+   *  Chunks are never empty.
+   */
+  template <typename chunk_function>
+  void for_each_chunk(chunk_function&& on_chunk) const {
+    for (auto block = first; block != nullptr; block = block->next) {
+      if (block->used > 0u) {
+        on_chunk(
+            static_cast<short const*>(block->samples), block->used);
+      }
+    }
+  }
+
+  /** \brief Calls `on_chunk(samples, count)` for each part of a block
+   *  holding samples from `begin` up to `end`, in order.
+   *
+   *  Chunks are never empty.
+   *  Samples past the end of the buffer are ignored.
+   */
+  template <typename chunk_function>
+  void for_each_chunk_in(
+      std::size_t begin, std::size_t end,
+      chunk_function&& on_chunk) const {
+    std::size_t block_start = 0u;
+    for (auto block = first; block != nullptr && block_start < end;
+         block = block->next) {
+      auto const block_end = block_start + block->used;
+      auto const from = std::max(begin, block_start);
+      auto const to = std::min(end, block_end);
+      if (from < to) {
+        on_chunk(
+            static_cast<short const*>(block->samples) +
+                (from - block_start),
+            to - from);
+      }
+      block_start = block_end;
+    }
+  }
+
+  /** \brief Writes all samples to `destination`, chunk by chunk. */
+  void write_to(sink& destination) const {
+    for_each_chunk(
+        [&destination](short const* chunk, std::size_t count) {
+          destination.write(chunk, count);
+        });
+  }
+
+private:
+  sample_block* first{nullptr};
+  sample_block* last{nullptr};
+  std::size_t sample_count{0u};
+};
+
+/** \brief Keeps all samples in memory. */
+class memory_sink : public sink {
+public:
+  void write(short const* samples, std::size_t sample_count) override {
+    this->samples.insert(
+        this->samples.end(), samples, samples + sample_count);
+  }
+
+  /** \brief All samples written so far. */
+  std::vector<short> samples;
+};
+
+/** \brief Passes samples on only in whole blocks of a fixed size.
+ *
+ *  \par Purpose
+ *  eSpeak NG gives samples in small chunks of irregular size,
+ *  and every chunk costs each sink a hand-off,
+ *  whether a ring buffer update, a lock, a system call
+ *  or an encoder invocation.
+ *  This collects them into blocks of `block_size` samples,
+ *  say a device period or a network frame,
+ *  so that the sink behind it sees fewer, larger writes,
+ *  each a whole number of blocks.
+ *
+ *  \par Copies
+ *  Only the samples completing a partial block, or left over,
+ *  are copied into the block held.
+ *  Whole blocks in a chunk are passed on in place, in one write.
+ *
+ *  \par Flushing
+ *  The partial block left at the end of an utterance is passed on
+ *  by \ref flush, which `SynthCallback` calls on completion,
+ *  or by \ref finish.
+ */
+class coalescing_sink final : public sink {
+public:
+  /** \brief Writes blocks of `block_size` samples to `output`.
+   *
+   *  \exception std::invalid_argument
+   *  If `block_size` is zero.
+   */
+  coalescing_sink(std::unique_ptr<sink> output, std::size_t block_size)
+      : output{std::move(output)}, block(block_size) {
+    if (block_size == 0u) {
+      throw std::invalid_argument("Coalescing block size is zero");
+    }
+  }
+
+  void write(short const* samples, std::size_t sample_count) override {
+    auto const block_size = block.size();
+    if (used > 0u) {
+      auto const copied = std::min(sample_count, block_size - used);
+      std::copy(samples, samples + copied, block.data() + used);
+      used += copied;
+      samples += copied;
+      sample_count -= copied;
+      if (used < block_size) {
+        return;
+      }
+      hand_off(block.data(), block_size);
+      used = 0u;
+    }
+    auto const whole_size = sample_count - sample_count % block_size;
+    if (whole_size > 0u) {
+      hand_off(samples, whole_size);
+    }
+    std::copy(
+        samples + whole_size, samples + sample_count, block.data());
+    used = sample_count - whole_size;
+  }
+
+  void flush() override {
+    if (used > 0u) {
+      hand_off(block.data(), std::exchange(used, 0u));
+    }
+    output->flush();
+  }
+
+  void finish() override {
+    flush();
+    output->finish();
+  }
+
+  void discard_pending() override {
+    used = 0u;
+    output->discard_pending();
+  }
+
+  /** \brief Number of writes made to the sink behind this. */
+  std::uint64_t hand_offs() const { return hand_off_count; }
+
+private:
+  void hand_off(short const* samples, std::size_t sample_count) {
+    output->write(samples, sample_count);
+    ++hand_off_count;
+  }
+
+  std::unique_ptr<sink> const output;
+  /** \brief The partial block, in its first \ref used samples. */
+  std::vector<short> block;
+  std::size_t used{0u};
+  std::uint64_t hand_off_count{0u};
+};
+
+/** \brief Joins pieces of audio with short crossfades.
+ *
+ *  \par Purpose
+ *  Pieces cut from separate syntheses rarely meet at the same level,
+ *  so playing them end to end clicks at every join.
+ *  Here, the last `crossfade_size` samples of each piece are held back
+ *  and faded out linearly while the next piece is faded in.
+ *  Each join makes the audio shorter by the crossfade.
+ *
+ *  \par Usage
+ *  It does not own `output`, which must outlive it,
+ *  so it can be put in front of any sink for just one prompt.
+ *  ```cpp
+ *  audio::splicing_sink spliced{output, 110u};
+ *  first_piece.write_to(spliced);
+ *  spliced.splice();
+ *  second_piece.write_to(spliced);
+ *  spliced.flush();
+ *  ```
+ */
+class splicing_sink : public sink {
+public:
+  splicing_sink(sink& output, std::size_t crossfade_size)
+      : output{output}, crossfade_size{crossfade_size} {}
+
+  /** \brief Makes the next \ref write start a new piece. */
+  void splice() {
+    release_fade();
+    fading_out.swap(held);
+    held.clear();
+    fade_position = 0u;
+  }
+
+  void write(short const* samples, std::size_t sample_count) override {
+    if (fade_position < fading_out.size()) {
+      auto const mixed_count =
+          std::min(sample_count, fading_out.size() - fade_position);
+      mixed.resize(mixed_count);
+      auto const steps = static_cast<float>(fading_out.size() + 1u);
+      for (std::size_t index = 0u; index < mixed_count; ++index) {
+        auto const position = fade_position + index;
+        auto const weight = static_cast<float>(position + 1u) / steps;
+        mixed[index] = static_cast<short>(
+            static_cast<float>(fading_out[position]) * (1.0f - weight) +
+            static_cast<float>(samples[index]) * weight);
+      }
+      fade_position += mixed_count;
+      hold(mixed.data(), mixed_count);
+      samples += mixed_count;
+      sample_count -= mixed_count;
+    }
+    hold(samples, sample_count);
+  }
+
+  /** \brief Writes the end of the last piece, with no crossfade. */
+  void flush() override {
+    release_fade();
+    if (!held.empty()) {
+      output.write(held.data(), held.size());
+      held.clear();
+    }
+    output.flush();
+  }
+
+  void finish() override {
+    flush();
+    output.finish();
+  }
+
+  void discard_pending() override {
+    held.clear();
+    fading_out.clear();
+    fade_position = 0u;
+    output.discard_pending();
+  }
+
+private:
+  /** \brief Appends to \ref held, writing all but its last samples. */
+  void hold(short const* samples, std::size_t sample_count) {
+    held.insert(held.end(), samples, samples + sample_count);
+    if (held.size() > crossfade_size) {
+      auto const released = held.size() - crossfade_size;
+      output.write(held.data(), released);
+      held.erase(
+          held.begin(),
+          held.begin() + static_cast<std::ptrdiff_t>(released));
+    }
+  }
+
+  /** \brief Keeps what a piece too short to cover its fade left.
+   *
+   *  The rest of the previous piece carries on after it, unfaded.
+   */
+  void release_fade() {
+    if (fade_position < fading_out.size()) {
+      hold(
+          fading_out.data() + fade_position,
+          fading_out.size() - fade_position);
+    }
+    fading_out.clear();
+    fade_position = 0u;
+  }
+
+  sink& output;
+  std::size_t const crossfade_size;
+  /** \brief End of the current piece, not yet written. */
+  std::vector<short> held;
+  /** \brief End of the previous piece, being faded out. */
+  std::vector<short> fading_out;
+  /** \brief Samples of \ref fading_out already mixed. */
+  std::size_t fade_position{0u};
+  /** \brief Reused between writes. */
+  std::vector<short> mixed;
+};
+
+/** \brief Encodings samples can be written in. */
+enum class sample_format {
+  /** \brief Signed 16-bit, as produced by eSpeak NG. */
+  s16,
+  /** \brief 32-bit float from `-1` to `1`. */
+  f32,
+  /** \brief 8-bit G.711 \f$\mu\f$-law, for telephony. */
+  mu_law,
+  /** \brief 8-bit G.711 A-law, for telephony. */
+  a_law,
+};
+
+/** \brief Bytes taken by one sample in `format`. */
+constexpr std::size_t bytes_per_sample(sample_format format) {
+  return format == sample_format::s16   ? 2u
+         : format == sample_format::f32 ? 4u
+                                        : 1u;
+}
+
+/** \brief Bytes of stdio buffer used by the file sinks.
+ *
+ *  Synthesis chunks are typically a few hundred samples.
+ *  A large buffer turns them into few large `write` system calls.
+ */
+constexpr std::size_t file_buffer_size = std::size_t{1u} << 20;
+
+/** \brief Writes samples as headerless native-endian PCM.
+ *
+ *  Samples already encoded in another \ref sample_format,
+ *  say by a conversion stage, are written with \ref write_bytes.
+ */
+class raw_file_sink : public sink {
+public:
+  /** \brief Creates, or truncates, the file at `path`.
+   *
+   *  \exception std::runtime_error
+   *  If the file cannot be opened.
+   */
+  explicit raw_file_sink(std::string const& path)
+      : buffer{new char[file_buffer_size]},
+        file{std::fopen(path.c_str(), "wb")} {
+    if (file.get() == nullptr) {
+      throw std::runtime_error("Unable to open file: " + path);
+    }
+    std::setvbuf(file, buffer.get(), _IOFBF, file_buffer_size);
+  }
+
+  void write(short const* samples, std::size_t sample_count) override {
+    write_bytes(samples, sample_count * sizeof(short));
+  }
+
+  /** \brief Appends `size` bytes of encoded samples. */
+  void write_bytes(void const* data, std::size_t size) {
+    if (size != std::fwrite(data, 1u, size, file)) {
+      throw std::runtime_error("Unable to write samples");
+    }
+    written_size += size;
+  }
+
+  void finish() override {
+    if (0 != std::fflush(file)) {
+      throw std::runtime_error("Unable to write samples");
+    }
+  }
+
+  /** \brief Number of bytes of samples written so far. */
+  std::uint64_t size_in_bytes() const { return written_size; }
+
+protected:
+  /** \brief Storage given to `setvbuf`. Must outlive \ref file. */
+  std::unique_ptr<char[]> buffer;
+  /** \brief The file written to. */
+  boni::file file;
+  /** \brief Number of bytes of samples written so far. */
+  std::uint64_t written_size{0u};
+};
+
+/** \brief Writes samples as a mono WAV file.
+ *
+ *  A header with zero sizes is written on construction,
+ *  and rewritten with the real sizes once in \ref finish,
+ *  so that samples can be streamed without knowing the total up front.
+ *  The header is little-endian as required by the format.
+ *  Samples are written in native order,
+ *  which is little-endian on all platforms eSpeak NG is used on.
+ */
+class wav_file_sink : public raw_file_sink {
+public:
+  /** \brief Creates, or truncates, the file at `path`.
+   *
+   *  \param format
+   *  How the samples given to \ref write_bytes are encoded.
+   *  Samples given to \ref write must be \ref sample_format::s16.
+   *  \exception std::runtime_error
+   *  If the file cannot be opened or written.
+   */
+  wav_file_sink(
+      std::string const& path, int sample_rate,
+      sample_format format = sample_format::s16)
+      : raw_file_sink{path}, sample_rate{sample_rate}, format{format} {
+    write_header();
+  }
+
+  void finish() override {
+    // RIFF chunks are padded to an even size,
+    // which only 8-bit samples can break.
+    if (written_size % 2u != 0u && std::fputc(0, file) == EOF) {
+      throw std::runtime_error("Unable to write WAV padding");
+    }
+    if (0 != std::fseek(file, 0, SEEK_SET)) {
+      throw std::runtime_error("Unable to rewrite WAV header");
+    }
+    write_header();
+    raw_file_sink::finish();
+  }
+
+private:
+  /** \brief Size of the largest header written. */
+  static constexpr std::size_t max_header_size = 46u;
+
+  /** \brief Writes the header for the samples written so far.
+   *
+   *  Formats other than PCM get the 18-byte `fmt ` chunk
+   *  the specification asks for, with no extension.
+   */
+  void write_header() {
+    auto const is_pcm = format == sample_format::s16;
+    std::uint32_t const format_size = is_pcm ? 16u : 18u;
+    auto const header_size = 28u + format_size;
+    auto const data_size = static_cast<std::uint32_t>(written_size);
+    auto const sample_size =
+        static_cast<std::uint32_t>(bytes_per_sample(format));
+    std::uint32_t format_tag = 1u; // PCM.
+    switch (format) {
+    case sample_format::s16:
+      break;
+    case sample_format::f32:
+      format_tag = 3u; // IEEE float.
+      break;
+    case sample_format::a_law:
+      format_tag = 6u;
+      break;
+    case sample_format::mu_law:
+      format_tag = 7u;
+      break;
+    }
+    std::array<unsigned char, max_header_size> header{};
+    auto position = header.begin();
+    auto const put_text = [&position](char const* text) {
+      for (std::size_t index = 0u; index < 4u; ++index) {
+        *position++ = static_cast<unsigned char>(text[index]);
+      }
+    };
+    auto const put = [&position](std::uint32_t value, int size) {
+      for (int index = 0; index < size; ++index) {
+        *position++ = static_cast<unsigned char>(value >> (8 * index));
+      }
+    };
+    put_text("RIFF");
+    put(header_size - 8u + data_size + data_size % 2u, 4);
+    put_text("WAVE");
+    put_text("fmt ");
+    put(format_size, 4);
+    put(format_tag, 2);
+    put(1u, 2); // Mono.
+    put(static_cast<std::uint32_t>(sample_rate), 4);
+    put(static_cast<std::uint32_t>(sample_rate) * sample_size, 4);
+    put(sample_size, 2);
+    put(sample_size * 8u, 2);
+    if (!is_pcm) {
+      put(0u, 2); // No extension.
+    }
+    put_text("data");
+    put(data_size, 4);
+    if (1u != std::fwrite(header.data(), header_size, 1u, file)) {
+      throw std::runtime_error("Unable to write WAV header");
+    }
+  }
+
+  /** \brief Recorded in the header. */
+  int const sample_rate;
+  sample_format const format;
+};
+
+/** \brief Whether `path` ends in `.wav`. */
+inline bool is_wav_path(std::string const& path) {
+  auto const extension = std::string{".wav"};
+  return path.size() >= extension.size() &&
+         0 == path.compare(
+                  path.size() - extension.size(), extension.size(),
+                  extension);
+}
+
+/** \brief Opens a file sink chosen by the extension of `path`.
+ *
+ *  Paths ending in `.wav` get a \ref wav_file_sink,
+ *  and anything else a \ref raw_file_sink.
+ */
+inline std::unique_ptr<raw_file_sink> make_file_sink(
+    std::string const& path, int sample_rate,
+    sample_format format = sample_format::s16) {
+  if (is_wav_path(path)) {
+    return std::make_unique<wav_file_sink>(path, sample_rate, format);
+  }
+  return std::make_unique<raw_file_sink>(path);
+}
+
+} // namespace audio
@@ -0,0 +1,274 @@
+// Local dependencies.
+#include "audio.hpp"
+#include "boni.hpp"
+#include "espeak-ng.hpp"
+#include "instrumentation.hpp"
+#include "synthesis.hpp"
+
+// External dependencies.
+#include <espeak-ng/espeak_ng.h>
+
+// Standard C++ libraries.
+#include <algorithm>
+#include <chrono>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Standard C libraries.
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+/** \brief Clock used for all measurements. */
+using bench_clock = std::chrono::steady_clock;
+
+/** \brief One group of texts measured together. */
+struct corpus_set {
+  /** \brief Key of the set in the JSON output. */
+  char const* name;
+  /** \brief Flags given to `espeak_ng_Synthesize`. */
+  unsigned int flags;
+  std::vector<std::string> texts;
+};
+
+/** \brief The fixed texts measured.
+ *
+ *  They must not change between runs that are compared,
+ *  so that differences come from the code and not the input.
+ */
+std::vector<corpus_set> make_corpus() {
+  return {
+      corpus_set{
+          "short",
+          espeakCHARS_AUTO,
+          {"Yes.", "Hello world.", "Turn left.", "Ten percent.",
+           "Goodbye."}},
+      corpus_set{
+          "medium",
+          espeakCHARS_AUTO,
+          {"The quick brown fox jumps over the lazy dog "
+           "while the farmer watches from the gate.",
+           "Your call is important to us, "
+           "please stay on the line and an agent will be with you.",
+           "In two hundred metres, "
+           "take the second exit at the roundabout onto the high "
+           "street."}},
+      corpus_set{
+          "long",
+          espeakCHARS_AUTO,
+          {"It was the best of times, it was the worst of times, "
+           "it was the age of wisdom, it was the age of foolishness, "
+           "it was the epoch of belief, "
+           "it was the epoch of incredulity, "
+           "it was the season of Light, "
+           "it was the season of Darkness, "
+           "it was the spring of hope, it was the winter of despair, "
+           "we had everything before us, we had nothing before us, "
+           "we were all going direct to Heaven, "
+           "we were all going direct the other way."}},
+      corpus_set{
+          "ssml",
+          espeakCHARS_AUTO | espeakSSML,
+          {"<speak>Press <mark name=\"one\"/>one "
+           "for sales, or <mark name=\"two\"/>two for support."
+           "</speak>",
+           "<speak><prosody rate=\"fast\">This part is fast,"
+           "</prosody> <mark name=\"slow\"/>"
+           "<prosody rate=\"slow\">and this part is slow."
+           "</prosody></speak>"}},
+  };
+}
+
+/** \brief Sink recording when the first sample arrived.
+ *
+ *  Samples are otherwise discarded,
+ *  so that the measurement is of synthesis and the callback,
+ *  and not of whatever would consume the samples.
+ *  It is `final` so that the callback writes to it directly,
+ *  as the example does with its concrete sinks.
+ */
+class timing_sink final : public audio::sink {
+public:
+  void write(short const*, std::size_t sample_count) override {
+    if (!first_sample_time && sample_count > 0u) {
+      first_sample_time = bench_clock::now();
+    }
+    this->sample_count += sample_count;
+    byte_count += sample_count * sizeof(short);
+  }
+
+  /** \brief Time of the first non-empty \ref write, if any. */
+  std::optional<bench_clock::time_point> first_sample_time;
+  /** \brief Samples given to \ref write. */
+  std::uint64_t sample_count{0u};
+  /** \brief Bytes the callback handed over to the sink. */
+  std::uint64_t byte_count{0u};
+};
+
+/** \brief Measurements of one \ref corpus_set. */
+struct set_result {
+  /** \brief Time to first sample of each synthesis, in seconds. */
+  std::vector<double> first_sample_seconds;
+  /** \brief Time spent in \ref synthesise_to, in seconds. */
+  double wall_seconds{0.0};
+  std::uint64_t sample_count{0u};
+  /** \brief Bytes copied by the callback into sink and recording. */
+  std::uint64_t copied_bytes{0u};
+  std::uint64_t callback_count{0u};
+  std::uint64_t synthesis_count{0u};
+};
+
+/** \brief Returns the `fraction` quantile by nearest rank.
+ *
+ *  `values` is sorted in place.
+ */
+double percentile(std::vector<double>& values, double fraction) {
+  if (values.empty()) {
+    return 0.0;
+  }
+  std::sort(values.begin(), values.end());
+  auto const rank = static_cast<std::size_t>(
+      std::ceil(fraction * static_cast<double>(values.size())));
+  return values[std::max<std::size_t>(rank, 1u) - 1u];
+}
+
+/** \brief Synthesises every text of `set` `iterations` times.
+ *
+ *  Output is recorded as the default mode of the example does,
+ *  so that copies made for the cache are included in the figures.
+ */
+set_result measure(corpus_set const& set, std::size_t iterations) {
+  set_result result;
+  for (std::size_t count = 0u; count < iterations; ++count) {
+    for (auto const& text : set.texts) {
+      timing_sink sink;
+      espeak_ng::synthesis_output recording;
+      basic_synthesis_destination<timing_sink> destination{
+          &sink, &recording};
+      // Counted by the synthesis callback itself.
+      auto const& callbacks =
+          instrumentation::local_metrics().callback_count;
+      auto const calls_before = callbacks.load();
+      auto const start = bench_clock::now();
+      espeak_ng::throw_if_not_ok(
+          synthesise_to(text, set.flags, destination));
+      auto const end = bench_clock::now();
+      result.wall_seconds +=
+          std::chrono::duration<double>(end - start).count();
+      result.first_sample_seconds.push_back(
+          std::chrono::duration<double>(
+              sink.first_sample_time.value_or(end) - start)
+              .count());
+      result.sample_count += sink.sample_count;
+      result.copied_bytes +=
+          sink.byte_count +
+          recording.samples.size() * sizeof(short);
+      result.callback_count += callbacks.load() - calls_before;
+      ++result.synthesis_count;
+    }
+  }
+  return result;
+}
+
+/** \brief Measures synthesis of a fixed corpus and prints JSON.
+ *
+ *  Usage:
+ *  `espeak-ng-example-bench [--iterations count] [--output path]`
+ *
+ *  Each text is synthesised `count` times, 20 by default,
+ *  without an audio device.
+ *  The results are written to `path`, or standard output,
+ *  as one JSON object keyed by corpus set,
+ *  along with the eSpeak NG version they were measured with.
+ *  Times are in milliseconds
+ *  and the real-time factor is wall time over audio duration,
+ *  so below 1 is faster than real time.
+ *  Errors, such as an output that cannot be opened,
+ *  are printed and exit with failure.
+ */
+int main(int argc, char* argv[]) {
+  std::size_t iterations = 20u;
+  std::string output_path;
+  try {
+    for (int index = 1; index < argc; ++index) {
+      auto const argument = std::string{argv[index]};
+      if (argument == "--iterations" && index + 1 < argc) {
+        iterations =
+            boni::parse_number<std::size_t>(argument, argv[++index]);
+      } else if (argument == "--output" && index + 1 < argc) {
+        output_path = argv[++index];
+      } else {
+        throw std::invalid_argument("Unknown argument: " + argument);
+      }
+    }
+    if (iterations == 0u) {
+      throw std::invalid_argument("--iterations must be positive");
+    }
+
+    espeak_ng_InitializePath(nullptr);
+    espeak_ng::service service;
+    espeak_ng::throw_if_not_ok(espeak_ng_InitializeOutput(
+        ENOUTPUT_MODE_SYNCHRONOUS, 0, nullptr));
+    auto const sample_rate = espeak_ng_GetSampleRate();
+    espeak_ng::synthesis_options const voice;
+    espeak_ng::throw_if_not_ok(
+        espeak_ng_SetVoiceByName(voice.voice_name.c_str()));
+
+    boni::file output_file;
+    if (!output_path.empty()) {
+      output_file.reset(std::fopen(output_path.c_str(), "w"));
+      if (output_file.get() == nullptr) {
+        throw std::runtime_error("Unable to open file: " + output_path);
+      }
+    }
+    std::FILE* const output =
+        output_file.get() != nullptr ? output_file.get() : stdout;
+
+    std::fprintf(
+        output,
+        "{\n  \"espeak_ng_version\": \"%s\",\n"
+        "  \"sample_rate\": %d,\n  \"iterations\": %zu,\n"
+        "  \"sets\": {",
+        espeak_Info(nullptr), sample_rate, iterations);
+    auto is_first = true;
+    for (auto const& set : make_corpus()) {
+      auto result = measure(set, iterations);
+      auto const audio_seconds =
+          static_cast<double>(result.sample_count) / sample_rate;
+      auto const samples =
+          std::max<std::uint64_t>(result.sample_count, 1u);
+      std::fprintf(
+          output,
+          "%s\n    \"%s\": {\n"
+          "      \"synthesis_count\": %llu,\n"
+          "      \"time_to_first_sample_ms_p50\": %.3f,\n"
+          "      \"time_to_first_sample_ms_p99\": %.3f,\n"
+          "      \"wall_time_ms\": %.3f,\n"
+          "      \"audio_time_ms\": %.3f,\n"
+          "      \"real_time_factor\": %.6f,\n"
+          "      \"sample_count\": %llu,\n"
+          "      \"bytes_copied_per_sample\": %.3f,\n"
+          "      \"callback_count\": %llu\n"
+          "    }",
+          is_first ? "" : ",", set.name,
+          static_cast<unsigned long long>(result.synthesis_count),
+          percentile(result.first_sample_seconds, 0.5) * 1e3,
+          percentile(result.first_sample_seconds, 0.99) * 1e3,
+          result.wall_seconds * 1e3, audio_seconds * 1e3,
+          audio_seconds > 0.0 ? result.wall_seconds / audio_seconds
+                              : 0.0,
+          static_cast<unsigned long long>(result.sample_count),
+          static_cast<double>(result.copied_bytes) / samples,
+          static_cast<unsigned long long>(result.callback_count));
+      is_first = false;
+    }
+    std::fprintf(output, "\n  }\n}\n");
+  } catch (std::exception const& error) {
+    std::fprintf(stderr, "%s\n", error.what());
+    return EXIT_FAILURE;
+  }
+}
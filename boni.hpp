@@ -1,12 +1,26 @@
 #pragma once
 
 // Standard library.
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
 
 // C standard library.
+#include <cassert>
+#include <cerrno>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 
@@ -17,6 +31,8 @@
  *  and the likelihood of resoure leak.
  *  They are created as needed to provided minimal functionalities,
  *  with no attempt to make them as general as possible.
+ *  The same applies to the few non-RAII utilities,
+ *  such as \ref spsc_ring_buffer, that also live here.
  */
 namespace boni {
 
@@ -99,6 +115,9 @@ public:
  *  This is similar to `boni::handle_deleter`
  *  but with `handle_type_t` being possibly not a `NullablePointer`,
  *  This is necessary, for example, when a handle is `int`.
+ *  The `null_value` defaults to a value-initialised `handle_type_t`,
+ *  but can be changed for handles such as POSIX file descriptors
+ *  where `0` is valid and `-1` is used instead.
  *
  *  \par Implementation Consideration
  *  It is possible to generalise this to `boni::unsafe_nullable_deleter`
@@ -110,7 +129,8 @@ public:
  *  removing the need for this class altogether.
  */
 template <
-    typename handle_type_t, void (*destroy_function)(handle_type_t)>
+    typename handle_type_t, void (*destroy_function)(handle_type_t),
+    handle_type_t null_value = handle_type_t{}>
 class nullable_deleter {
 public:
   /** \brief The `handle_type` that the `destroy_function` acts on.
@@ -125,7 +145,7 @@ public:
    *  It is a `NullablePointer`
    *  and is implicitly convertible to `handle_type`.
    */
-  using pointer = nullable<handle_type>;
+  using pointer = nullable<handle_type, null_value>;
 
   /** \brief Destroy the given handle.
    *
@@ -133,7 +153,7 @@ public:
    *  but only if the argument is not "null".
    */
   void operator()(pointer pointer_to_delete) {
-    if (pointer_to_delete == pointer()) {
+    if (pointer_to_delete != pointer()) {
       destroy_function(pointer_to_delete);
     }
   }
@@ -224,7 +244,7 @@ public:
    *  but only if the argument is not "null".
    */
   void operator()(pointer handle_to_delete) {
-    if (handle_to_delete == pointer()) {
+    if (handle_to_delete != pointer()) {
       destroy_function(handle_to_delete);
     }
   }
@@ -443,4 +463,354 @@ using file_deleter = unsafe_handle_deleter<FILE*, int, std::fclose>;
  */
 using file = auto_handle<file_deleter>;
 
+/** \brief Size, in bytes, assumed for a CPU cache line.
+ *
+ *  `std::hardware_destructive_interference_size` would be the standard
+ *  way to obtain this, but compilers warn about its use in headers
+ *  since its value may differ between translation units.
+ *  64 bytes is correct for all current x86-64 and most ARM cores.
+ */
+constexpr std::size_t cache_line_size = 64u;
+
+/** \brief Fixed-capacity lock-free single-producer single-consumer
+ *  queue.
+ *
+ *  \tparam value_type_t
+ *  The type of the elements to store.
+ *  It must be trivially copyable,
+ *  since elements are copied in and out in bulk.
+ *
+ *  Exactly one thread may call \ref write
+ *  and exactly one, possibly different, thread may call \ref read
+ *  at any one time.
+ *  Neither of them take a lock nor allocate,
+ *  so that, for example, a synthesis thread producing audio
+ *  never waits for an audio callback consuming it, and vice versa.
+ *
+ *  The read and write positions are kept in separate cache lines
+ *  so that the two threads do not invalidate each other's caches
+ *  on every operation.
+ *  Each side also keeps a cached copy of the position of the other side
+ *  and only reloads it when the cached copy suggests
+ *  that the buffer is full or empty.
+ *
+ *  Failing to read everything requested counts as an _underrun_.
+ *  The counter is only informative, and is not reset by the class.
+ *  Failing to write everything is not counted,
+ *  since a producer filling the buffer and waiting for room
+ *  is the expected steady state.
+ *
+ *  ```cpp
+ *  boni::spsc_ring_buffer<short> samples{4096u};
+ *
+ *  // Producer thread.
+ *  short produced[256]{};
+ *  auto const written = samples.write(produced, 256u);
+ *
+ *  // Consumer thread.
+ *  short consumed[128];
+ *  auto const read = samples.read(consumed, 128u);
+ *  ```
+ */
+template <typename value_type_t> class spsc_ring_buffer {
+public:
+  /** \brief The type of the elements stored. */
+  using value_type = value_type_t;
+
+  /** \brief Allocates storage for at least `minimum_capacity` elements.
+   *
+   *  The capacity is rounded up to a power of two
+   *  so that wrapping around is a mask instead of a division.
+   *  This is the only allocation done by the class.
+   */
+  explicit spsc_ring_buffer(std::size_t minimum_capacity)
+      : mask{round_up_to_power_of_two(minimum_capacity) - 1u},
+        storage{new value_type[mask + 1u]} {}
+
+  // The positions are shared with other threads by address.
+  spsc_ring_buffer(spsc_ring_buffer const&) = delete;
+  spsc_ring_buffer& operator=(spsc_ring_buffer const&) = delete;
+
+  /** \brief Maximum number of elements that can be stored at once. */
+  std::size_t capacity() const { return mask + 1u; }
+
+  /** \brief Start of the storage, of \ref capacity elements.
+   *
+   *  Only meant for locking the storage in memory.
+   *  Elements must not be accessed through it.
+   */
+  value_type const* data() const { return storage.get(); }
+
+  /** \brief Number of elements currently stored.
+   *
+   *  This is only a snapshot when called concurrently with
+   *  \ref read or \ref write.
+   */
+  std::size_t size() const {
+    auto const tail = producer.position.load(std::memory_order_acquire);
+    auto const head = consumer.position.load(std::memory_order_acquire);
+    return tail - head;
+  }
+
+  /** \brief Copies up to `count` elements from `source` into buffer.
+   *
+   *  \return The number of elements copied.
+   *  It is less than `count` if the buffer became full.
+   *
+   *  Must only be called from the producer thread.
+   */
+  std::size_t write(value_type const* source, std::size_t count) {
+    auto const tail = producer.position.load(std::memory_order_relaxed);
+    if (capacity() - (tail - producer.cached_position) < count) {
+      producer.cached_position =
+          consumer.position.load(std::memory_order_acquire);
+    }
+    auto const written =
+        std::min(count, capacity() - (tail - producer.cached_position));
+    copy_around(source, tail, written);
+    producer.position.store(tail + written, std::memory_order_release);
+    return written;
+  }
+
+  /** \brief Moves up to `count` elements from buffer to `destination`.
+   *
+   *  \return The number of elements copied.
+   *  It is less than `count` if the buffer became empty,
+   *  in which case the underrun counter is incremented.
+   *
+   *  Must only be called from the consumer thread.
+   */
+  std::size_t read(value_type* destination, std::size_t count) {
+    auto const head = consumer.position.load(std::memory_order_relaxed);
+    if (consumer.cached_position - head < count) {
+      consumer.cached_position =
+          producer.position.load(std::memory_order_acquire);
+    }
+    auto const read = std::min(count, consumer.cached_position - head);
+    auto const offset = head & mask;
+    auto const first_part = std::min(read, capacity() - offset);
+    std::copy_n(storage.get() + offset, first_part, destination);
+    std::copy_n(
+        storage.get(), read - first_part, destination + first_part);
+    consumer.position.store(head + read, std::memory_order_release);
+    if (read < count) {
+      consumer.underrun_count.fetch_add(1u, std::memory_order_relaxed);
+    }
+    return read;
+  }
+
+  /** \brief Drops every element stored.
+   *
+   *  \return The number of elements dropped.
+   *  Elements written concurrently may or may not be dropped.
+   *
+   *  Must only be called from the consumer thread.
+   */
+  std::size_t discard() {
+    auto const head = consumer.position.load(std::memory_order_relaxed);
+    consumer.cached_position =
+        producer.position.load(std::memory_order_acquire);
+    consumer.position.store(
+        consumer.cached_position, std::memory_order_release);
+    return consumer.cached_position - head;
+  }
+
+  /** \brief Number of \ref read calls not reading everything. */
+  std::uint64_t underruns() const {
+    return consumer.underrun_count.load(std::memory_order_relaxed);
+  }
+
+private:
+  /** \brief Smallest power of two not less than `value`, minimum 1. */
+  static std::size_t round_up_to_power_of_two(std::size_t value) {
+    std::size_t result = 1u;
+    while (result < value) {
+      result <<= 1u;
+    }
+    return result;
+  }
+
+  /** \brief Copies `count` elements to `tail`, wrapping around. */
+  void copy_around(
+      value_type const* source, std::size_t tail, std::size_t count) {
+    auto const offset = tail & mask;
+    auto const first_part = std::min(count, capacity() - offset);
+    std::copy_n(source, first_part, storage.get() + offset);
+    std::copy_n(source + first_part, count - first_part, storage.get());
+  }
+
+  /** \brief State written by one side and read by the other.
+   *
+   *  `position` counts elements ever written (for the producer)
+   *  or ever read (for the consumer).
+   *  It is only reduced to an index into `storage` when used,
+   *  so that a full buffer and an empty buffer are distinguishable.
+   *  `cached_position` is the last seen `position` of the other side,
+   *  and is only accessed by the owning side.
+   */
+  struct alignas(cache_line_size) side_state {
+    std::atomic<std::size_t> position{0u};
+    std::size_t cached_position{0u};
+    std::atomic<std::uint64_t> underrun_count{0u};
+  };
+
+  /** \brief One less than \ref capacity, used to wrap positions. */
+  std::size_t const mask;
+  /** \brief The elements, as a circular array. */
+  std::unique_ptr<value_type[]> const storage;
+  /** \brief Owned by the thread calling \ref write. */
+  side_state producer;
+  /** \brief Owned by the thread calling \ref read. */
+  side_state consumer;
+};
+
+/** \brief Blocking first-in first-out queue with a maximum size.
+ *
+ *  \tparam value_type_t
+ *  The type of the elements to store. It must be movable.
+ *
+ *  Any number of threads may \ref push and \ref pop concurrently.
+ *  Pushing waits while the queue is full,
+ *  which provides back-pressure to producers
+ *  instead of letting the queue grow without bound.
+ *  Unlike \ref spsc_ring_buffer, this takes a lock,
+ *  and is meant for passing coarse work items such as jobs,
+ *  not for streaming samples.
+ *
+ *  ```cpp
+ *  boni::bounded_queue<std::string> jobs{16u};
+ *
+ *  // Consumer thread.
+ *  while (auto job = jobs.pop()) {
+ *    std::puts(job->c_str());
+ *  }
+ *
+ *  // Producer threads.
+ *  jobs.push("Hello world.");
+ *  // Wakes the consumer up when the queue is empty.
+ *  jobs.close();
+ *  ```
+ */
+template <typename value_type_t> class bounded_queue {
+public:
+  /** \brief The type of the elements stored. */
+  using value_type = value_type_t;
+
+  /** \brief Creates an empty queue holding at most `capacity` items. */
+  explicit bounded_queue(std::size_t capacity) : capacity{capacity} {
+    assert(capacity > 0u);
+  }
+
+  /** \brief Appends `value`, waiting while the queue is full.
+   *
+   *  \return `false` if the queue has been closed,
+   *  in which case `value` is not moved from.
+   */
+  bool push(value_type&& value) {
+    std::unique_lock<std::mutex> lock{mutex};
+    not_full.wait(
+        lock, [this] { return is_closed || items.size() < capacity; });
+    if (is_closed) {
+      return false;
+    }
+    items.push_back(std::move(value));
+    lock.unlock();
+    not_empty.notify_one();
+    return true;
+  }
+
+  /** \brief Removes the oldest item, waiting while the queue is empty.
+   *
+   *  \return No value if the queue is closed and empty.
+   *  Items pushed before closing are still returned.
+   */
+  std::optional<value_type> pop() {
+    std::unique_lock<std::mutex> lock{mutex};
+    not_empty.wait(
+        lock, [this] { return is_closed || !items.empty(); });
+    if (items.empty()) {
+      return std::nullopt;
+    }
+    std::optional<value_type> result{std::move(items.front())};
+    items.pop_front();
+    lock.unlock();
+    not_full.notify_one();
+    return result;
+  }
+
+  /** \brief Makes further pushes fail and wakes up all waiters. */
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      is_closed = true;
+    }
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+  /** \brief Number of items currently stored. */
+  std::size_t size() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return items.size();
+  }
+
+private:
+  /** \brief Maximum number of items in \ref items. */
+  std::size_t const capacity;
+  /** \brief Guards all other members. */
+  mutable std::mutex mutex;
+  /** \brief Signalled when an item is removed or on closing. */
+  std::condition_variable not_full;
+  /** \brief Signalled when an item is added or on closing. */
+  std::condition_variable not_empty;
+  /** \brief The stored items, oldest first. */
+  std::deque<value_type> items;
+  /** \brief Whether \ref close has been called. */
+  bool is_closed{false};
+};
+
+/** \brief Parses the whole of `text` as a `number_type`.
+ *
+ *  Unlike `std::stoul` and others,
+ *  a prefix of `text` being a number is not enough,
+ *  and a minus sign is rejected for unsigned types
+ *  instead of wrapping around.
+ *  `option` is the command-line option given `text`,
+ *  naming it in the message of the exception.
+ *
+ *  \exception std::invalid_argument
+ *  If `text` is not a number representable as a `number_type`.
+ */
+template <typename number_type>
+number_type
+parse_number(std::string_view option, std::string const& text) {
+  static_assert(std::is_arithmetic<number_type>::value);
+  number_type result{};
+  auto is_parsed = false;
+  if constexpr (std::is_floating_point<number_type>::value) {
+    char* end = nullptr;
+    errno = 0;
+    if constexpr (std::is_same<number_type, float>::value) {
+      result = std::strtof(text.c_str(), &end);
+    } else if constexpr (std::is_same<number_type, double>::value) {
+      result = std::strtod(text.c_str(), &end);
+    } else {
+      result = std::strtold(text.c_str(), &end);
+    }
+    is_parsed = !text.empty() && end == text.c_str() + text.size() &&
+                errno != ERANGE;
+  } else {
+    // Signs other than `-` for signed types are rejected too.
+    auto const end = text.data() + text.size();
+    auto const parsed = std::from_chars(text.data(), end, result);
+    is_parsed = parsed.ec == std::errc{} && parsed.ptr == end;
+  }
+  if (!is_parsed) {
+    throw std::invalid_argument(
+        "Invalid value for " + std::string{option} + ": \"" + text +
+        "\"");
+  }
+  return result;
+}
+
 } // namespace boni
@@ -0,0 +1,219 @@
+#pragma once
+
+// Local dependencies.
+#include "espeak-ng.hpp"
+
+// Standard C++ libraries.
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+// Standard C libraries.
+#include <cstddef>
+
+namespace espeak_ng {
+
+/** \brief Returns `text` with white space runs collapsed to a space.
+ *
+ *  Leading and trailing white space is removed.
+ *  eSpeak NG treats such variations the same,
+ *  so they should not make otherwise identical texts miss the cache.
+ */
+inline std::string normalise_white_space(std::string_view text) {
+  std::string result;
+  result.reserve(text.size());
+  auto is_pending_space = false;
+  for (auto const character : text) {
+    if (character == ' ' || character == '\t' || character == '\n' ||
+        character == '\r' || character == '\f' || character == '\v') {
+      is_pending_space = !result.empty();
+      continue;
+    }
+    if (is_pending_space) {
+      result.push_back(' ');
+      is_pending_space = false;
+    }
+    result.push_back(character);
+  }
+  return result;
+}
+
+/** \brief Combines everything affecting synthesis into one string.
+ *
+ *  Fields are separated by `'\0'`,
+ *  which cannot appear in a voice name or in the text
+ *  given to `espeak_ng_Synthesize`.
+ */
+inline std::string make_cache_key(
+    std::string_view text, synthesis_options const& options) {
+  auto key = options.voice_name;
+  key.push_back('\0');
+  key += std::to_string(options.rate);
+  key.push_back('\0');
+  key += std::to_string(options.pitch);
+  key.push_back('\0');
+  key += std::to_string(options.flags);
+  key.push_back('\0');
+  key += normalise_white_space(text);
+  return key;
+}
+
+/** \brief In-memory least-recently-used cache of synthesis output.
+ *
+ *  \par Purpose
+ *  Synthesising the same prompt again produces the same samples.
+ *  This keeps the \ref synthesis_output of recent jobs,
+ *  keyed by their normalised text and all of their
+ *  \ref synthesis_options,
+ *  so that repeated prompts can skip eSpeak NG altogether.
+ *
+ *  \par Budget
+ *  The cache holds at most `byte_budget` bytes
+ *  of samples, events and keys.
+ *  Inserting beyond that evicts the least recently used entries.
+ *  An output larger than the whole budget is not cached.
+ *
+ *  \par Usage
+ *  Entries are shared and immutable,
+ *  so a hit costs a reference count instead of a copy,
+ *  and stays valid even if evicted while in use.
+ *  All member functions are safe to call from any thread.
+ *  ```cpp
+ *  espeak_ng::pcm_cache cache{std::size_t{16u} << 20};
+ *  auto output = cache.find(text, options);
+ *  if (!output) {
+ *    output = cache.insert(text, options, synthesise(text, options));
+ *  }
+ *  play(output->samples);
+ *  ```
+ */
+class pcm_cache {
+public:
+  /** \brief Shared, immutable cached output. */
+  using entry_pointer = std::shared_ptr<synthesis_output const>;
+
+  /** \brief Creates an empty cache of up to `byte_budget` bytes. */
+  explicit pcm_cache(std::size_t byte_budget)
+      : byte_budget{byte_budget} {}
+
+  /** \brief Returns the cached output for `text`, or `nullptr`.
+   *
+   *  A hit makes the entry the most recently used.
+   */
+  entry_pointer
+  find(std::string_view text, synthesis_options const& options) {
+    auto const key = make_cache_key(text, options);
+    std::lock_guard<std::mutex> lock{mutex};
+    auto const found = index.find(key);
+    if (found == index.end()) {
+      ++miss_count;
+      return nullptr;
+    }
+    ++hit_count;
+    entries.splice(entries.begin(), entries, found->second);
+    return found->second->output;
+  }
+
+  /** \brief Stores `output` as the result for `text`.
+   *
+   *  \return The stored entry, for the caller to use.
+   *  It is returned even if it was too large to be kept.
+   *
+   *  An existing entry for the same key is replaced.
+   */
+  entry_pointer insert(
+      std::string_view text, synthesis_options const& options,
+      synthesis_output output) {
+    auto const shared =
+        std::make_shared<synthesis_output const>(std::move(output));
+    auto key = make_cache_key(text, options);
+    auto const size = entry_size(key, *shared);
+    std::lock_guard<std::mutex> lock{mutex};
+    auto const found = index.find(key);
+    if (found != index.end()) {
+      erase(found->second);
+    }
+    if (size > byte_budget) {
+      return shared;
+    }
+    while (byte_count + size > byte_budget) {
+      erase(std::prev(entries.end()));
+      ++eviction_count;
+    }
+    entries.push_front(entry{std::move(key), shared, size});
+    index.emplace(entries.front().key, entries.begin());
+    byte_count += size;
+    return shared;
+  }
+
+  /** \brief Number of \ref find calls that found an entry. */
+  std::uint64_t hits() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return hit_count;
+  }
+
+  /** \brief Number of \ref find calls that found nothing. */
+  std::uint64_t misses() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return miss_count;
+  }
+
+  /** \brief Number of entries removed to stay within budget. */
+  std::uint64_t evictions() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return eviction_count;
+  }
+
+  /** \brief Bytes currently accounted to entries. */
+  std::size_t size_in_bytes() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return byte_count;
+  }
+
+private:
+  /** \brief A cached output and its key, in recency order. */
+  struct entry {
+    std::string key;
+    entry_pointer output;
+    /** \brief Bytes accounted to this entry. */
+    std::size_t size;
+  };
+
+  /** \brief Approximate memory used by an entry. */
+  static std::size_t
+  entry_size(std::string const& key, synthesis_output const& output) {
+    return key.size() +
+           output.samples.capacity_in_bytes() +
+           output.timeline.size_in_bytes() + sizeof(entry);
+  }
+
+  /** \brief Removes an entry. The lock must be held. */
+  void erase(std::list<entry>::iterator position) {
+    byte_count -= position->size;
+    index.erase(position->key);
+    entries.erase(position);
+  }
+
+  /** \brief Maximum value of \ref byte_count. */
+  std::size_t const byte_budget;
+  /** \brief Guards all other members. */
+  mutable std::mutex mutex;
+  /** \brief Entries, most recently used first. */
+  std::list<entry> entries;
+  /** \brief Looks up entries by key. Keys are owned by `entries`. */
+  std::unordered_map<std::string_view, std::list<entry>::iterator>
+      index;
+  /** \brief Sum of the sizes of all entries. */
+  std::size_t byte_count{0u};
+  std::uint64_t hit_count{0u};
+  std::uint64_t miss_count{0u};
+  std::uint64_t eviction_count{0u};
+};
+
+} // namespace espeak_ng
@@ -0,0 +1,430 @@
+#pragma once
+
+// Local dependencies.
+#include "audio.hpp"
+#include "boni.hpp"
+#include "espeak-ng-cache.hpp"
+#include "espeak-ng.hpp"
+#include "posix.hpp"
+
+// External dependencies.
+#include <sys/mman.h>
+
+// Standard C++ libraries.
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Standard C libraries.
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+namespace espeak_ng {
+
+/** \brief 64-bit FNV-1a hash of `size` bytes, continuing from `hash`.
+ *
+ *  Used both to look keys up and to detect corrupted data.
+ *  It is not meant to resist deliberate tampering.
+ */
+inline std::uint64_t fnv1a_hash(
+    void const* data, std::size_t size,
+    std::uint64_t hash = 14695981039346656037ull) {
+  auto const bytes = static_cast<unsigned char const*>(data);
+  for (std::size_t index = 0u; index < size; ++index) {
+    hash ^= bytes[index];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+/** \brief Persistent cache of synthesised samples in two files.
+ *
+ *  \par Purpose
+ *  \ref pcm_cache is lost when the process exits.
+ *  This keeps samples on disk, so that restarted processes,
+ *  and other processes using the same files,
+ *  can reuse them without running eSpeak NG.
+ *  Events are not stored.
+ *
+ *  \par Format
+ *  `<prefix>.samples` is a blob of entries,
+ *  each the key from `make_cache_key` and then the samples,
+ *  both padded to 8 bytes so that the samples can be used in place.
+ *  `<prefix>.index` is an \ref index_header
+ *  followed by fixed-size \ref index_record items,
+ *  each locating one entry in the blob.
+ *  Both files are only ever appended to,
+ *  with appends from different processes serialised by `flock`.
+ *  Native byte order is used,
+ *  so the files are not portable between architectures.
+ *
+ *  \par Validation
+ *  Each index record carries a checksum of itself,
+ *  and a checksum of its key and samples.
+ *  Records failing the first check,
+ *  such as one torn by a crash part way through an append,
+ *  are skipped when the index is read.
+ *  The second check is done on the first hit of each entry,
+ *  and an entry failing it is treated as a miss.
+ *
+ *  \par Usage
+ *  The blob is memory mapped, and hits point directly into it.
+ *  Mappings grow geometrically as the blob does,
+ *  and are kept until the cache is destroyed,
+ *  so the returned samples stay valid until then.
+ *  All member functions are safe to call from any thread.
+ *  ```cpp
+ *  espeak_ng::disk_pcm_cache cache{"prompts"};
+ *  if (auto const hit = cache.find(text, options)) {
+ *    play(hit->samples, hit->sample_count);
+ *  } else {
+ *    auto const output = synthesise(text, options);
+ *    cache.insert(text, options, output.samples);
+ *  }
+ *  ```
+ */
+class disk_pcm_cache {
+public:
+  /** \brief Samples of a hit, in the mapped blob. */
+  struct samples_view {
+    short const* samples;
+    std::size_t sample_count;
+  };
+
+  /** \brief Opens, or creates, `<path_prefix>.index` and `.samples`.
+   *
+   *  \exception std::runtime_error
+   *  If the files cannot be opened,
+   *  or the index is not in the expected format.
+   */
+  explicit disk_pcm_cache(std::string const& path_prefix)
+      : index_file{std::fopen((path_prefix + ".index").c_str(), "a+b")},
+        blob_file{
+            std::fopen((path_prefix + ".samples").c_str(), "a+b")} {
+    posix::throw_if(nullptr == index_file.get());
+    posix::throw_if(nullptr == blob_file.get());
+    auto const index_descriptor = fileno(index_file);
+    posix::exclusive_file_lock file_lock{index_descriptor};
+    if (posix::file_size(index_descriptor) == 0u) {
+      index_header const header;
+      write_or_throw(index_file, &header, sizeof(header));
+      std::fflush(index_file);
+    }
+    std::lock_guard<std::mutex> lock{mutex};
+    read_new_records();
+  }
+
+  disk_pcm_cache(disk_pcm_cache const&) = delete;
+  disk_pcm_cache& operator=(disk_pcm_cache const&) = delete;
+
+  /** \brief Returns the stored samples for `text`, if any.
+   *
+   *  Records appended by other processes since the last call
+   *  are picked up first.
+   *
+   *  \exception std::runtime_error
+   *  If locking the index fails.
+   */
+  std::optional<samples_view>
+  find(std::string_view text, synthesis_options const& options) {
+    auto const key = make_cache_key(text, options);
+    std::lock_guard<std::mutex> lock{mutex};
+    {
+      // Not while a record is half written by \ref insert.
+      posix::shared_file_lock file_lock{fileno(index_file)};
+      read_new_records();
+    }
+    auto const result = find_locked(key);
+    ++(result ? hit_count : miss_count);
+    return result;
+  }
+
+  /** \brief Appends samples for `text`.
+   *
+   *  The chunks of `samples` are written one after another,
+   *  without first being gathered into one array.
+   *  Does nothing if another process has already stored the same key.
+   *
+   *  \exception std::runtime_error
+   *  If writing fails.
+   */
+  void insert(
+      std::string_view text, synthesis_options const& options,
+      audio::pcm_buffer const& samples) {
+    auto const key = make_cache_key(text, options);
+    std::lock_guard<std::mutex> lock{mutex};
+    posix::exclusive_file_lock file_lock{fileno(index_file)};
+    read_new_records();
+    if (find_locked(key)) {
+      return;
+    }
+
+    index_record record;
+    record.blob_offset = pad_to_alignment(blob_file);
+    record.key_size = key.size();
+    record.sample_count = samples.size();
+    record.key_hash = fnv1a_hash(key.data(), key.size());
+    record.data_checksum = record.key_hash;
+    samples.for_each_chunk([&](short const* chunk, std::size_t count) {
+      record.data_checksum = fnv1a_hash(
+          chunk, count * sizeof(short), record.data_checksum);
+    });
+    record.record_checksum = record.compute_checksum();
+
+    static std::array<char, alignment> const padding{};
+    auto const samples_size = samples.size() * sizeof(short);
+    write_or_throw(blob_file, key.data(), key.size());
+    write_or_throw(
+        blob_file, padding.data(), padded(key.size()) - key.size());
+    samples.for_each_chunk([&](short const* chunk, std::size_t count) {
+      write_or_throw(blob_file, chunk, count * sizeof(short));
+    });
+    write_or_throw(
+        blob_file, padding.data(), padded(samples_size) - samples_size);
+    throw_if_not_flushed(blob_file);
+
+    // Only publish the record once the data it points to is written.
+    pad_to_record(index_file);
+    write_or_throw(index_file, &record, sizeof(record));
+    throw_if_not_flushed(index_file);
+    read_new_records();
+  }
+
+  /** \brief Number of \ref find calls returning samples. */
+  std::uint64_t hits() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return hit_count;
+  }
+
+  /** \brief Number of \ref find calls returning nothing. */
+  std::uint64_t misses() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return miss_count;
+  }
+
+  /** \brief Number of index records or entries failing validation. */
+  std::uint64_t rejections() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return rejection_count;
+  }
+
+private:
+  /** \brief Alignment of entries in the blob. */
+  static constexpr std::size_t alignment = 8u;
+
+  /** \brief Locates one entry in the blob. */
+  struct index_record {
+    std::uint64_t key_hash{0u};
+    std::uint64_t blob_offset{0u};
+    std::uint64_t key_size{0u};
+    std::uint64_t sample_count{0u};
+    /** \brief Hash of the key and then the samples. */
+    std::uint64_t data_checksum{0u};
+    /** \brief Hash of all the fields above. */
+    std::uint64_t record_checksum{0u};
+
+    /** \brief The expected \ref record_checksum. */
+    std::uint64_t compute_checksum() const {
+      return fnv1a_hash(this, offsetof(index_record, record_checksum));
+    }
+  };
+
+  /** \brief Start of the index file. */
+  struct index_header {
+    std::array<char, 8> magic{{'E', 'S', 'P', 'C', 'A', 'C', 'H', 'E'}};
+    std::uint32_t version{1u};
+    std::uint32_t record_size{sizeof(index_record)};
+
+    friend bool
+    operator==(index_header const& left, index_header const& right) {
+      return left.magic == right.magic &&
+             left.version == right.version &&
+             left.record_size == right.record_size;
+    }
+  };
+
+  /** \brief An index record as known in memory. */
+  struct known_entry {
+    index_record record;
+    /** \brief Whether \ref index_record::data_checksum matched. */
+    bool is_validated{false};
+  };
+
+  /** \brief `size` rounded up to a multiple of \ref alignment. */
+  static std::size_t padded(std::size_t size) {
+    return (size + alignment - 1u) / alignment * alignment;
+  }
+
+  /** \brief Calls `fwrite`, throwing if not everything was written. */
+  static void
+  write_or_throw(std::FILE* file, void const* data, std::size_t size) {
+    if (size > 0u) {
+      posix::throw_if(1u != std::fwrite(data, size, 1u, file));
+    }
+  }
+
+  /** \brief Calls `fflush`, throwing on failure. */
+  static void throw_if_not_flushed(std::FILE* file) {
+    posix::throw_if(0 != std::fflush(file));
+  }
+
+  /** \brief Appends zeros up to a multiple of \ref alignment.
+   *
+   *  This resynchronises after a write torn by a crash.
+   *  \return The new size of the file.
+   */
+  static std::size_t pad_to_alignment(std::FILE* file) {
+    auto const size = posix::file_size(fileno(file));
+    static std::array<char, alignment> const padding{};
+    write_or_throw(file, padding.data(), padded(size) - size);
+    return padded(size);
+  }
+
+  /** \brief Appends zeros up to a whole number of index records.
+   *
+   *  The padded slot fails its checksum and is skipped by readers.
+   */
+  static void pad_to_record(std::FILE* file) {
+    auto const size =
+        posix::file_size(fileno(file)) - sizeof(index_header);
+    auto const remainder = size % sizeof(index_record);
+    if (remainder != 0u) {
+      static std::array<char, sizeof(index_record)> const padding{};
+      write_or_throw(
+          file, padding.data(), sizeof(index_record) - remainder);
+    }
+  }
+
+  /** \brief Adds complete records appended since the last call.
+   *
+   *  The lock must be held.
+   */
+  void read_new_records() {
+    auto const index_size = posix::file_size(fileno(index_file));
+    auto const whole_size =
+        index_size -
+        (index_size - sizeof(index_header)) % sizeof(index_record);
+    if (index_size < sizeof(index_header) ||
+        whole_size <= index_read_size) {
+      return;
+    }
+    auto const index_map = posix::map_memory(
+        whole_size, PROT_READ, MAP_SHARED, fileno(index_file));
+    auto const bytes =
+        static_cast<unsigned char const*>(index_map.get());
+    if (index_read_size == 0u) {
+      index_header header;
+      std::memcpy(&header, bytes, sizeof(header));
+      if (!(header == index_header{})) {
+        throw std::runtime_error("Not a PCM cache index of version 1");
+      }
+      index_read_size = sizeof(index_header);
+    }
+    for (; index_read_size < whole_size;
+         index_read_size += sizeof(index_record)) {
+      index_record record;
+      std::memcpy(&record, bytes + index_read_size, sizeof(record));
+      if (record.record_checksum != record.compute_checksum()) {
+        ++rejection_count;
+        continue;
+      }
+      entries.emplace(record.key_hash, known_entry{record});
+    }
+  }
+
+  /** \brief Returns the mapped samples for `key`. Lock must be held. */
+  std::optional<samples_view> find_locked(std::string const& key) {
+    auto const key_hash = fnv1a_hash(key.data(), key.size());
+    auto const range = entries.equal_range(key_hash);
+    for (auto position = range.first; position != range.second;
+         ++position) {
+      auto& found = position->second;
+      auto const& record = found.record;
+      auto const samples_offset =
+          record.blob_offset + padded(record.key_size);
+      auto const blob = map_blob(
+          samples_offset + record.sample_count * sizeof(short));
+      if (blob == nullptr || record.key_size != key.size() ||
+          0 != std::memcmp(
+                   blob + record.blob_offset, key.data(), key.size())) {
+        continue;
+      }
+      auto const samples =
+          reinterpret_cast<short const*>(blob + samples_offset);
+      if (!found.is_validated) {
+        auto const checksum = fnv1a_hash(
+            samples, record.sample_count * sizeof(short), key_hash);
+        if (checksum != record.data_checksum) {
+          ++rejection_count;
+          continue;
+        }
+        found.is_validated = true;
+      }
+      return samples_view{samples, record.sample_count};
+    }
+    return std::nullopt;
+  }
+
+  /** \brief Returns the blob mapped for at least `size` bytes.
+   *
+   *  \return `nullptr` if the blob is shorter than that.
+   *  Mappings reach past the end of the file,
+   *  at least twice as far as the one before,
+   *  so that appends are mostly covered by the last mapping
+   *  and only a logarithmic number of them is ever made.
+   *  Older, shorter, mappings are kept so that pointers into them,
+   *  given out by earlier hits, stay valid.
+   */
+  unsigned char const* map_blob(std::size_t size) {
+    if (blob_size < size) {
+      // Pages past the end of the file must not be touched.
+      blob_size = posix::file_size(fileno(blob_file));
+      if (blob_size < size) {
+        return nullptr;
+      }
+    }
+    if (blob_maps.empty() ||
+        blob_maps.back().get_deleter().length < size) {
+      auto length = std::max(blob_size, min_blob_map_size);
+      if (!blob_maps.empty()) {
+        auto const previous = blob_maps.back().get_deleter().length;
+        length = std::max(length, 2u * previous);
+      }
+      blob_maps.push_back(posix::map_memory(
+          length, PROT_READ, MAP_SHARED, fileno(blob_file)));
+    }
+    return static_cast<unsigned char const*>(blob_maps.back().get());
+  }
+
+  /** \brief Length of the first mapping of the blob. */
+  static constexpr std::size_t min_blob_map_size =
+      std::size_t{1u} << 20;
+
+  /** \brief Appended with index records. */
+  boni::file index_file;
+  /** \brief Appended with keys and samples. */
+  boni::file blob_file;
+  /** \brief Guards all other members. */
+  mutable std::mutex mutex;
+  /** \brief Bytes of `index_file` already added to `entries`. */
+  std::size_t index_read_size{0u};
+  /** \brief Valid index records by key hash. */
+  std::unordered_multimap<std::uint64_t, known_entry> entries;
+  /** \brief Mappings of the blob, the longest last. */
+  std::vector<posix::memory_map> blob_maps;
+  /** \brief Size of the blob file when last looked at. */
+  std::size_t blob_size{0u};
+  std::uint64_t hit_count{0u};
+  std::uint64_t miss_count{0u};
+  std::uint64_t rejection_count{0u};
+};
+
+} // namespace espeak_ng
@@ -0,0 +1,153 @@
+#pragma once
+
+// Local dependencies.
+#include "audio.hpp"
+#include "espeak-ng-worker-pool.hpp"
+#include "espeak-ng.hpp"
+
+// Standard C++ libraries.
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Standard C libraries.
+#include <cstddef>
+
+namespace espeak_ng {
+
+/** \brief A part of a document synthesised as one job. */
+struct document_segment {
+  /** \brief Position of the first byte of `text` in the document. */
+  std::size_t offset;
+  /** \brief The bytes of the document from `offset`, unchanged. */
+  std::string text;
+  synthesis_options options;
+};
+
+/** \brief Voice settings of each speaker, by label. */
+using speaker_voices =
+    std::unordered_map<std::string, synthesis_options>;
+
+/** \brief Cuts `document` into segments that can be synthesised apart.
+ *
+ *  Segments end at blank lines, which separate paragraphs,
+ *  and before lines starting with a label in `speakers`
+ *  followed by `:`, as in `Alice: Hello.`.
+ *  A labelled segment is spoken with the settings of its speaker,
+ *  without the label, and the others with `narration`.
+ *  Leading and trailing blanks of segments are left out,
+ *  so that each segment is a contiguous part of the document
+ *  and its text positions only need moving by its offset.
+ */
+inline std::vector<document_segment> split_document(
+    std::string_view document, speaker_voices const& speakers = {},
+    synthesis_options const& narration = {}) {
+  constexpr std::string_view blanks{" \t\r"};
+  auto constexpr none = std::string_view::npos;
+  std::vector<document_segment> segments;
+  auto const* voice = &narration;
+  auto begin = none;
+  std::size_t end = 0u;
+  auto const end_segment = [&]() {
+    if (begin != none) {
+      segments.push_back(document_segment{
+          begin, std::string{document.substr(begin, end - begin)},
+          *voice});
+    }
+    begin = none;
+  };
+  std::size_t line_start = 0u;
+  while (line_start < document.size()) {
+    auto const line_end =
+        std::min(document.find('\n', line_start), document.size());
+    auto line = document.substr(line_start, line_end - line_start);
+    auto text_start = line_start;
+    auto const colon = line.find(':');
+    if (colon != none) {
+      auto label = line.substr(0u, colon);
+      label.remove_prefix(
+          std::min(label.find_first_not_of(blanks), label.size()));
+      label.remove_suffix(
+          label.size() - (label.find_last_not_of(blanks) + 1u));
+      auto const speaker = speakers.find(std::string{label});
+      if (speaker != speakers.end()) {
+        end_segment();
+        voice = &speaker->second;
+        line.remove_prefix(colon + 1u);
+        text_start += colon + 1u;
+      }
+    }
+    auto const first = line.find_first_not_of(blanks);
+    if (first != none) {
+      if (begin == none) {
+        begin = text_start + first;
+      }
+      end = text_start + line.find_last_not_of(blanks) + 1u;
+    } else if (text_start == line_start) {
+      // A blank line, not a label with the text on the next lines.
+      end_segment();
+      voice = &narration;
+    }
+    line_start = line_end + 1u;
+  }
+  end_segment();
+  return segments;
+}
+
+/** \brief Synthesises `segments` on `pool` and writes them in order.
+ *
+ *  \par Purpose
+ *  A long document synthesised as one text uses one core,
+ *  and only starts playing once its first sentence is done.
+ *  Here, its segments are synthesised concurrently by the workers,
+ *  each with its own voice settings,
+ *  while the finished ones are written to `output` in document order,
+ *  back to back as one stream.
+ *
+ *  \param events
+ *  If not `nullptr`, the events of every segment are appended,
+ *  with sample offsets from the start of the stream
+ *  and text positions in the whole document.
+ *  \return Number of samples written.
+ *  \exception std::runtime_error
+ *  If a worker fails to synthesise a segment.
+ *
+ *  The pool must have no jobs in flight.
+ *  `output` is flushed, but not finished.
+ */
+inline std::uint64_t render_document(
+    worker_pool& pool, std::vector<document_segment> const& segments,
+    audio::sink& output, event_timeline* events = nullptr) {
+  std::uint64_t sample_count = 0u;
+  std::size_t next_collection = 0u;
+  auto const write = [&](short const* samples, std::size_t count) {
+    output.write(samples, count);
+    sample_count += count;
+  };
+  auto const collect_next = [&]() {
+    auto const& segment = segments[next_collection++];
+    auto const segment_start = sample_count;
+    event_timeline segment_events;
+    pool.collect(write, events ? &segment_events : nullptr);
+    if (events) {
+      events->append(
+          segment_events, static_cast<std::uint32_t>(segment_start),
+          static_cast<std::int32_t>(segment.offset));
+    }
+  };
+  for (auto const& segment : segments) {
+    if (pool.is_full()) {
+      collect_next();
+    }
+    pool.submit(segment.text, segment.options);
+  }
+  while (pool.in_flight() > 0u) {
+    collect_next();
+  }
+  output.flush();
+  return sample_count;
+}
+
+} // namespace espeak_ng
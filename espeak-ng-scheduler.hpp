@@ -0,0 +1,314 @@
+#pragma once
+
+// Standard C++ libraries.
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+
+// Standard C libraries.
+#include <cassert>
+#include <cstddef>
+
+namespace espeak_ng {
+
+/** \brief Classes of jobs, most urgent first. */
+enum class job_priority : std::uint8_t {
+  /** \brief Someone is waiting to hear it, as on a live call. */
+  interactive,
+  /** \brief Rendered ahead of time, as in pre-rendering prompts. */
+  bulk,
+};
+
+/** \brief Number of \ref job_priority classes. */
+constexpr std::size_t job_priority_count = 2u;
+
+/** \brief How a job is to be ordered against the others. */
+struct job_schedule {
+  job_priority priority{job_priority::interactive};
+  /** \brief When the job should start by, if earlier than others. */
+  std::chrono::steady_clock::time_point deadline{
+      std::chrono::steady_clock::time_point::max()};
+  /** \brief Who the job is for, sharing synthesis time fairly. */
+  std::string tenant;
+};
+
+/** \brief Queue deciding which synthesis job runs next.
+ *
+ *  \par Ordering
+ *  Jobs of a more urgent \ref job_priority always go first.
+ *  Within a class, the next job is of the tenant
+ *  that has been given the least synthesis time, see \ref charge,
+ *  so that one tenant submitting a large batch
+ *  does not hold back the others.
+ *  Within a tenant, jobs go by earliest deadline,
+ *  and then in submission order.
+ *  A tenant becoming active again starts from the least time
+ *  of the tenants already waiting,
+ *  so that being idle does not earn it a monopoly afterwards.
+ *
+ *  \par Idle tenants
+ *  Tenants are arbitrary strings, so their usage is not kept forever.
+ *  That of an idle tenant is dropped once it is no more
+ *  than the least of the tenants waiting,
+ *  since it would be raised to that on becoming active anyway,
+ *  and every idle one is dropped when no tenant is waiting.
+ *  Beyond \ref max_idle_tenants, the least used idle ones are dropped.
+ *
+ *  \par Back-pressure
+ *  Like `boni::bounded_queue`,
+ *  \ref push waits while the class of the job is full,
+ *  with each class bounded on its own
+ *  so that a full bulk queue never holds back interactive jobs.
+ *
+ *  \par Pre-emption
+ *  The running job can poll \ref is_waiting
+ *  without taking the lock,
+ *  give way at a convenient point and be put back with \ref resume,
+ *  ahead of the jobs submitted after it.
+ */
+template <typename job_type_t> class job_scheduler {
+public:
+  /** \brief The type of the jobs stored. */
+  using job_type = job_type_t;
+
+  /** \brief Most idle tenants whose usage is remembered. */
+  static constexpr std::size_t max_idle_tenants = 1024u;
+
+  /** \brief A job with what it is ordered by. */
+  struct entry {
+    job_type job;
+    job_schedule schedule;
+    /** \brief Submission order, kept when resumed. */
+    std::uint64_t sequence;
+  };
+
+  /** \brief Holds at most `capacity` jobs of each class. */
+  explicit job_scheduler(std::size_t capacity) : capacity{capacity} {
+    assert(capacity > 0u);
+  }
+
+  /** \brief Adds `job`, waiting while its class is full.
+   *
+   *  \return `false` if the scheduler has been closed,
+   *  in which case `job` is not moved from.
+   */
+  bool push(job_type&& job, job_schedule schedule) {
+    auto const priority = index(schedule.priority);
+    std::unique_lock<std::mutex> lock{mutex};
+    not_full.wait(lock, [&] {
+      return is_closed || classes[priority].size < capacity;
+    });
+    if (is_closed) {
+      return false;
+    }
+    auto const sequence = next_sequence++;
+    add(entry{std::move(job), std::move(schedule), sequence});
+    lock.unlock();
+    not_empty.notify_one();
+    return true;
+  }
+
+  /** \brief Puts back a job taken by \ref pop, without waiting.
+   *
+   *  It may take its class over capacity by one until popped again.
+   *  Unlike \ref push, this succeeds even after \ref close,
+   *  so that a pre-empted job is still finished.
+   */
+  void resume(entry&& pre_empted) {
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      add(std::move(pre_empted));
+    }
+    not_empty.notify_one();
+  }
+
+  /** \brief Removes the next job, waiting while there are none.
+   *
+   *  \return No value if closed and empty.
+   *  Jobs pushed before closing are still returned.
+   */
+  std::optional<entry> pop() {
+    std::unique_lock<std::mutex> lock{mutex};
+    not_empty.wait(lock, [this] { return is_closed || total > 0u; });
+    if (total == 0u) {
+      return std::nullopt;
+    }
+    auto& next_class = *std::find_if(
+        classes.begin(), classes.end(),
+        [](priority_class const& queued) { return queued.size > 0u; });
+    auto next_tenant = std::min_element(
+        next_class.tenants.begin(), next_class.tenants.end(),
+        [this](auto const& left, auto const& right) {
+          return usage[left.first] < usage[right.first];
+        });
+    auto& queued = next_tenant->second;
+    auto const first = queued.begin();
+    std::optional<entry> result{std::move(first->second)};
+    queued.erase(first);
+    if (queued.empty()) {
+      next_class.tenants.erase(next_tenant);
+    }
+    --next_class.size;
+    --total;
+    waiting[index(result->schedule.priority)].fetch_sub(
+        1u, std::memory_order_relaxed);
+    lock.unlock();
+    not_full.notify_all();
+    return result;
+  }
+
+  /** \brief Counts `used` synthesis time against `tenant`. */
+  void
+  charge(std::string const& tenant, std::chrono::nanoseconds used) {
+    std::lock_guard<std::mutex> lock{mutex};
+    usage[tenant] += used;
+    forget_idle();
+  }
+
+  /** \brief Whether a job of `priority` is waiting to start.
+   *
+   *  Does not take the lock, so may be polled while synthesising.
+   */
+  bool is_waiting(job_priority priority) const {
+    return waiting[index(priority)].load(std::memory_order_relaxed) >
+           0u;
+  }
+
+  /** \brief Makes further pushes fail and wakes up all waiters. */
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      is_closed = true;
+    }
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+  /** \brief Number of jobs currently stored. */
+  std::size_t size() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return total;
+  }
+
+private:
+  /** \brief Deadline and then submission order. */
+  using order_key =
+      std::pair<std::chrono::steady_clock::time_point, std::uint64_t>;
+
+  /** \brief The jobs of one \ref job_priority. */
+  struct priority_class {
+    /** \brief Waiting jobs of each tenant with any, in order. */
+    std::map<std::string, std::map<order_key, entry>> tenants;
+    std::size_t size{0u};
+  };
+
+  static std::size_t index(job_priority priority) {
+    return static_cast<std::size_t>(priority);
+  }
+
+  /** \brief Stores `queued`. Must be called with the lock held. */
+  void add(entry&& queued) {
+    auto const priority = index(queued.schedule.priority);
+    auto& added_class = classes[priority];
+    auto const& tenant = queued.schedule.tenant;
+    if (!is_active(tenant)) {
+      auto const least = least_active_usage();
+      auto& used = usage[tenant];
+      if (least) {
+        used = std::max(used, *least);
+      }
+    }
+    order_key const key{queued.schedule.deadline, queued.sequence};
+    added_class.tenants[tenant].emplace(key, std::move(queued));
+    ++added_class.size;
+    ++total;
+    waiting[priority].fetch_add(1u, std::memory_order_relaxed);
+  }
+
+  /** \brief Least usage of the tenants waiting, if any.
+   *
+   *  Must be called with the lock held.
+   */
+  std::optional<std::chrono::nanoseconds> least_active_usage() {
+    auto least = std::optional<std::chrono::nanoseconds>{};
+    for (auto const& active_class : classes) {
+      for (auto const& active : active_class.tenants) {
+        auto const active_usage = usage[active.first];
+        least = least ? std::min(*least, active_usage) : active_usage;
+      }
+    }
+    return least;
+  }
+
+  /** \brief Drops the usage of idle tenants, see \ref job_scheduler.
+   *
+   *  Must be called with the lock held.
+   */
+  void forget_idle() {
+    auto const least = least_active_usage();
+    std::size_t idle_count = 0u;
+    for (auto used = usage.begin(); used != usage.end();) {
+      if (is_active(used->first)) {
+        ++used;
+      } else if (!least || used->second <= *least) {
+        used = usage.erase(used);
+      } else {
+        ++idle_count;
+        ++used;
+      }
+    }
+    for (; idle_count > max_idle_tenants; --idle_count) {
+      auto least_used = usage.end();
+      for (auto used = usage.begin(); used != usage.end(); ++used) {
+        if (!is_active(used->first) &&
+            (least_used == usage.end() ||
+             used->second < least_used->second)) {
+          least_used = used;
+        }
+      }
+      usage.erase(least_used);
+    }
+  }
+
+  /** \brief Whether `tenant` has jobs waiting in any class. */
+  bool is_active(std::string const& tenant) const {
+    return std::any_of(
+        classes.begin(), classes.end(),
+        [&](priority_class const& active_class) {
+          return active_class.tenants.count(tenant) > 0u;
+        });
+  }
+
+  /** \brief Maximum number of jobs of each class. */
+  std::size_t const capacity;
+  /** \brief Guards all other members, except \ref waiting. */
+  mutable std::mutex mutex;
+  /** \brief Signalled when a job is removed or on closing. */
+  std::condition_variable not_full;
+  /** \brief Signalled when a job is added or on closing. */
+  std::condition_variable not_empty;
+  std::array<priority_class, job_priority_count> classes;
+  /** \brief Copy of the size of each class, read without the lock. */
+  std::array<std::atomic<std::size_t>, job_priority_count> waiting{};
+  /** \brief Synthesis time given to each tenant so far.
+   *
+   *  Only kept for idle tenants while it matters,
+   *  see \ref forget_idle.
+   */
+  std::map<std::string, std::chrono::nanoseconds> usage;
+  /** \brief Number of jobs in all classes. */
+  std::size_t total{0u};
+  std::uint64_t next_sequence{0u};
+  /** \brief Whether \ref close has been called. */
+  bool is_closed{false};
+};
+
+} // namespace espeak_ng
@@ -0,0 +1,697 @@
+#pragma once
+
+// Local dependencies.
+#include "audio.hpp"
+#include "espeak-ng.hpp"
+#include "instrumentation.hpp"
+#include "posix.hpp"
+
+// External dependencies.
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Standard C++ libraries.
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+// Standard C libraries.
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+namespace espeak_ng {
+
+/** \brief Streams synthesised speech to HTTP clients.
+ *
+ *  \par Protocol
+ *  Each connection makes one request, either
+ *  `GET /speak?text=...&voice=...`
+ *  or `POST /speak?voice=...` with the text as the body,
+ *  and `voice` being optional.
+ *  `priority=bulk` queues the request behind interactive ones,
+ *  `tenant=...` names who it is for, to share the engine fairly,
+ *  and `deadline_ms=...` asks for it to start within that time,
+ *  see \ref job_scheduler.
+ *  The response is `audio/L16` at the rate of the \ref engine,
+ *  that is mono 16-bit big-endian samples,
+ *  sent with chunked transfer encoding
+ *  while the synthesis is still producing them.
+ *  The connection is closed after the response.
+ *
+ *  \par Threads
+ *  One thread runs \ref run, an `epoll` loop over
+ *  non-blocking sockets, which never waits for synthesis.
+ *  The \ref engine thread writes samples to a \ref response_stream
+ *  per request, which wakes the loop through a pipe.
+ *
+ *  \par Back-pressure
+ *  At most `max_in_flight` requests are accepted at a time,
+ *  and more are answered with `503` instead of being queued.
+ *  Each response buffers at most `high_water_bytes` unsent,
+ *  so that a slow client does not make the server buffer
+ *  a whole utterance for it.
+ *  A full buffer makes its synthesis wait up to `write_timeout`
+ *  for the loop to take it, and the client is then given up on,
+ *  since the single synthesis thread waiting any longer
+ *  would hold back every other request with it.
+ *  Together, these bound the samples buffered by the server
+ *  to about twice `max_in_flight` times `high_water_bytes`,
+ *  counting what is being sent,
+ *  and those waiting to be taken by the loop are counted in
+ *  \ref instrumentation::registry::buffered_pcm_bytes.
+ *
+ *  \par Usage
+ *  ```cpp
+ *  espeak_ng::engine engine;
+ *  espeak_ng::streaming_server server{engine, "", "8080"};
+ *  // Does not return.
+ *  server.run();
+ *  ```
+ *  and, say, `curl -N 'localhost:8080/speak?text=Hello'`.
+ */
+class streaming_server {
+public:
+  /** \brief Listens on `host` and `port` for requests to `speech`.
+   *
+   *  `speech` is not owned.
+   *  `max_in_flight` must not be more than its queue capacity,
+   *  so that submitting a request never waits.
+   *
+   *  \exception std::runtime_error
+   *  If the socket cannot be set up.
+   */
+  streaming_server(
+      engine& speech, std::string const& host, std::string const& port,
+      std::size_t max_in_flight = 16u,
+      std::size_t high_water_bytes = std::size_t{256u} << 10,
+      std::chrono::milliseconds write_timeout =
+          std::chrono::milliseconds{20})
+      : speech{speech}, max_in_flight{max_in_flight},
+        high_water_bytes{high_water_bytes},
+        write_timeout{write_timeout},
+        listening{posix::listen_on_tcp_port(host, port)},
+        wake_up{posix::make_pipe()}, events{posix::make_epoll()} {
+    posix::set_non_blocking(wake_up.read_end);
+    posix::set_non_blocking(wake_up.write_end);
+    watch(listening, listening_key, EPOLLIN);
+    watch(wake_up.read_end, wake_up_key, EPOLLIN);
+  }
+
+  /** \brief Serves requests until an error is thrown. */
+  void run() {
+    epoll_event ready[64];
+    for (;;) {
+      // Failed syntheses do not wake the loop, so look now and then.
+      auto const timeout_ms = in_flight > 0u ? 100 : -1;
+      auto const ready_count =
+          ::epoll_wait(events, ready, 64, timeout_ms);
+      if (ready_count == -1 && errno == EINTR) {
+        continue;
+      }
+      posix::throw_if(ready_count == -1);
+      for (int index = 0; index < ready_count; ++index) {
+        auto const key = ready[index].data.u64;
+        if (key == listening_key) {
+          accept_connections();
+        } else if (key == wake_up_key) {
+          drain_wake_ups();
+        } else {
+          auto const found = connections.find(key);
+          if (found != connections.end()) {
+            on_ready(found->second, ready[index].events);
+          }
+        }
+      }
+      update_connections();
+    }
+  }
+
+private:
+  /** \brief Chunked audio of one response,
+   *  written by the synthesis thread and sent by the loop.
+   */
+  class response_stream : public audio::sink {
+  public:
+    response_stream(
+        int wake_up, std::size_t high_water_bytes,
+        std::chrono::milliseconds write_timeout)
+        : wake_up{wake_up}, high_water_bytes{high_water_bytes},
+          write_timeout{write_timeout} {}
+
+    /** \brief Stops counting what was never taken as buffered. */
+    ~response_stream() { release_buffered(pending.size()); }
+
+    /** \brief Queues the samples as one chunk.
+     *
+     *  Waits at most `write_timeout` for room,
+     *  and not at all once the client has been given up on.
+     *
+     *  \exception std::runtime_error
+     *  If the client has gone, or is not keeping up.
+     */
+    void
+    write(short const* samples, std::size_t sample_count) override {
+      std::unique_lock<std::mutex> lock{mutex};
+      auto const has_room = drained.wait_for(lock, write_timeout, [&] {
+        return is_abandoned || pending.size() < high_water_bytes;
+      });
+      if (is_abandoned) {
+        throw std::runtime_error("Client disconnected");
+      }
+      if (!has_room) {
+        is_abandoned = true;
+        throw std::runtime_error("Client not keeping up");
+      }
+      auto const size_before = pending.size();
+      append_chunk_size(sample_count * 2u);
+      for (std::size_t index = 0u; index < sample_count; ++index) {
+        // `audio/L16` is big-endian.
+        auto const sample =
+            static_cast<std::uint16_t>(samples[index]);
+        pending.push_back(static_cast<char>(sample >> 8));
+        pending.push_back(static_cast<char>(sample & 0xffu));
+      }
+      pending += "\r\n";
+      instrumentation::global_registry().buffered_pcm_bytes.add(
+          pending.size() - size_before);
+      lock.unlock();
+      notify_loop();
+    }
+
+    /** \brief Queues the last, empty, chunk. */
+    void finish() override {
+      {
+        std::lock_guard<std::mutex> lock{mutex};
+        pending += "0\r\n\r\n";
+        is_finished = true;
+      }
+      notify_loop();
+    }
+
+    /** \brief Moves everything queued to the end of `sending`.
+     *
+     *  \return Whether the last chunk has been taken.
+     */
+    bool take(std::string& sending) {
+      bool result;
+      {
+        std::lock_guard<std::mutex> lock{mutex};
+        sending += pending;
+        release_buffered(pending.size());
+        pending.clear();
+        result = is_finished;
+      }
+      drained.notify_one();
+      return result;
+    }
+
+    /** \brief Makes further writes throw. */
+    void abandon() {
+      {
+        std::lock_guard<std::mutex> lock{mutex};
+        is_abandoned = true;
+      }
+      drained.notify_one();
+    }
+
+  private:
+    void append_chunk_size(std::size_t size) {
+      char digits[32];
+      auto const length = std::snprintf(
+          digits, sizeof(digits), "%zx\r\n", size);
+      pending.append(digits, static_cast<std::size_t>(length));
+    }
+
+    static void release_buffered(std::size_t size) {
+      instrumentation::global_registry().buffered_pcm_bytes.subtract(
+          size);
+    }
+
+    void notify_loop() {
+      // A full pipe already has a wake-up pending.
+      char const byte = 0;
+      static_cast<void>(::write(wake_up, &byte, 1u));
+    }
+
+    /** \brief Write end of the wake-up pipe, not owned. */
+    int const wake_up;
+    std::size_t const high_water_bytes;
+    std::chrono::milliseconds const write_timeout;
+    std::mutex mutex;
+    std::condition_variable drained;
+    /** \brief Encoded bytes not yet taken by the loop. */
+    std::string pending;
+    bool is_finished{false};
+    bool is_abandoned{false};
+  };
+
+  /** \brief State of one client. Only used by the loop. */
+  struct connection {
+    /** \brief Identifies the connection in `epoll` events.
+     *
+     *  Descriptors are reused once closed,
+     *  possibly before the synthesis for them is collected,
+     *  so they cannot be used instead.
+     */
+    std::uint64_t key{0u};
+    /** \brief Closed once the response is sent or the client gone. */
+    posix::file_descriptor socket;
+    /** \brief Bytes of the request received so far. */
+    std::string request;
+    /** \brief Bytes to send, from \ref sent_size on. */
+    std::string sending;
+    std::size_t sent_size{0u};
+    /** \brief Audio of the response, if synthesis was started.
+     *
+     *  Owned by \ref framing.
+     */
+    response_stream* response{nullptr};
+    /** \brief Collects samples into frames for \ref response. */
+    std::unique_ptr<audio::coalescing_sink> framing;
+    /** \brief Valid until the synthesis has been collected. */
+    std::future<synthesis_result> result;
+    /** \brief Whether everything to send is in \ref sending. */
+    bool is_complete{false};
+    /** \brief Whether `EPOLLOUT` is being waited for. */
+    bool is_waiting_to_send{false};
+  };
+
+  /** \brief Audio in each HTTP chunk, but the last of an utterance.
+   *
+   *  Several synthesis chunks make one frame,
+   *  so that the synthesis thread takes the lock,
+   *  and wakes the loop, less often.
+   */
+  static constexpr std::size_t frame_duration_ms = 100u;
+
+  /** \brief Largest request accepted, headers and body. */
+  static constexpr std::size_t max_request_bytes = 64u << 10;
+
+  /** \brief Keys of events not about a connection. */
+  static constexpr std::uint64_t listening_key = 0u;
+  static constexpr std::uint64_t wake_up_key = 1u;
+
+  /** \brief Empties the wake-up pipe, which is non-blocking. */
+  void drain_wake_ups() {
+    char discarded[256];
+    while (0 < ::read(wake_up.read_end, discarded, sizeof(discarded))) {
+    }
+  }
+
+  /** \brief Reports `event_mask` of `descriptor` with `key`. */
+  void watch(
+      int descriptor, std::uint64_t key, std::uint32_t event_mask) {
+    control(EPOLL_CTL_ADD, descriptor, key, event_mask);
+  }
+
+  void rewatch(connection const& client, std::uint32_t event_mask) {
+    control(EPOLL_CTL_MOD, client.socket, client.key, event_mask);
+  }
+
+  void control(
+      int operation, int descriptor, std::uint64_t key,
+      std::uint32_t event_mask) {
+    epoll_event event{};
+    event.events = event_mask;
+    event.data.u64 = key;
+    posix::throw_if(
+        0 != ::epoll_ctl(events, operation, descriptor, &event));
+  }
+
+  void accept_connections() {
+    for (;;) {
+      auto const accepted =
+          ::accept4(listening, nullptr, nullptr, SOCK_NONBLOCK);
+      if (accepted == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // Including running out of descriptors: try again later.
+        return;
+      }
+      connection client;
+      client.socket = posix::file_descriptor{accepted};
+      client.key = next_key++;
+      watch(accepted, client.key, EPOLLIN);
+      connections.emplace(client.key, std::move(client));
+    }
+  }
+
+  void on_ready(connection& client, std::uint32_t ready_events) {
+    if (!client.socket) {
+      return;
+    }
+    if ((ready_events & (EPOLLERR | EPOLLHUP)) != 0u) {
+      close(client);
+      return;
+    }
+    if ((ready_events & EPOLLIN) != 0u) {
+      receive(client);
+    }
+  }
+
+  /** \brief Reads what the client sent, handling a complete request.
+   */
+  void receive(connection& client) {
+    char buffer[4096];
+    for (;;) {
+      auto const received =
+          ::recv(client.socket, buffer, sizeof(buffer), 0);
+      if (received == -1 && errno == EINTR) {
+        continue;
+      }
+      if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      if (received <= 0) {
+        // Gone, even if the response is not finished.
+        close(client);
+        return;
+      }
+      // Anything after the request is ignored,
+      // and the request must not move while its body is borrowed.
+      if (client.sending.empty() && !client.is_complete &&
+          !client.response) {
+        client.request.append(
+            buffer, static_cast<std::size_t>(received));
+      }
+    }
+    if (client.sending.empty() && !client.is_complete &&
+        !client.response) {
+      handle_request(client);
+    }
+  }
+
+  /** \brief Starts the response once the request is complete. */
+  void handle_request(connection& client) {
+    auto const& request = client.request;
+    auto const header_end = request.find("\r\n\r\n");
+    if (header_end == std::string::npos) {
+      if (request.size() > max_request_bytes) {
+        respond_with_error(client, "413 Payload Too Large");
+      }
+      return;
+    }
+    std::string_view const headers{request.data(), header_end};
+    auto const line_end = headers.find("\r\n");
+    auto const request_line = headers.substr(0u, line_end);
+    auto const method_end = request_line.find(' ');
+    auto const target_end = request_line.find(' ', method_end + 1u);
+    if (method_end == std::string_view::npos ||
+        target_end == std::string_view::npos) {
+      respond_with_error(client, "400 Bad Request");
+      return;
+    }
+    auto const method = request_line.substr(0u, method_end);
+    auto const target = request_line.substr(
+        method_end + 1u, target_end - method_end - 1u);
+    auto const query_start = std::min(target.find('?'), target.size());
+    if (target.substr(0u, query_start) != "/speak") {
+      respond_with_error(client, "404 Not Found");
+      return;
+    }
+    auto const query = target.substr(
+        std::min(query_start + 1u, target.size()));
+
+    synthesis_options options;
+    if (auto const voice = query_parameter(query, "voice")) {
+      options.voice_name = *voice;
+    }
+    job_schedule schedule;
+    if (query_parameter(query, "priority") == "bulk") {
+      schedule.priority = job_priority::bulk;
+    }
+    schedule.tenant = query_parameter(query, "tenant").value_or("");
+    if (auto const deadline = query_parameter(query, "deadline_ms")) {
+      char* end = nullptr;
+      auto const milliseconds =
+          std::strtoul(deadline->c_str(), &end, 10);
+      if (end == deadline->c_str() || *end != '\0') {
+        respond_with_error(client, "400 Bad Request");
+        return;
+      }
+      schedule.deadline = std::chrono::steady_clock::now() +
+                          std::chrono::milliseconds{milliseconds};
+    }
+    synthesis_request job;
+    if (method == "GET") {
+      job = synthesis_request{
+          query_parameter(query, "text").value_or(""),
+          std::move(options)};
+    } else if (method == "POST") {
+      auto const body_size = content_length(headers);
+      if (!body_size) {
+        respond_with_error(client, "411 Length Required");
+        return;
+      }
+      if (*body_size > max_request_bytes) {
+        respond_with_error(client, "413 Payload Too Large");
+        return;
+      }
+      auto const body_start = header_end + 4u;
+      if (request.size() - body_start < *body_size) {
+        // Wait for the rest of the body.
+        return;
+      }
+      // Borrowed, since the request is kept until collected.
+      job = synthesis_request::borrowing(
+          std::string_view{request}.substr(body_start, *body_size),
+          std::move(options));
+    } else {
+      respond_with_error(client, "405 Method Not Allowed");
+      return;
+    }
+    if (job.text().empty()) {
+      respond_with_error(client, "400 Bad Request");
+      return;
+    }
+    if (in_flight >= max_in_flight) {
+      respond_with_error(client, "503 Service Unavailable");
+      return;
+    }
+
+    auto response = std::make_unique<response_stream>(
+        wake_up.write_end, high_water_bytes, write_timeout);
+    client.response = response.get();
+    client.framing = std::make_unique<audio::coalescing_sink>(
+        std::move(response),
+        static_cast<std::size_t>(speech.get_sample_rate()) *
+            frame_duration_ms / 1000u);
+    client.sending =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: audio/L16;rate=" +
+        std::to_string(speech.get_sample_rate()) +
+        ";channels=1\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "Connection: close\r\n\r\n";
+    client.result =
+        speech.submit(
+            std::move(job), client.framing.get(), std::move(schedule));
+    ++in_flight;
+  }
+
+  /** \brief Sends a response with no body, and then closes. */
+  static void
+  respond_with_error(connection& client, char const* status) {
+    client.sending = std::string{"HTTP/1.1 "} + status +
+                     "\r\nContent-Length: 0\r\n"
+                     "Connection: close\r\n\r\n";
+    client.is_complete = true;
+  }
+
+  /** \brief Value of `Content-Length` in `headers`, if given. */
+  static std::optional<std::size_t>
+  content_length(std::string_view headers) {
+    // Header names are case-insensitive.
+    std::string lowered{headers};
+    for (auto& character : lowered) {
+      if (character >= 'A' && character <= 'Z') {
+        character = static_cast<char>(character - 'A' + 'a');
+      }
+    }
+    auto const name = lowered.find("\r\ncontent-length:");
+    if (name == std::string::npos) {
+      return std::nullopt;
+    }
+    std::size_t value = 0u;
+    auto position = name + 17u;
+    while (position < lowered.size() && lowered[position] == ' ') {
+      ++position;
+    }
+    auto const digits_start = position;
+    for (; position < lowered.size() && lowered[position] >= '0' &&
+           lowered[position] <= '9';
+         ++position) {
+      value = value * 10u +
+              static_cast<std::size_t>(lowered[position] - '0');
+      if (value > max_request_bytes) {
+        break;
+      }
+    }
+    if (position == digits_start) {
+      return std::nullopt;
+    }
+    return value;
+  }
+
+  /** \brief The percent-decoded value of `name` in `query`. */
+  static std::optional<std::string>
+  query_parameter(std::string_view query, std::string_view name) {
+    while (!query.empty()) {
+      auto const end = std::min(query.find('&'), query.size());
+      auto const pair = query.substr(0u, end);
+      query.remove_prefix(std::min(end + 1u, query.size()));
+      auto const equals = std::min(pair.find('='), pair.size());
+      if (pair.substr(0u, equals) == name) {
+        return percent_decode(
+            pair.substr(std::min(equals + 1u, pair.size())));
+      }
+    }
+    return std::nullopt;
+  }
+
+  /** \brief Decodes `%xx` escapes, and `+` as space. */
+  static std::string percent_decode(std::string_view encoded) {
+    auto const hex_value = [](char digit) -> int {
+      if (digit >= '0' && digit <= '9') {
+        return digit - '0';
+      }
+      if (digit >= 'a' && digit <= 'f') {
+        return digit - 'a' + 10;
+      }
+      if (digit >= 'A' && digit <= 'F') {
+        return digit - 'A' + 10;
+      }
+      return -1;
+    };
+    std::string decoded;
+    decoded.reserve(encoded.size());
+    for (std::size_t index = 0u; index < encoded.size(); ++index) {
+      auto const character = encoded[index];
+      if (character == '+') {
+        decoded.push_back(' ');
+      } else if (character == '%' && index + 2u < encoded.size() &&
+                 hex_value(encoded[index + 1u]) >= 0 &&
+                 hex_value(encoded[index + 2u]) >= 0) {
+        decoded.push_back(static_cast<char>(
+            hex_value(encoded[index + 1u]) * 16 +
+            hex_value(encoded[index + 2u])));
+        index += 2u;
+      } else {
+        decoded.push_back(character);
+      }
+    }
+    return decoded;
+  }
+
+  /** \brief Sends queued bytes, and collects finished syntheses. */
+  void update_connections() {
+    for (auto iterator = connections.begin();
+         iterator != connections.end();) {
+      auto& client = iterator->second;
+      if (client.result.valid() &&
+          client.result.wait_for(std::chrono::seconds{0}) ==
+              std::future_status::ready) {
+        collect(client);
+      }
+      if (client.socket) {
+        // Only take more once the socket has taken the last,
+        // so that a slow client holds up its synthesis.
+        if (client.response && !client.is_complete &&
+            client.sending.empty()) {
+          client.is_complete = client.response->take(client.sending);
+        }
+        send_queued(client);
+      }
+      // The stream is only destroyed once synthesis is done with it.
+      if (!client.socket && !client.result.valid()) {
+        iterator = connections.erase(iterator);
+      } else {
+        ++iterator;
+      }
+    }
+  }
+
+  /** \brief Takes the result of a finished synthesis. */
+  void collect(connection& client) {
+    --in_flight;
+    try {
+      // The samples were streamed, so there is nothing else to keep.
+      static_cast<void>(client.result.get());
+    } catch (std::exception const& error) {
+      std::fprintf(stderr, "Streaming failed: %s\n", error.what());
+      // A truncated response must not look complete.
+      close(client);
+    }
+  }
+
+  void send_queued(connection& client) {
+    while (client.sent_size < client.sending.size()) {
+      auto const sent = ::send(
+          client.socket, client.sending.data() + client.sent_size,
+          client.sending.size() - client.sent_size, MSG_NOSIGNAL);
+      if (sent == -1 && errno == EINTR) {
+        continue;
+      }
+      if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (!client.is_waiting_to_send) {
+          rewatch(client, EPOLLIN | EPOLLOUT);
+          client.is_waiting_to_send = true;
+        }
+        return;
+      }
+      if (sent == -1) {
+        close(client);
+        return;
+      }
+      client.sent_size += static_cast<std::size_t>(sent);
+    }
+    client.sending.clear();
+    client.sent_size = 0u;
+    if (client.is_waiting_to_send) {
+      rewatch(client, EPOLLIN);
+      client.is_waiting_to_send = false;
+    }
+    if (client.is_complete) {
+      close(client);
+    }
+  }
+
+  /** \brief Closes the socket, stopping any synthesis for it. */
+  void close(connection& client) {
+    if (client.response) {
+      client.response->abandon();
+    }
+    // Closing also removes it from `events`.
+    client.socket.reset();
+  }
+
+  engine& speech;
+  std::size_t const max_in_flight;
+  std::size_t const high_water_bytes;
+  std::chrono::milliseconds const write_timeout;
+  posix::file_descriptor const listening;
+  /** \brief Written by response streams to wake up \ref run. */
+  posix::pipe_ends const wake_up;
+  posix::file_descriptor const events;
+  /** \brief Kept until closed and collected. */
+  std::unordered_map<std::uint64_t, connection> connections;
+  std::uint64_t next_key{wake_up_key + 1u};
+  /** \brief Number of syntheses started but not collected. */
+  std::size_t in_flight{0u};
+};
+
+} // namespace espeak_ng
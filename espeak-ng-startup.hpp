@@ -0,0 +1,379 @@
+#pragma once
+
+// Local dependencies.
+#include "espeak-ng.hpp"
+
+// External dependencies.
+#include <espeak-ng/espeak_ng.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Standard C++ libraries.
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <initializer_list>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Standard C libraries.
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+namespace espeak_ng {
+
+/** \brief Time taken by each phase of start-up.
+ *
+ *  Each phase runs from the end of the previous one,
+ *  or from construction for the first,
+ *  so that the phases add up to the whole start-up.
+ */
+class startup_timer {
+public:
+  /** \brief A named part of start-up. */
+  struct phase {
+    std::string name;
+    std::chrono::nanoseconds duration;
+  };
+
+  /** \brief Ends the phase running since the last one as `name`. */
+  void end_phase(std::string name) {
+    auto const now = std::chrono::steady_clock::now();
+    phases.push_back(phase{std::move(name), now - last});
+    last = now;
+  }
+
+  std::vector<phase> const& get_phases() const { return phases; }
+
+  /** \brief Sum of the phases ended so far. */
+  std::chrono::nanoseconds total() const {
+    std::chrono::nanoseconds sum{0};
+    for (auto const& ended : phases) {
+      sum += ended.duration;
+    }
+    return sum;
+  }
+
+  /** \brief Writes the phases on one line, in milliseconds. */
+  void write_report(std::FILE* output) const {
+    std::fprintf(
+        output, "Start-up took %.3f ms", milliseconds(total()));
+    auto separator = ": ";
+    for (auto const& ended : phases) {
+      std::fprintf(
+          output, "%s%s %.3f ms", separator, ended.name.c_str(),
+          milliseconds(ended.duration));
+      separator = ", ";
+    }
+    std::fprintf(output, ".\n");
+  }
+
+private:
+  static double milliseconds(std::chrono::nanoseconds duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+  }
+
+  std::chrono::steady_clock::time_point last{
+      std::chrono::steady_clock::now()};
+  std::vector<phase> phases;
+};
+
+/** \brief What eSpeak NG found at start-up, kept for the next run.
+ *
+ *  \par Purpose
+ *  Processes started per request pay for looking up the data path
+ *  and scanning every installed voice, each time.
+ *  This records the resolved data path and the \ref voice_inventory,
+ *  so that later runs can give the path directly
+ *  and load voices by file.
+ *
+ *  \par Validation
+ *  The manifest is used only while
+ *  the eSpeak NG version and `ESPEAK_DATA_PATH` are unchanged,
+ *  and the data directory, its voice directories
+ *  and its phoneme files have the modification times and sizes
+ *  recorded, so that installing or upgrading voices
+ *  makes the next run scan again.
+ *  Changes deep inside the voice directories,
+ *  that do not touch those, are not noticed.
+ *
+ *  \par Format
+ *  A text file of tab-separated lines, starting with \ref magic,
+ *  then `version`, `environment` and `data` lines,
+ *  a `stamp` line per watched path
+ *  and a `voice` line of name and identifier per voice.
+ */
+class startup_manifest {
+public:
+  /** \brief First line of every manifest. */
+  static constexpr char const* magic = "espeak-ng-startup-manifest 1";
+
+  /** \brief Modification time and size of a watched path. */
+  struct file_stamp {
+    std::string path;
+    /** \brief Nanoseconds since the epoch, or `-1` if missing. */
+    std::int64_t modified_ns{-1};
+    std::int64_t size{-1};
+
+    bool operator==(file_stamp const& other) const {
+      return path == other.path && modified_ns == other.modified_ns &&
+             size == other.size;
+    }
+  };
+
+  /** \brief Describes the data at `data_path` as it is now. */
+  static startup_manifest
+  describe(std::string data_path, voice_inventory voices) {
+    startup_manifest manifest;
+    manifest.version = current_version();
+    manifest.environment = current_environment();
+    for (auto const* watched :
+         {"", "/phontab", "/phondata", "/phonindex", "/intonations",
+          "/lang", "/voices"}) {
+      manifest.stamps.push_back(stamp_of(data_path + watched));
+    }
+    manifest.data_path = std::move(data_path);
+    manifest.voices = std::move(voices);
+    return manifest;
+  }
+
+  /** \brief Reads the manifest at `path`.
+   *
+   *  \return No value if it is missing or not a manifest.
+   */
+  static std::optional<startup_manifest> read(std::string const& path) {
+    std::ifstream file{path};
+    std::string line;
+    if (!std::getline(file, line) || line != magic) {
+      return std::nullopt;
+    }
+    startup_manifest manifest;
+    std::vector<voice_entry> entries;
+    while (std::getline(file, line)) {
+      auto const fields = split_fields(line);
+      auto const& kind = fields.front();
+      if (kind == "version" && fields.size() == 2u) {
+        manifest.version = fields[1];
+      } else if (kind == "environment" && fields.size() == 2u) {
+        manifest.environment = fields[1];
+      } else if (kind == "data" && fields.size() == 2u) {
+        manifest.data_path = fields[1];
+      } else if (kind == "stamp" && fields.size() == 4u) {
+        manifest.stamps.push_back(file_stamp{
+            fields[1], std::strtoll(fields[2].c_str(), nullptr, 10),
+            std::strtoll(fields[3].c_str(), nullptr, 10)});
+      } else if (kind == "voice" && fields.size() == 3u) {
+        entries.push_back(voice_entry{fields[1], fields[2]});
+      } else {
+        return std::nullopt;
+      }
+    }
+    if (manifest.data_path.empty()) {
+      return std::nullopt;
+    }
+    manifest.voices = voice_inventory{std::move(entries)};
+    return manifest;
+  }
+
+  /** \brief Writes the manifest to `path`.
+   *
+   *  It is written to a temporary file renamed over `path`,
+   *  so that processes starting meanwhile
+   *  read either the old manifest or the new one, never part of one.
+   *
+   *  \exception std::runtime_error
+   *  If the file cannot be written.
+   */
+  void write(std::string const& path) const {
+    auto const temporary =
+        path + ".tmp" + std::to_string(static_cast<long>(::getpid()));
+    {
+      std::ofstream file{temporary, std::ios::trunc};
+      file << magic << '\n'
+           << "version\t" << version << '\n'
+           << "environment\t" << environment << '\n'
+           << "data\t" << data_path << '\n';
+      for (auto const& stamp : stamps) {
+        file << "stamp\t" << stamp.path << '\t' << stamp.modified_ns
+             << '\t' << stamp.size << '\n';
+      }
+      for (auto const& entry : voices.entries()) {
+        file << "voice\t" << entry.name << '\t' << entry.identifier
+             << '\n';
+      }
+      if (!file.flush()) {
+        std::remove(temporary.c_str());
+        throw std::runtime_error(
+            "Unable to write start-up manifest: " + temporary);
+      }
+    }
+    if (0 != std::rename(temporary.c_str(), path.c_str())) {
+      std::remove(temporary.c_str());
+      throw std::runtime_error(
+          "Unable to replace start-up manifest: " + path);
+    }
+  }
+
+  /** \brief Whether the manifest still describes the installation. */
+  bool is_current() const {
+    if (version != current_version() ||
+        environment != current_environment()) {
+      return false;
+    }
+    for (auto const& stamp : stamps) {
+      if (!(stamp_of(stamp.path) == stamp)) {
+        return false;
+      }
+    }
+    return !stamps.empty();
+  }
+
+  /** \brief Version string of the eSpeak NG library run. */
+  std::string version;
+  /** \brief Value of `ESPEAK_DATA_PATH`, or empty if not set. */
+  std::string environment;
+  /** \brief Data path eSpeak NG resolved. */
+  std::string data_path;
+  std::vector<file_stamp> stamps;
+  voice_inventory voices;
+
+private:
+  static std::string current_version() {
+    auto const* info = espeak_Info(nullptr);
+    return info != nullptr ? info : "";
+  }
+
+  static std::string current_environment() {
+    auto const* value = std::getenv("ESPEAK_DATA_PATH");
+    return value != nullptr ? value : "";
+  }
+
+  static file_stamp stamp_of(std::string path) {
+    struct stat status;
+    if (0 != ::stat(path.c_str(), &status)) {
+      return file_stamp{std::move(path)};
+    }
+    auto const modified_ns =
+        static_cast<std::int64_t>(status.st_mtim.tv_sec) * 1000000000 +
+        status.st_mtim.tv_nsec;
+    return file_stamp{
+        std::move(path), modified_ns,
+        static_cast<std::int64_t>(status.st_size)};
+  }
+
+  /** \brief Splits `line` at tabs. Gives at least one field. */
+  static std::vector<std::string>
+  split_fields(std::string const& line) {
+    std::vector<std::string> fields;
+    std::size_t start = 0u;
+    for (;;) {
+      auto const tab = line.find('\t', start);
+      fields.push_back(line.substr(start, tab - start));
+      if (tab == std::string::npos) {
+        return fields;
+      }
+      start = tab + 1u;
+    }
+  }
+};
+
+/** \brief Initialises eSpeak NG, with a start-up manifest if given.
+ *
+ *  \par Purpose
+ *  This replaces
+ *  `espeak_ng_InitializePath(nullptr)` and a \ref service,
+ *  for programs that start often and speak briefly.
+ *  With a current \ref startup_manifest at `manifest_path`,
+ *  its data path is given to eSpeak NG directly
+ *  and its \ref voice_inventory is used,
+ *  so that a \ref voice_pool given \ref get_voices
+ *  skips the scan of every installed voice.
+ *  Otherwise, the voices are listed after initialisation,
+ *  and the manifest is written for the next run.
+ *  Each step is timed as a phase of `timer`.
+ *
+ *  \par Usage
+ *  ```cpp
+ *  espeak_ng::startup_timer timer;
+ *  espeak_ng::quick_start started{"/tmp/espeak-ng.manifest", timer};
+ *  espeak_ng::voice_pool voices{&started.get_voices()};
+ *  voices.select("en");
+ *  timer.end_phase("load voice");
+ *  timer.write_report(stderr);
+ *  ```
+ */
+class quick_start {
+public:
+  /** \brief Initialises eSpeak NG.
+   *
+   *  \param manifest_path
+   *  Where the manifest is read from and written to.
+   *  If empty, none is used and voices are not listed.
+   *  \exception std::runtime_error
+   *  If initialisation fails.
+   *  Failing to write the manifest is only reported to `stderr`.
+   */
+  quick_start(std::string manifest_path, startup_timer& timer)
+      : manifest_path{std::move(manifest_path)},
+        manifest{resolve_data_path(timer)} {
+    timer.end_phase("initialise");
+    if (this->manifest_path.empty()) {
+      return;
+    }
+    if (manifest) {
+      voices = std::move(manifest->voices);
+      return;
+    }
+    voices = voice_inventory::list_installed();
+    timer.end_phase("list voices");
+    char const* data_path = nullptr;
+    espeak_Info(&data_path);
+    try {
+      startup_manifest::describe(data_path ? data_path : "", voices)
+          .write(this->manifest_path);
+    } catch (std::exception const& error) {
+      std::fprintf(stderr, "%s\n", error.what());
+    }
+    timer.end_phase("write manifest");
+  }
+
+  /** \brief Whether a current manifest was used. */
+  bool is_cached() const { return manifest.has_value(); }
+
+  /** \brief Installed voices, empty without a manifest path. */
+  voice_inventory const& get_voices() const { return voices; }
+
+private:
+  /** \brief Gives eSpeak NG the data path, from the manifest if any.
+   *
+   *  \return The manifest, if current.
+   */
+  std::optional<startup_manifest>
+  resolve_data_path(startup_timer& timer) {
+    std::optional<startup_manifest> current;
+    if (!manifest_path.empty()) {
+      current = startup_manifest::read(manifest_path);
+      if (current && !current->is_current()) {
+        current.reset();
+      }
+      timer.end_phase(current ? "read manifest" : "check manifest");
+    }
+    espeak_ng_InitializePath(
+        current ? current->data_path.c_str() : nullptr);
+    timer.end_phase("resolve data path");
+    return current;
+  }
+
+  std::string const manifest_path;
+  /** \brief The manifest used, if it was current. */
+  std::optional<startup_manifest> manifest;
+  /** \brief Initialised after the data path is given. */
+  service running_service;
+  voice_inventory voices;
+};
+
+} // namespace espeak_ng
@@ -0,0 +1,321 @@
+#pragma once
+
+// Local dependencies.
+#include "audio.hpp"
+#include "espeak-ng-cache.hpp"
+#include "espeak-ng.hpp"
+#include "synthesis.hpp"
+
+// External dependencies.
+#include <espeak-ng/espeak_ng.h>
+
+// Standard C++ libraries.
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Standard C libraries.
+#include <cstddef>
+#include <cstdlib>
+
+namespace espeak_ng {
+
+/** \brief A prompt whose slots are filled in per request.
+ *
+ *  Each `{}` in the pattern is a slot, as in `Your balance is {}.`,
+ *  and the text around the slots is the static frame of the prompt.
+ */
+class prompt_template {
+public:
+  /** \brief Splits `pattern` at each `{}`. */
+  explicit prompt_template(std::string_view pattern) {
+    for (;;) {
+      auto const slot = pattern.find("{}");
+      parts.emplace_back(pattern.substr(0u, slot));
+      if (slot == std::string_view::npos) {
+        break;
+      }
+      pattern.remove_prefix(slot + 2u);
+    }
+  }
+
+  std::size_t slot_count() const { return parts.size() - 1u; }
+
+  /** \brief Text around the slots, one more than there are slots. */
+  std::vector<std::string> const& static_parts() const { return parts; }
+
+  /** \brief SSML of the frame, with a mark in place of each slot.
+   *
+   *  The mark of each slot is named by \ref mark_name.
+   */
+  std::string to_ssml() const {
+    std::string ssml{"<speak>"};
+    for (std::size_t index = 0u; index < parts.size(); ++index) {
+      if (index > 0u) {
+        ssml += "<mark name=\"" + mark_name(index - 1u) + "\"/>";
+      }
+      append_escaped(ssml, parts[index]);
+    }
+    ssml += "</speak>";
+    return ssml;
+  }
+
+  /** \brief Name of the mark where slot `slot` is. */
+  static std::string mark_name(std::size_t slot) {
+    return "slot-" + std::to_string(slot);
+  }
+
+private:
+  /** \brief Appends `text`, escaped to be SSML character data. */
+  static void append_escaped(std::string& ssml, std::string_view text) {
+    for (auto const character : text) {
+      switch (character) {
+      case '&':
+        ssml += "&amp;";
+        break;
+      case '<':
+        ssml += "&lt;";
+        break;
+      case '>':
+        ssml += "&gt;";
+        break;
+      default:
+        ssml.push_back(character);
+      }
+    }
+  }
+
+  std::vector<std::string> parts;
+};
+
+/** \brief Speaks templated prompts, synthesising only their slots.
+ *
+ *  \par Purpose
+ *  Templates such as `Your balance is {}.` are mostly static,
+ *  but synthesising the filled-in text every time
+ *  pays for the whole frame again.
+ *  Here, the frame is synthesised once, as SSML with a mark per slot,
+ *  and the `espeakEVENT_MARK` positions recorded with it
+ *  are where its samples are cut.
+ *  Each request then only synthesises its slot values,
+ *  trimmed of leading and trailing silence,
+ *  and splices them between the cached frame segments
+ *  with \ref audio::splicing_sink crossfades.
+ *
+ *  \par Caching
+ *  Frames and slot values are kept in the given \ref pcm_cache,
+ *  under the frame SSML and value text respectively,
+ *  so repeated values, such as common amounts, are not synthesised
+ *  again either.
+ *  Each is recorded whole before it is cut or spliced,
+ *  so a recording limit bounds what one frame or value may take.
+ *
+ *  \par Prosody
+ *  Slot values are synthesised on their own,
+ *  so they are spoken with the intonation of a short sentence
+ *  instead of following the frame around them.
+ *
+ *  \par Usage
+ *  Like the rest of the C API,
+ *  it must only be used on the thread using the \ref service.
+ *  It sets the synthesis callback itself, see \ref synthesise_to.
+ *  ```cpp
+ *  espeak_ng::pcm_cache cache{std::size_t{16u} << 20};
+ *  espeak_ng::template_renderer renderer{cache, 110u};
+ *  espeak_ng::prompt_template const balance{"Your balance is {}."};
+ *  renderer.render(balance, {"42 dollars"}, options, sink);
+ *  ```
+ */
+class template_renderer {
+public:
+  /** \brief Amplitude below which slot audio counts as silence. */
+  static constexpr short silence_threshold = 256;
+
+  /** \brief Renders using `cache`, joining with `crossfade_size`.
+   *
+   *  At most `recording_limit` samples are recorded
+   *  for each frame or value,
+   *  as for \ref basic_synthesis_destination::recording_limit.
+   *  `cache` is not owned and must outlive the renderer.
+   */
+  template_renderer(
+      pcm_cache& cache, std::size_t crossfade_size,
+      std::size_t recording_limit = SIZE_MAX)
+      : cache{cache}, crossfade_size{crossfade_size},
+        recording_limit{recording_limit} {}
+
+  /** \brief Writes `prompt` with its slots filled by `values`.
+   *
+   *  \param cancellation
+   *  Stops rendering once cancelled, if not `nullptr`.
+   *  \return Whether the whole prompt was written,
+   *  being `false` only if cancelled.
+   *  \exception std::invalid_argument
+   *  If the number of values is not the number of slots,
+   *  or if the frame or a value is longer than the recording limit.
+   *  Nothing is written in either case.
+   *  \exception std::runtime_error
+   *  If synthesis fails or eSpeak NG dropped a mark.
+   *
+   *  `output` is flushed, but not finished.
+   */
+  bool render(
+      prompt_template const& prompt,
+      std::vector<std::string> const& values,
+      synthesis_options const& options, audio::sink& output,
+      cancellation_token const* cancellation = nullptr) {
+    if (values.size() != prompt.slot_count()) {
+      throw std::invalid_argument(
+          "Template has " + std::to_string(prompt.slot_count()) +
+          " slots but was given " + std::to_string(values.size()) +
+          " values");
+    }
+    auto frame_options = options;
+    frame_options.flags |= espeakSSML;
+    auto const frame =
+        synthesise(prompt.to_ssml(), frame_options, cancellation);
+    if (!frame) {
+      return false;
+    }
+    auto const cuts = find_cuts(prompt, *frame);
+    // All of them first, so that a value too long writes nothing.
+    std::vector<pcm_cache::entry_pointer> slot_values;
+    slot_values.reserve(values.size());
+    for (auto const& value : values) {
+      slot_values.push_back(synthesise(value, options, cancellation));
+      if (!slot_values.back()) {
+        return false;
+      }
+    }
+    audio::splicing_sink spliced{output, crossfade_size};
+    auto const write_range = [&](audio::pcm_buffer const& samples,
+                                 std::size_t begin, std::size_t end) {
+      samples.for_each_chunk_in(
+          begin, end, [&](short const* chunk, std::size_t count) {
+            if (!is_cancelled(cancellation)) {
+              spliced.write(chunk, count);
+            }
+          });
+      spliced.splice();
+    };
+    std::size_t segment_start = 0u;
+    for (std::size_t slot = 0u; slot < values.size(); ++slot) {
+      write_range(frame->samples, segment_start, cuts[slot]);
+      auto const& value = slot_values[slot];
+      auto const voiced = voiced_range(value->samples);
+      write_range(value->samples, voiced.first, voiced.second);
+      segment_start = cuts[slot];
+    }
+    write_range(frame->samples, segment_start, frame->samples.size());
+    if (is_cancelled(cancellation)) {
+      return false;
+    }
+    spliced.flush();
+    return true;
+  }
+
+  /** \brief Number of frames and values synthesised, not cached. */
+  std::uint64_t syntheses() const { return synthesis_count; }
+
+private:
+  static bool is_cancelled(cancellation_token const* cancellation) {
+    return cancellation && cancellation->is_cancelled();
+  }
+
+  /** \brief Output for `text` from the cache, synthesised if missing.
+   *
+   *  \return The output, or `nullptr` if cancelled.
+   *  \exception std::invalid_argument
+   *  If the output is longer than \ref recording_limit,
+   *  since a partial recording cannot be cut or spliced.
+   */
+  pcm_cache::entry_pointer synthesise(
+      std::string const& text, synthesis_options const& options,
+      cancellation_token const* cancellation) {
+    if (auto cached = cache.find(text, options)) {
+      return cached;
+    }
+    synthesis_output recording;
+    synthesis_destination destination{
+        nullptr, &recording, nullptr, cancellation};
+    destination.recording_limit = recording_limit;
+    auto const status = synthesise_to(text, options.flags, destination);
+    if (is_cancelled(cancellation)) {
+      // Restores parameters an interrupted SSML text may have changed.
+      throw_if_not_ok(espeak_ng_Cancel());
+      return nullptr;
+    }
+    throw_if_not_ok(status);
+    if (destination.is_recording_truncated) {
+      throw std::invalid_argument(
+          "Template text too long to render: " +
+          std::to_string(recording.samples.size()) + " samples");
+    }
+    ++synthesis_count;
+    return cache.insert(text, options, std::move(recording));
+  }
+
+  /** \brief Sample offset of the mark of each slot of `prompt`.
+   *
+   *  Offsets are clamped so that they never decrease
+   *  nor pass the end of the samples.
+   */
+  static std::vector<std::size_t> find_cuts(
+      prompt_template const& prompt, synthesis_output const& frame) {
+    auto const& timeline = frame.timeline;
+    std::vector<std::size_t> cuts;
+    cuts.reserve(prompt.slot_count());
+    for (std::size_t slot = 0u; slot < prompt.slot_count(); ++slot) {
+      auto const name = prompt_template::mark_name(slot);
+      std::size_t index = 0u;
+      while (index < timeline.size() &&
+             !(timeline.types[index] == espeakEVENT_MARK &&
+               name == timeline.name(index))) {
+        ++index;
+      }
+      if (index == timeline.size()) {
+        throw std::runtime_error("Template mark missing: " + name);
+      }
+      auto cut = std::min<std::size_t>(
+          timeline.sample_offsets[index], frame.samples.size());
+      if (!cuts.empty()) {
+        cut = std::max(cut, cuts.back());
+      }
+      cuts.push_back(cut);
+    }
+    return cuts;
+  }
+
+  /** \brief First and one past the last sample above the threshold.
+   *
+   *  An entirely silent buffer gives an empty range.
+   */
+  static std::pair<std::size_t, std::size_t>
+  voiced_range(audio::pcm_buffer const& samples) {
+    auto first = samples.size();
+    std::size_t last = 0u;
+    std::size_t offset = 0u;
+    samples.for_each_chunk([&](short const* chunk, std::size_t count) {
+      for (std::size_t index = 0u; index < count; ++index) {
+        if (std::abs(chunk[index]) > silence_threshold) {
+          first = std::min(first, offset + index);
+          last = offset + index + 1u;
+        }
+      }
+      offset += count;
+    });
+    return {first, std::max(first, last)};
+  }
+
+  pcm_cache& cache;
+  std::size_t const crossfade_size;
+  /** \brief Most samples recorded for each frame or value. */
+  std::size_t const recording_limit;
+  std::uint64_t synthesis_count{0u};
+};
+
+} // namespace espeak_ng
@@ -0,0 +1,921 @@
+#pragma once
+
+// Local dependencies.
+#include "audio.hpp"
+#include "boni.hpp"
+#include "espeak-ng.hpp"
+#include "instrumentation.hpp"
+#include "posix.hpp"
+
+// External dependencies.
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Standard C++ libraries.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Standard C libraries.
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace espeak_ng {
+
+/** \brief Byte queue in shared memory, written by a worker process.
+ *
+ *  This plays the role of `boni::spsc_ring_buffer`
+ *  across a `fork`,
+ *  with the positions and the data living in one `MAP_SHARED` mapping.
+ *  Lock-free `std::atomic` of integers are address-free,
+ *  so they work between processes sharing the mapping.
+ *
+ *  The worker writes _records_, each a \ref record_header
+ *  followed by its payload padded to \ref record_alignment bytes.
+ *  The parent reads payloads in place, without copying,
+ *  and only then releases the space back to the worker.
+ *  A payload may wrap around the end of the data,
+ *  in which case it is given to the reader in two parts.
+ *  A writer finding the ring full flags that it is waiting,
+ *  and \ref read reports the flag so that the reader can wake it,
+ *  instead of the writer polling for space.
+ */
+class shared_record_ring {
+public:
+  /** \brief What the payload of a record holds. */
+  enum class record_type : std::uint32_t {
+    /** \brief Samples of the current job. */
+    samples,
+    /** \brief The current job finished. No payload. */
+    job_end,
+    /** \brief The current job failed. No payload. */
+    job_error,
+    /** \brief Events of the current job, after all its samples.
+     *
+     *  Each is a \ref worker_pool::wire_event
+     *  followed by its name, if any.
+     */
+    events,
+  };
+
+  /** \brief Precedes every payload. */
+  struct record_header {
+    record_type type;
+    /** \brief Length of the payload in bytes, before padding. */
+    std::uint32_t size;
+  };
+
+  /** \brief Every record starts at a multiple of this. */
+  static constexpr std::size_t record_alignment = sizeof(record_header);
+
+  /** \brief Maps shared memory for at least `minimum_capacity` bytes.
+   *
+   *  Must be constructed before `fork` for both processes to share it.
+   */
+  explicit shared_record_ring(std::size_t minimum_capacity)
+      : capacity{round_up(minimum_capacity)},
+        mapping{posix::map_memory(
+            sizeof(positions) + capacity, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS)} {
+    shared = new (mapping.get()) positions{};
+    data = reinterpret_cast<unsigned char*>(mapping.get()) +
+           sizeof(positions);
+  }
+
+  /** \brief Largest payload that fits into one record. */
+  std::size_t max_payload() const {
+    return capacity - sizeof(record_header);
+  }
+
+  /** \brief Writes one record, waiting while there is no space.
+   *
+   *  `wait_for_room` is called while the ring is full,
+   *  and should block until the reader wakes it up
+   *  after a \ref read returned `true`.
+   *  It may return early, and returns `false` to give up.
+   *
+   *  \return `false` if `wait_for_room` gave up.
+   *  `size` must not exceed \ref max_payload.
+   *  Must only be called by the single writing process.
+   */
+  template <typename wait_function>
+  bool write(
+      record_type type, void const* payload, std::size_t size,
+      wait_function&& wait_for_room) {
+    assert(size <= max_payload());
+    auto const record_size = sizeof(record_header) + padded(size);
+    auto const tail = shared->write.load(std::memory_order_relaxed);
+    auto const has_room = [&] {
+      return capacity - (tail - shared->read.load(
+                                    std::memory_order_acquire)) >=
+             record_size;
+    };
+    while (!has_room()) {
+      shared->is_writer_waiting.store(true, std::memory_order_relaxed);
+      // Either the space released is seen here,
+      // or the reader sees the flag after releasing it.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (has_room()) {
+        break;
+      }
+      if (!wait_for_room()) {
+        return false;
+      }
+    }
+    record_header const header{type, static_cast<std::uint32_t>(size)};
+    copy_in(tail, &header, sizeof(header));
+    copy_in(tail + sizeof(header), payload, size);
+    shared->write.store(tail + record_size, std::memory_order_release);
+    return true;
+  }
+
+  /** \brief Whether there is a record to \ref read. */
+  bool empty() const {
+    return shared->read.load(std::memory_order_relaxed) ==
+           shared->write.load(std::memory_order_acquire);
+  }
+
+  /** \brief Gives the oldest record to `on_record`, then releases it.
+   *
+   *  `on_record` is called as
+   *  `on_record(header, first_part, first_size,
+   *  second_part, second_size)`
+   *  with the payload split in two if it wraps around.
+   *  The pointers are only valid during the call.
+   *  Must only be called by the single reading process,
+   *  and only if not \ref empty.
+   *
+   *  \return Whether the writer may be waiting for the space released,
+   *  and should be woken up.
+   */
+  template <typename record_function>
+  bool read(record_function&& on_record) {
+    assert(!empty());
+    auto const head = shared->read.load(std::memory_order_relaxed);
+    record_header header;
+    copy_out(head, &header, sizeof(header));
+    auto const offset = (head + sizeof(header)) % capacity;
+    auto const first_size =
+        std::min<std::size_t>(header.size, capacity - offset);
+    on_record(
+        header, data + offset, first_size, data,
+        header.size - first_size);
+    shared->read.store(
+        head + sizeof(header) + padded(header.size),
+        std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return shared->is_writer_waiting.exchange(
+        false, std::memory_order_relaxed);
+  }
+
+private:
+  /** \brief Positions written by the two sides, in separate lines. */
+  struct positions {
+    alignas(boni::cache_line_size) std::atomic<std::uint64_t> write{0u};
+    alignas(boni::cache_line_size) std::atomic<std::uint64_t> read{0u};
+    /** \brief Set by a writer finding no space, cleared by a read. */
+    alignas(boni::cache_line_size) std::atomic<bool> is_writer_waiting{
+        false};
+  };
+
+  /** \brief Rounds `size` up to a multiple of \ref record_alignment. */
+  static std::size_t padded(std::size_t size) {
+    return (size + record_alignment - 1u) / record_alignment *
+           record_alignment;
+  }
+
+  /** \brief Rounds up to a multiple of `record_alignment`
+   *  large enough for a header and one sample.
+   */
+  static std::size_t round_up(std::size_t minimum_capacity) {
+    return padded(std::max(minimum_capacity, 2u * record_alignment));
+  }
+
+  /** \brief Copies `size` bytes to `position`, wrapping around. */
+  void copy_in(
+      std::uint64_t position, void const* source, std::size_t size) {
+    if (size == 0u) {
+      return;
+    }
+    auto const offset = position % capacity;
+    auto const first_size = std::min(size, capacity - offset);
+    auto const bytes = static_cast<unsigned char const*>(source);
+    std::memcpy(data + offset, bytes, first_size);
+    std::memcpy(data, bytes + first_size, size - first_size);
+  }
+
+  /** \brief Copies `size` bytes from `position`, wrapping around. */
+  void copy_out(
+      std::uint64_t position, void* destination,
+      std::size_t size) const {
+    auto const offset = position % capacity;
+    auto const first_size = std::min(size, capacity - offset);
+    auto const bytes = static_cast<unsigned char*>(destination);
+    std::memcpy(bytes, data + offset, first_size);
+    std::memcpy(bytes + first_size, data, size - first_size);
+  }
+
+  /** \brief Number of data bytes. A multiple of `record_alignment`. */
+  std::size_t const capacity;
+  /** \brief The shared mapping holding `positions` and then data. */
+  posix::memory_map mapping;
+  /** \brief Start of the mapping. */
+  positions* shared;
+  /** \brief Just after `shared`. */
+  unsigned char* data;
+};
+
+/** \brief Pre-forked processes, each synthesising with own eSpeak NG.
+ *
+ *  \par Purpose
+ *  eSpeak NG keeps global state,
+ *  so one process can only synthesise one text at a time
+ *  no matter how many threads it has.
+ *  This class forks worker processes,
+ *  each initialising its own \ref engine once,
+ *  so that jobs can be synthesised on as many cores
+ *  as there are workers.
+ *
+ *  \par Design
+ *  Jobs are sent to the workers through pipes in round-robin order,
+ *  and each worker synthesises its jobs in the order received.
+ *  So the results of the jobs can be collected in submission order
+ *  simply by reading from the worker the next job was sent to.
+ *  Samples come back through a \ref shared_record_ring per worker,
+ *  and are given to the caller directly from the shared memory.
+ *  Each worker also has a pipe back to the parent,
+ *  used to wake the parent up when a record is ready
+ *  and to detect if the worker has died.
+ *
+ *  At most `jobs_per_worker` jobs can be in flight per worker.
+ *  The caller must \ref collect before \ref submit when \ref is_full,
+ *  which bounds the text queued and provides back-pressure.
+ *  Each worker synthesises one job at a time
+ *  straight into its ring, and waits while the ring is full,
+ *  so the samples held for a worker are bounded by `ring_capacity`
+ *  however long its texts are.
+ *
+ *  \par Usage
+ *  The pool must be created before any other thread is started,
+ *  since only the forking thread survives in the workers.
+ *  ```cpp
+ *  espeak_ng::worker_pool pool{4u};
+ *  for (auto const& text : texts) {
+ *    if (pool.is_full()) {
+ *      pool.collect([](short const* samples, std::size_t count) {});
+ *    }
+ *    pool.submit(text);
+ *  }
+ *  while (pool.in_flight() > 0u) {
+ *    pool.collect([](short const* samples, std::size_t count) {});
+ *  }
+ *  ```
+ */
+class worker_pool {
+public:
+  /** \brief Forks `worker_count` workers and waits for them to start.
+   *
+   *  \param worker_count
+   *  Number of processes to fork. Must be positive.
+   *  \param jobs_per_worker
+   *  Jobs that can be queued in each worker.
+   *  \param ring_capacity
+   *  Bytes of shared memory for samples per worker,
+   *  being the most a worker synthesises ahead of collection.
+   *  \param preloaded_voices
+   *  Voices every worker loads before it counts as started.
+   *  \param worker_cpus
+   *  CPUs the workers are pinned to, in turn, if not empty,
+   *  so that they can be kept off a CPU reserved for playback.
+   *  A worker that cannot be pinned runs where the system puts it.
+   *  \exception std::runtime_error
+   *  If forking fails or a worker cannot initialise eSpeak NG
+   *  or load one of the voices.
+   *  The workers already forked are then killed and reaped.
+   */
+  explicit worker_pool(
+      std::size_t worker_count, std::size_t jobs_per_worker = 4u,
+      std::size_t ring_capacity = std::size_t{1u} << 20,
+      std::vector<std::string> preloaded_voices = {},
+      std::vector<int> worker_cpus = {})
+      : jobs_per_worker{jobs_per_worker},
+        preloaded_voices{std::move(preloaded_voices)},
+        worker_cpus{std::move(worker_cpus)} {
+    assert(worker_count > 0u);
+    assert(jobs_per_worker > 0u);
+    // Writing a job to a worker that died should throw,
+    // instead of killing this process with `SIGPIPE`.
+    ::signal(SIGPIPE, SIG_IGN);
+    workers.reserve(worker_count);
+    try {
+      for (std::size_t index = 0u; index < worker_count; ++index) {
+        start_worker(ring_capacity);
+      }
+      for (auto& current_worker : workers) {
+        int worker_sample_rate = 0;
+        if (!posix::read_all(
+                current_worker.notifications, &worker_sample_rate,
+                sizeof(worker_sample_rate)) ||
+            worker_sample_rate <= 0) {
+          throw std::runtime_error("eSpeak NG worker failed to start");
+        }
+        sample_rate = worker_sample_rate;
+        read_load_times(current_worker.notifications);
+      }
+    } catch (...) {
+      // The destructor does not run for a failed constructor.
+      stop_workers(true);
+      throw;
+    }
+  }
+
+  worker_pool(worker_pool const&) = delete;
+  worker_pool& operator=(worker_pool const&) = delete;
+
+  /** \brief Stops the workers and waits for them to exit.
+   *
+   *  Workers with uncollected jobs are killed,
+   *  since they would otherwise wait forever for ring space.
+   */
+  ~worker_pool() { stop_workers(false); }
+
+  /** \brief Sends `text` to the next worker in round-robin order.
+   *
+   *  Must not be called when \ref is_full.
+   */
+  void submit(
+      std::string const& text, synthesis_options const& options = {}) {
+    assert(!is_full());
+    auto& current_worker = workers[next_submission % workers.size()];
+    job_header const header{
+        static_cast<std::uint32_t>(text.size()),
+        static_cast<std::uint32_t>(options.voice_name.size()),
+        options.rate, options.pitch, options.flags};
+    posix::write_all(current_worker.jobs, &header, sizeof(header));
+    posix::write_all(
+        current_worker.jobs, options.voice_name.data(),
+        options.voice_name.size());
+    posix::write_all(current_worker.jobs, text.data(), text.size());
+    ++current_worker.in_flight;
+    ++next_submission;
+  }
+
+  /** \brief Streams the samples of the oldest uncollected job.
+   *
+   *  `on_samples(samples, count)` is called as samples arrive,
+   *  with `samples` pointing into shared memory
+   *  and only valid during the call.
+   *  Returns once the job has finished.
+   *  If `events` is not `nullptr`, the events of the job
+   *  are appended to it, with offsets relative to the job.
+   *
+   *  \exception std::runtime_error
+   *  If synthesis of the job failed or the worker died,
+   *  possibly after some of its samples were given.
+   *  Must only be called if \ref in_flight is positive.
+   */
+  template <typename sample_function>
+  void collect(
+      sample_function&& on_samples, event_timeline* events = nullptr) {
+    assert(in_flight() > 0u);
+    auto& current_worker = workers[next_collection % workers.size()];
+    ++next_collection;
+    --current_worker.in_flight;
+    auto is_finished = false;
+    auto is_failed = false;
+    while (!is_finished) {
+      while (current_worker.ring->empty()) {
+        wait_for_notification(current_worker);
+      }
+      auto const is_writer_waiting = current_worker.ring->read(
+          [&](shared_record_ring::record_header const& header,
+              unsigned char const* first_part, std::size_t first_size,
+              unsigned char const* second_part,
+              std::size_t second_size) {
+            switch (header.type) {
+            case shared_record_ring::record_type::samples:
+              deliver(on_samples, first_part, first_size);
+              deliver(on_samples, second_part, second_size);
+              break;
+            case shared_record_ring::record_type::job_error:
+              is_failed = true;
+              is_finished = true;
+              break;
+            case shared_record_ring::record_type::job_end:
+              is_finished = true;
+              break;
+            case shared_record_ring::record_type::events:
+              if (events) {
+                event_bytes.assign(first_part, first_part + first_size);
+                event_bytes.insert(
+                    event_bytes.end(), second_part,
+                    second_part + second_size);
+                read_events(event_bytes, *events);
+              }
+              break;
+            }
+          });
+      if (is_writer_waiting) {
+        wake_writer(current_worker);
+      }
+    }
+    if (is_failed) {
+      throw std::runtime_error("eSpeak NG worker failed to synthesise");
+    }
+  }
+
+  /** \brief Number of jobs submitted but not collected. */
+  std::size_t in_flight() const {
+    return next_submission - next_collection;
+  }
+
+  /** \brief Whether \ref submit has to wait for a \ref collect. */
+  bool is_full() const {
+    return in_flight() >= jobs_per_worker * workers.size();
+  }
+
+  /** \brief Number of worker processes. */
+  std::size_t size() const { return workers.size(); }
+
+  /** \brief Sample rate of the samples from all workers. */
+  int get_sample_rate() const { return sample_rate; }
+
+  /** \brief Time the slowest worker took to load each voice. */
+  std::vector<voice_load_time> const& get_load_times() const {
+    return load_times;
+  }
+
+  /** \brief Process identifiers of the workers, in order.
+   *
+   *  As for looking up the resources they use.
+   */
+  std::vector<pid_t> process_ids() const {
+    std::vector<pid_t> ids;
+    for (auto const& current_worker : workers) {
+      ids.push_back(current_worker.process_id);
+    }
+    return ids;
+  }
+
+  /** \brief Fixed-size part of an event sent back by a worker.
+   *
+   *  It is followed by `name_size` bytes of the name of the event.
+   */
+  struct wire_event {
+    std::uint32_t sample_offset;
+    std::int32_t text_position;
+    std::int32_t length;
+    std::int32_t number;
+    std::uint32_t type;
+    std::uint32_t name_size;
+  };
+
+private:
+  /** \brief Fixed-size part of a job sent to a worker.
+   *
+   *  It is followed by the voice name and then the text.
+   */
+  struct job_header {
+    std::uint32_t text_size;
+    std::uint32_t voice_name_size;
+    int rate;
+    int pitch;
+    unsigned int flags;
+  };
+
+  /** \brief The parent side of a worker process. */
+  struct worker {
+    pid_t process_id{-1};
+    /** \brief Jobs are written here. */
+    posix::file_descriptor jobs;
+    /** \brief Wake ups are read from here. */
+    posix::file_descriptor notifications;
+    /** \brief Wake ups for a worker waiting for ring space
+     *  are written here.
+     *
+     *  Workers close those of their siblings,
+     *  so the worker reads the end of file once this process is gone.
+     */
+    posix::file_descriptor room;
+    /** \brief Samples are read from here. */
+    std::unique_ptr<shared_record_ring> ring;
+    /** \brief Jobs sent to this worker but not yet collected. */
+    std::size_t in_flight{0u};
+  };
+
+  /** \brief Where a worker writes its results.
+   *
+   *  Writing into a full ring blocks on \ref room
+   *  until the parent has read from it and sent a wake up,
+   *  see \ref shared_record_ring::read.
+   */
+  struct ring_writer {
+    shared_record_ring& ring;
+    /** \brief Wake ups for the parent are written here. */
+    int notifications;
+    /** \brief Wake ups from the parent are read from here. */
+    int room;
+    /** \brief The parent, as recorded before forking. */
+    pid_t parent_id;
+
+    /** \brief Writes one record and wakes the parent up.
+     *
+     *  \exception std::runtime_error
+     *  If the parent is gone.
+     */
+    void write(
+        shared_record_ring::record_type type, void const* payload,
+        std::size_t size) const {
+      auto const wait = [this] { return wait_for_room(); };
+      if (!ring.write(type, payload, size, wait) ||
+          !notify(notifications)) {
+        throw std::runtime_error("Parent of eSpeak NG worker is gone");
+      }
+    }
+
+    /** \brief Blocks until the parent sends a wake up.
+     *
+     *  \return `false` if the parent is gone.
+     */
+    bool wait_for_room() const {
+      if (::getppid() != parent_id) {
+        return false;
+      }
+      char wake_ups[64];
+      auto read = ::read(room, wake_ups, sizeof(wake_ups));
+      while (read == -1 && errno == EINTR) {
+        read = ::read(room, wake_ups, sizeof(wake_ups));
+      }
+      return read > 0;
+    }
+  };
+
+  /** \brief Closes the job pipes and reaps every worker.
+   *
+   *  Workers with uncollected jobs are killed first,
+   *  or all of them if `is_killing_all`.
+   */
+  void stop_workers(bool is_killing_all) {
+    for (auto& current_worker : workers) {
+      current_worker.jobs.reset();
+      if (is_killing_all || current_worker.in_flight > 0u) {
+        ::kill(current_worker.process_id, SIGKILL);
+      }
+    }
+    for (auto& current_worker : workers) {
+      int status = 0;
+      while (-1 == ::waitpid(current_worker.process_id, &status, 0) &&
+             errno == EINTR) {
+      }
+    }
+  }
+
+  /** \brief Forks a worker and appends it to `workers`. */
+  void start_worker(std::size_t ring_capacity) {
+    auto ring = std::make_unique<shared_record_ring>(ring_capacity);
+    auto job_pipe = posix::make_pipe();
+    auto notification_pipe = posix::make_pipe();
+    auto room_pipe = posix::make_pipe();
+    // A wake up is dropped if the worker has some pending already.
+    posix::set_non_blocking(room_pipe.write_end);
+    auto const parent_id = ::getpid();
+    // Only shared with the worker if made before forking it.
+    instrumentation::global_registry();
+    std::fflush(nullptr);
+    auto const process_id = ::fork();
+    posix::throw_if(process_id == -1);
+    if (process_id == 0) {
+      // Only keep the ends of this worker.
+      for (auto& sibling : workers) {
+        sibling.jobs.reset();
+        sibling.notifications.reset();
+        sibling.room.reset();
+      }
+      job_pipe.write_end.reset();
+      notification_pipe.read_end.reset();
+      room_pipe.write_end.reset();
+      if (!worker_cpus.empty()) {
+        // The threads of the engine inherit the affinity.
+        posix::pin_to_cpu(
+            worker_cpus[workers.size() % worker_cpus.size()]);
+      }
+      auto const exit_status = run_worker(
+          job_pipe.read_end,
+          ring_writer{
+              *ring, notification_pipe.write_end, room_pipe.read_end,
+              parent_id});
+      // Skip destructors and `atexit` handlers of the parent.
+      std::_Exit(exit_status);
+    }
+    worker new_worker;
+    new_worker.process_id = process_id;
+    new_worker.jobs = std::move(job_pipe.write_end);
+    new_worker.notifications = std::move(notification_pipe.read_end);
+    new_worker.room = std::move(room_pipe.write_end);
+    new_worker.ring = std::move(ring);
+    workers.push_back(std::move(new_worker));
+  }
+
+  /** \brief Body of a worker process.
+   *
+   *  The main thread reads jobs into a queue.
+   *  A second thread submits them to an \ref engine one at a time,
+   *  streaming the samples into the ring as they are synthesised,
+   *  see \ref ring_sink.
+   *  Reading jobs never waits on the ring,
+   *  so the parent can always send the jobs it is allowed to.
+   *  If the parent is gone, the job being written fails
+   *  and the rest are dropped.
+   */
+  int run_worker(int jobs, ring_writer const& output) {
+    auto const notifications = output.notifications;
+    try {
+      posix::set_non_blocking(notifications);
+      engine worker_engine{1u, preloaded_voices};
+      int const worker_sample_rate = worker_engine.get_sample_rate();
+      posix::write_all(
+          notifications, &worker_sample_rate,
+          sizeof(worker_sample_rate));
+      for (auto const& loaded : worker_engine.get_load_times()) {
+        std::int64_t const nanoseconds = loaded.duration.count();
+        posix::write_all(
+            notifications, &nanoseconds, sizeof(nanoseconds));
+      }
+
+      boni::bounded_queue<synthesis_request> pending{jobs_per_worker};
+      std::thread writer{[&] {
+        ring_sink samples{output};
+        try {
+          while (auto next = pending.pop()) {
+            auto result =
+                worker_engine.submit(std::move(*next), &samples);
+            write_output(result, output);
+          }
+        } catch (std::exception const& error) {
+          std::fprintf(stderr, "eSpeak NG worker: %s\n", error.what());
+          // Nothing more can be given to the parent.
+          pending.close();
+        }
+      }};
+      job_header header;
+      while (posix::read_all(jobs, &header, sizeof(header))) {
+        synthesis_options options;
+        options.voice_name.resize(header.voice_name_size);
+        options.rate = header.rate;
+        options.pitch = header.pitch;
+        options.flags = header.flags;
+        std::string text(header.text_size, '\0');
+        if (!posix::read_all(
+                jobs, options.voice_name.data(),
+                header.voice_name_size) ||
+            !posix::read_all(jobs, text.data(), header.text_size)) {
+          break;
+        }
+        pending.push(
+            synthesis_request{std::move(text), std::move(options)});
+      }
+      pending.close();
+      writer.join();
+      return EXIT_SUCCESS;
+    } catch (std::exception const& error) {
+      std::fprintf(stderr, "eSpeak NG worker: %s\n", error.what());
+      return EXIT_FAILURE;
+    }
+  }
+
+  /** \brief Writes samples into a ring as they are synthesised.
+   *
+   *  Writing waits while the ring is full,
+   *  so a worker synthesising faster than its results are collected
+   *  pauses in the synthesis callback,
+   *  instead of keeping the whole output of a long text in memory.
+   *  The samples of a job in the ring are then at most its capacity.
+   *  Writing throws if the parent is gone, failing the job.
+   */
+  class ring_sink final : public audio::sink {
+  public:
+    explicit ring_sink(ring_writer const& output) : output{output} {}
+
+    void
+    write(short const* samples, std::size_t sample_count) override {
+      auto const max_samples =
+          output.ring.max_payload() / sizeof(short);
+      for (std::size_t offset = 0u; offset < sample_count;
+           offset += max_samples) {
+        auto const count = std::min(max_samples, sample_count - offset);
+        output.write(
+            shared_record_ring::record_type::samples, samples + offset,
+            count * sizeof(short));
+      }
+    }
+
+  private:
+    ring_writer const& output;
+  };
+
+  /** \brief Ends the job of `result` in the ring of `output`.
+   *
+   *  Its samples are already in the ring,
+   *  so only its events are copied, before the end record.
+   *  A failed job ends with an error record instead,
+   *  after whatever samples it streamed.
+   *
+   *  \exception std::runtime_error
+   *  If the parent is gone.
+   */
+  static void write_output(
+      std::future<synthesis_result>& result,
+      ring_writer const& output) {
+    auto type = shared_record_ring::record_type::job_end;
+    try {
+      auto const finished = result.get();
+      write_events(finished.output.timeline, output);
+    } catch (std::exception const& error) {
+      std::fprintf(stderr, "eSpeak NG worker: %s\n", error.what());
+      type = shared_record_ring::record_type::job_error;
+    }
+    output.write(type, nullptr, 0u);
+  }
+
+  /** \brief Copies `timeline` into `ring`, packing records full.
+   *
+   *  Names longer than fit in a record are truncated.
+   */
+  static void write_events(
+      event_timeline const& timeline, ring_writer const& output) {
+    auto const& ring = output.ring;
+    std::vector<unsigned char> payload;
+    auto const send = [&] {
+      if (!payload.empty()) {
+        output.write(
+            shared_record_ring::record_type::events, payload.data(),
+            payload.size());
+        payload.clear();
+      }
+    };
+    auto const max_name_size = ring.max_payload() - sizeof(wire_event);
+    for (std::size_t index = 0u; index < timeline.size(); ++index) {
+      auto const type = timeline.types[index];
+      auto name = event_timeline::is_named(type)
+                      ? std::string_view{timeline.name(index)}
+                      : std::string_view{};
+      name = name.substr(0u, max_name_size);
+      wire_event const event{
+          timeline.sample_offsets[index],
+          timeline.text_positions[index],
+          timeline.lengths[index],
+          timeline.ids[index],
+          type,
+          static_cast<std::uint32_t>(name.size())};
+      if (payload.size() + sizeof(event) + name.size() >
+          ring.max_payload()) {
+        send();
+      }
+      auto const event_bytes =
+          reinterpret_cast<unsigned char const*>(&event);
+      payload.insert(
+          payload.end(), event_bytes, event_bytes + sizeof(event));
+      payload.insert(payload.end(), name.begin(), name.end());
+    }
+    send();
+  }
+
+  /** \brief Appends the events packed in `bytes` to `events`. */
+  static void read_events(
+      std::vector<unsigned char> const& bytes, event_timeline& events) {
+    std::size_t offset = 0u;
+    while (offset + sizeof(wire_event) <= bytes.size()) {
+      wire_event event;
+      std::memcpy(&event, bytes.data() + offset, sizeof(event));
+      offset += sizeof(event);
+      auto const name_size =
+          std::min<std::size_t>(event.name_size, bytes.size() - offset);
+      events.append(
+          event.sample_offset, event.text_position, event.length,
+          static_cast<std::uint8_t>(event.type), event.number,
+          std::string_view{
+              reinterpret_cast<char const*>(bytes.data() + offset),
+              name_size});
+      offset += name_size;
+    }
+  }
+
+  /** \brief Wakes the parent up if it is waiting.
+   *
+   *  The pipe is non-blocking.
+   *  If it is full, the parent has wake ups pending already.
+   *
+   *  \return `false` if the parent is gone.
+   */
+  static bool notify(int notifications) {
+    char const wake_up = 0;
+    while (-1 == ::write(notifications, &wake_up, 1u)) {
+      if (errno == EPIPE) {
+        return false;
+      }
+      if (errno != EINTR) {
+        break;
+      }
+    }
+    return true;
+  }
+
+  /** \brief Wakes up `current_worker` waiting for ring space.
+   *
+   *  The pipe is non-blocking.
+   *  If it is full, the worker has wake ups pending already,
+   *  and if the worker died, collecting reports it instead.
+   */
+  static void wake_writer(worker& current_worker) {
+    char const wake_up = 0;
+    while (-1 == ::write(current_worker.room, &wake_up, 1u) &&
+           errno == EINTR) {
+    }
+  }
+
+  /** \brief Waits for a worker to write something into its ring. */
+  static void wait_for_notification(worker& current_worker) {
+    char wake_ups[64];
+    int const descriptor = current_worker.notifications;
+    auto read = ::read(descriptor, wake_ups, sizeof(wake_ups));
+    while (read == -1 && errno == EINTR) {
+      read = ::read(descriptor, wake_ups, sizeof(wake_ups));
+    }
+    posix::throw_if(read == -1);
+    if (read == 0 && current_worker.ring->empty()) {
+      throw std::runtime_error("eSpeak NG worker died");
+    }
+  }
+
+  /** \brief Gives a part of a samples payload to `on_samples`. */
+  template <typename sample_function>
+  static void deliver(
+      sample_function& on_samples, unsigned char const* bytes,
+      std::size_t size) {
+    if (size > 0u) {
+      on_samples(
+          reinterpret_cast<short const*>(bytes), size / sizeof(short));
+    }
+  }
+
+  /** \brief Reads the load time of each preloaded voice.
+   *
+   *  Workers send them, in order, just after their sample rate.
+   */
+  void read_load_times(int notifications) {
+    if (load_times.empty()) {
+      for (auto const& voice_name : preloaded_voices) {
+        load_times.push_back(
+            voice_load_time{voice_name, std::chrono::nanoseconds{0}});
+      }
+    }
+    for (auto& loaded : load_times) {
+      std::int64_t nanoseconds = 0;
+      if (!posix::read_all(
+              notifications, &nanoseconds, sizeof(nanoseconds))) {
+        throw std::runtime_error("eSpeak NG worker failed to start");
+      }
+      loaded.duration =
+          std::max(loaded.duration, std::chrono::nanoseconds{
+                                        nanoseconds});
+    }
+  }
+
+  /** \brief Maximum number of jobs in flight per worker. */
+  std::size_t const jobs_per_worker;
+  /** \brief Voices each worker loads on start. */
+  std::vector<std::string> const preloaded_voices;
+  /** \brief CPUs the workers are pinned to in turn, if any. */
+  std::vector<int> const worker_cpus;
+  /** \brief Slowest load time of each preloaded voice. */
+  std::vector<voice_load_time> load_times;
+  /** \brief The forked workers, in round-robin order. */
+  std::vector<worker> workers;
+  /** \brief Index of the next job to be submitted. */
+  std::size_t next_submission{0u};
+  /** \brief Index of the next job to be collected. */
+  std::size_t next_collection{0u};
+  /** \brief Sample rate reported by the workers. */
+  int sample_rate{0};
+  /** \brief Events record being read, reused between records. */
+  std::vector<unsigned char> event_bytes;
+};
+
+} // namespace espeak_ng
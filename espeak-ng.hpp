@@ -1,13 +1,37 @@
 #pragma once
 
+// Local dependencies.
+#include "audio.hpp"
+#include "boni.hpp"
+#include "espeak-ng-scheduler.hpp"
+#include "instrumentation.hpp"
+
 // External dependencies.
 #include <espeak-ng/espeak_ng.h>
 
 // Standard C++ libraries.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 // Standard C libraries.
 #include <cassert>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
 
 /** \brief RAII wrappers for eSpeak NG functions.
@@ -210,4 +234,1032 @@ public:
   }
 };
 
+/** \brief Voice settings for one synthesis job of \ref engine.
+ *
+ *  eSpeak NG keeps these in global state,
+ *  so every job sets all of them instead of inheriting
+ *  whatever the previous job used.
+ */
+struct synthesis_options {
+  /** \brief Given to `espeak_ng_SetVoiceByName`. */
+  std::string voice_name{"en"};
+  /** \brief Speaking rate in words per minute, for `espeakRATE`. */
+  int rate{175};
+  /** \brief Base pitch from `0` to `100`, for `espeakPITCH`. */
+  int pitch{50};
+  /** \brief The `flags` argument of `espeak_ng_Synthesize`. */
+  unsigned int flags{espeakCHARS_AUTO};
+};
+
+/** \brief Word, sentence, mark and phoneme events of one synthesis.
+ *
+ *  \par Purpose
+ *  eSpeak NG reports where in the audio each word, sentence,
+ *  SSML mark and phoneme starts.
+ *  Lip-sync and captioning need exactly that,
+ *  so this keeps the events alongside the samples
+ *  instead of them having to synthesise again to get timings.
+ *
+ *  \par Layout
+ *  Events are stored as a structure of arrays,
+ *  one entry per event in each of the public vectors,
+ *  so that scanning, say, only sample offsets touches only them.
+ *  Unlike `espeak_EVENT`, nothing refers to memory owned by eSpeak NG.
+ *  Names of marks and audio elements, and phoneme mnemonics,
+ *  are copied into \ref names, and their `ids` are offsets into it.
+ *  For other events, `ids` are the numbers eSpeak NG gave them.
+ *
+ *  \par Usage
+ *  ```cpp
+ *  for (std::size_t index = 0u; index < timeline.size(); ++index) {
+ *    if (timeline.types[index] == espeakEVENT_WORD) {
+ *      show_word_at(
+ *          timeline.sample_offsets[index],
+ *          timeline.text_positions[index], timeline.lengths[index]);
+ *    }
+ *  }
+ *  ```
+ */
+class event_timeline {
+public:
+  /** \brief Creates an empty timeline with room for `capacity` events.
+   *
+   *  Events up to that number are appended without allocating.
+   */
+  explicit event_timeline(std::size_t capacity = 64u) {
+    reserve(capacity);
+  }
+
+  /** \brief Makes room for `capacity` events in total. */
+  void reserve(std::size_t capacity) {
+    sample_offsets.reserve(capacity);
+    text_positions.reserve(capacity);
+    lengths.reserve(capacity);
+    types.reserve(capacity);
+    ids.reserve(capacity);
+  }
+
+  /** \brief Adds `event`, received while synthesising at `sample_rate`.
+   *
+   *  List terminators and sample rate changes are not timeline events
+   *  and are ignored.
+   */
+  void append(espeak_EVENT const& event, int sample_rate) {
+    std::int32_t id = 0;
+    switch (event.type) {
+    case espeakEVENT_LIST_TERMINATED:
+    case espeakEVENT_SAMPLERATE:
+      return;
+    case espeakEVENT_MARK:
+    case espeakEVENT_PLAY:
+      id = add_name(event.id.name != nullptr ? event.id.name : "");
+      break;
+    case espeakEVENT_PHONEME:
+      // The mnemonic is only terminated if shorter than the array.
+      id = add_name(std::string{
+          event.id.string,
+          std::find(
+              std::begin(event.id.string), std::end(event.id.string),
+              '\0')});
+      break;
+    case espeakEVENT_WORD:
+    case espeakEVENT_SENTENCE:
+    case espeakEVENT_END:
+    case espeakEVENT_MSG_TERMINATED:
+      id = event.id.number;
+      break;
+    }
+    // Positions are reported in milliseconds.
+    sample_offsets.push_back(static_cast<std::uint32_t>(
+        static_cast<std::uint64_t>(event.audio_position) * sample_rate /
+        1000u));
+    text_positions.push_back(event.text_position);
+    lengths.push_back(event.length);
+    types.push_back(static_cast<std::uint8_t>(event.type));
+    ids.push_back(id);
+  }
+
+  /** \brief Adds an event given as it is stored.
+   *
+   *  \param number
+   *  The id of the event, unless it is of a named type.
+   *  \param name
+   *  The name of the event, if it is of a named type.
+   */
+  void append(
+      std::uint32_t sample_offset, std::int32_t text_position,
+      std::int32_t length, std::uint8_t type, std::int32_t number,
+      std::string_view name) {
+    sample_offsets.push_back(sample_offset);
+    text_positions.push_back(text_position);
+    lengths.push_back(length);
+    types.push_back(type);
+    ids.push_back(is_named(type) ? add_name(name) : number);
+  }
+
+  /** \brief Adds every event of `other`, moved along.
+   *
+   *  Used to join the timelines of consecutive parts of a text,
+   *  with `sample_shift` the number of samples before the part
+   *  and `text_shift` its position in the whole text.
+   */
+  void append(
+      event_timeline const& other, std::uint32_t sample_shift,
+      std::int32_t text_shift) {
+    reserve(size() + other.size());
+    for (std::size_t index = 0u; index < other.size(); ++index) {
+      auto const type = other.types[index];
+      append(
+          other.sample_offsets[index] + sample_shift,
+          other.text_positions[index] + text_shift,
+          other.lengths[index], type, other.ids[index],
+          is_named(type) ? std::string_view{other.name(index)}
+                         : std::string_view{});
+    }
+  }
+
+  /** \brief Whether `ids` of events of `type` index \ref names. */
+  static bool is_named(std::uint8_t type) {
+    return type == espeakEVENT_MARK || type == espeakEVENT_PLAY ||
+           type == espeakEVENT_PHONEME;
+  }
+
+  /** \brief Number of events. */
+  std::size_t size() const { return types.size(); }
+
+  bool empty() const { return types.empty(); }
+
+  /** \brief Name of the event at `index`.
+   *
+   *  Only meaningful for marks, audio elements and phonemes.
+   */
+  char const* name(std::size_t index) const {
+    return names.c_str() + ids[index];
+  }
+
+  /** \brief Bytes used by the stored events, for budgeting. */
+  std::size_t size_in_bytes() const {
+    return size() * (sizeof(sample_offsets.front()) +
+                     sizeof(text_positions.front()) +
+                     sizeof(lengths.front()) + sizeof(types.front()) +
+                     sizeof(ids.front())) +
+           names.size();
+  }
+
+  /** \brief Offset into the samples where each event happens. */
+  std::vector<std::uint32_t> sample_offsets;
+  /** \brief Position in the text, starting at `1`, of each event. */
+  std::vector<std::int32_t> text_positions;
+  /** \brief Length in the text of each word, or `0`. */
+  std::vector<std::int32_t> lengths;
+  /** \brief The `espeak_EVENT_TYPE` of each event. */
+  std::vector<std::uint8_t> types;
+  /** \brief Number, or offset into \ref names, of each event. */
+  std::vector<std::int32_t> ids;
+  /** \brief Names of events, each terminated by `'\0'`. */
+  std::string names;
+
+private:
+  /** \brief Copies `name` into \ref names and returns its offset. */
+  std::int32_t add_name(std::string_view name) {
+    auto const offset = static_cast<std::int32_t>(names.size());
+    names += name;
+    names.push_back('\0');
+    return offset;
+  }
+};
+
+/** \brief Receives events as soon as they are added to a timeline.
+ *
+ *  Subscribers let, say, captions follow synthesis live
+ *  instead of waiting for the whole text.
+ */
+class event_subscriber {
+public:
+  virtual ~event_subscriber() = default;
+
+  /** \brief Called with the events from `first` onward of `timeline`.
+   *
+   *  Earlier events were already delivered, and `timeline` is only
+   *  valid during the call.
+   */
+  virtual void
+  on_events(event_timeline const& timeline, std::size_t first) = 0;
+};
+
+/** \brief Everything produced by one synthesis job of \ref engine. */
+struct synthesis_output {
+  /** \brief Samples at `espeak_ng_GetSampleRate()`, mono. */
+  audio::pcm_buffer samples;
+  /** \brief Events, in order received. */
+  event_timeline timeline;
+};
+
+/** \brief Text and options of one synthesis job of \ref engine.
+ *
+ *  \par Ownership
+ *  The text is either owned, moved in as a `std::string`,
+ *  or borrowed from storage the caller keeps alive,
+ *  such as a network buffer or an arena,
+ *  until the \ref synthesis_result handed back for it is destroyed.
+ *  Either way, \ref text is a view and the characters are not copied
+ *  while the request moves from a queue to the synthesis thread.
+ *  Like \ref audio::pcm_buffer, it can be moved but not copied,
+ *  so that exactly one owner is responsible for the text at a time.
+ *
+ *  \par Termination
+ *  eSpeak NG reads text up to a null character.
+ *  Owned text and text borrowed from a `std::string` or C string
+ *  are known to have one, and are given to eSpeak NG in place.
+ *  Other borrowed views are copied once by the synthesis thread
+ *  into storage it reuses between jobs.
+ *
+ *  \par Usage
+ *  ```cpp
+ *  // Owned.
+ *  engine.submit(espeak_ng::synthesis_request{std::move(text)});
+ *  // Borrowed, `body` staying alive until the result is collected.
+ *  auto pending = engine.submit(
+ *      espeak_ng::synthesis_request::borrowing(body));
+ *  ```
+ */
+class synthesis_request {
+public:
+  synthesis_request() = default;
+
+  /** \brief Owns `text`. */
+  explicit synthesis_request(
+      std::string text, synthesis_options options = {})
+      : voice_options{std::move(options)},
+        owned_text{std::move(text)} {}
+
+  synthesis_request(synthesis_request const&) = delete;
+  synthesis_request& operator=(synthesis_request const&) = delete;
+  synthesis_request(synthesis_request&&) = default;
+  synthesis_request& operator=(synthesis_request&&) = default;
+
+  /** \brief Borrows `text`, which is not known to be terminated. */
+  static synthesis_request borrowing(
+      std::string_view text, synthesis_options options = {}) {
+    return synthesis_request{text, false, std::move(options)};
+  }
+
+  /** \brief Borrows a null-terminated `text`. */
+  static synthesis_request
+  borrowing(char const* text, synthesis_options options = {}) {
+    return synthesis_request{text, true, std::move(options)};
+  }
+
+  /** \brief Borrows `text`, which must outlive the request. */
+  static synthesis_request borrowing(
+      std::string const& text, synthesis_options options = {}) {
+    return synthesis_request{text, true, std::move(options)};
+  }
+
+  /** \brief Would borrow a temporary, so use the owning constructor. */
+  static synthesis_request
+  borrowing(std::string&& text, synthesis_options options = {}) =
+      delete;
+
+  /** \brief The text to synthesise. */
+  std::string_view text() const {
+    return is_borrowed ? borrowed_text : std::string_view{owned_text};
+  }
+
+  /** \brief Whether a null character follows \ref text. */
+  bool is_null_terminated() const {
+    return !is_borrowed || is_borrowed_text_terminated;
+  }
+
+  /** \brief Voice settings to synthesise with. */
+  synthesis_options const& options() const { return voice_options; }
+
+private:
+  synthesis_request(
+      std::string_view text, bool is_terminated,
+      synthesis_options options)
+      : voice_options{std::move(options)}, borrowed_text{text},
+        is_borrowed{true}, is_borrowed_text_terminated{is_terminated} {}
+
+  synthesis_options voice_options;
+  /** \brief Used unless \ref is_borrowed.
+   *
+   *  The view is made on demand, in \ref text,
+   *  since a short string moves its characters along with it.
+   */
+  std::string owned_text;
+  std::string_view borrowed_text;
+  bool is_borrowed{false};
+  bool is_borrowed_text_terminated{false};
+};
+
+/** \brief A finished job of \ref engine, with its request.
+ *
+ *  The request is handed back so that borrowed text
+ *  is known to be no longer in use once the result is taken,
+ *  and so that the text can be used, say, as a cache key,
+ *  without having been copied.
+ *  Samples stay in the blocks they were synthesised into.
+ */
+struct synthesis_result {
+  synthesis_request request;
+  synthesis_output output;
+  /** \brief When the synthesis thread first took up the job,
+   *  so that the time it was queued for can be told apart.
+   */
+  std::chrono::steady_clock::time_point started_at;
+};
+
+/** \brief Time taken to load one voice. */
+struct voice_load_time {
+  std::string voice_name;
+  std::chrono::nanoseconds duration;
+};
+
+/** \brief An installed voice, as listed by `espeak_ListVoices`. */
+struct voice_entry {
+  /** \brief Such as `English (Great Britain)`. */
+  std::string name;
+  /** \brief Path of its file under the voice directories,
+   *  such as `gmw/en`, for `espeak_ng_SetVoiceByFile`.
+   */
+  std::string identifier;
+};
+
+/** \brief Installed voices, to load by file instead of by name.
+ *
+ *  \par Purpose
+ *  `espeak_ng_SetVoiceByName` lists every installed voice,
+ *  reading each voice file, the first time it is called,
+ *  and that scan can take longer than the rest of start-up.
+ *  A voice found here is loaded by its file directly instead.
+ *  The inventory itself can be cached between runs,
+ *  see `espeak_ng::startup_manifest`.
+ *
+ *  \par Lookup
+ *  A voice is found by its name or by the last part of its identifier,
+ *  ignoring case, as `espeak_ng_SetVoiceByName` would.
+ *  Names with a variant, as in `en+f3`, are not looked up,
+ *  and are left to `espeak_ng_SetVoiceByName`.
+ */
+class voice_inventory {
+public:
+  voice_inventory() = default;
+
+  explicit voice_inventory(std::vector<voice_entry> entries)
+      : voice_entries{std::move(entries)} {
+    for (std::size_t index = 0u; index < voice_entries.size();
+         ++index) {
+      auto const& entry = voice_entries[index];
+      std::string_view identifier{entry.identifier};
+      auto const separator = identifier.rfind('/');
+      if (separator != std::string_view::npos) {
+        identifier.remove_prefix(separator + 1u);
+      }
+      // The first voice listed for a key wins, as in eSpeak NG.
+      by_key.emplace(lowered(entry.name), index);
+      by_key.emplace(lowered(identifier), index);
+    }
+  }
+
+  /** \brief Lists the voices installed.
+   *
+   *  Must only be called on the thread using the \ref service.
+   */
+  static voice_inventory list_installed() {
+    std::vector<voice_entry> entries;
+    auto const* voices = espeak_ListVoices(nullptr);
+    for (; voices != nullptr && *voices != nullptr; ++voices) {
+      auto const& voice = **voices;
+      if (voice.name != nullptr && voice.identifier != nullptr) {
+        entries.push_back(voice_entry{voice.name, voice.identifier});
+      }
+    }
+    return voice_inventory{std::move(entries)};
+  }
+
+  /** \brief Identifier of `voice_name`, or `nullptr` if not known. */
+  std::string const* find(std::string_view voice_name) const {
+    if (voice_name.find('+') != std::string_view::npos) {
+      return nullptr;
+    }
+    auto const found = by_key.find(lowered(voice_name));
+    if (found == by_key.end()) {
+      return nullptr;
+    }
+    return &voice_entries[found->second].identifier;
+  }
+
+  std::vector<voice_entry> const& entries() const {
+    return voice_entries;
+  }
+
+private:
+  static std::string lowered(std::string_view text) {
+    std::string result{text};
+    for (auto& character : result) {
+      character = static_cast<char>(
+          std::tolower(static_cast<unsigned char>(character)));
+    }
+    return result;
+  }
+
+  std::vector<voice_entry> voice_entries;
+  /** \brief Lowered names and identifiers to entry indices. */
+  std::unordered_map<std::string, std::size_t> by_key;
+};
+
+/** \brief Loads voices up front and switches between them per job.
+ *
+ *  \par Purpose
+ *  The first request for a voice pays for reading its voice file,
+ *  phoneme data and dictionary.
+ *  Loading the configured voices at startup
+ *  moves that cost, and any failure from a misspelt voice,
+ *  out of the first request and into start-up,
+ *  where the time taken for each voice is also recorded.
+ *
+ *  \par Switching
+ *  eSpeak NG holds one voice at a time,
+ *  so switching to another still reloads it,
+ *  though from files the operating system has already cached.
+ *  Selecting the voice that is already loaded does nothing,
+ *  so consecutive jobs with the same voice skip loading altogether.
+ *
+ *  \par Inventory
+ *  Given a \ref voice_inventory,
+ *  voices in it are loaded by file,
+ *  skipping the scan of every installed voice.
+ *
+ *  \par Usage
+ *  Like the rest of the C API,
+ *  it must only be used on the thread using the \ref service.
+ *  ```cpp
+ *  espeak_ng::voice_pool voices;
+ *  voices.preload({"en", "de", "fr"});
+ *  voices.write_report(stderr);
+ *  voices.select("de"); // Per job.
+ *  ```
+ */
+class voice_pool {
+public:
+  /** \brief Loads voices by name only. */
+  voice_pool() = default;
+
+  /** \brief Loads voices in `inventory`, not owned, by file. */
+  explicit voice_pool(voice_inventory const* inventory)
+      : inventory{inventory} {}
+
+  /** \brief Loads each of `voice_names` once, in order.
+   *
+   *  \exception std::runtime_error
+   *  If any of the voices fails to load.
+   */
+  void preload(std::vector<std::string> const& voice_names) {
+    for (auto const& voice_name : voice_names) {
+      auto const start = std::chrono::steady_clock::now();
+      load(voice_name);
+      load_times.push_back(voice_load_time{
+          voice_name, std::chrono::steady_clock::now() - start});
+    }
+  }
+
+  /** \brief Makes `voice_name` the voice used for synthesis.
+   *
+   *  \exception std::runtime_error
+   *  If the voice fails to load.
+   */
+  void select(std::string const& voice_name) {
+    if (voice_name != current_voice_name) {
+      load(voice_name);
+      ++switch_count;
+    }
+  }
+
+  /** \brief Load times recorded by \ref preload, in order. */
+  std::vector<voice_load_time> const& get_load_times() const {
+    return load_times;
+  }
+
+  /** \brief Number of times \ref select had to load a voice. */
+  std::uint64_t switches() const { return switch_count; }
+
+  /** \brief Writes the load time of each preloaded voice. */
+  void write_report(std::FILE* output) const {
+    for (auto const& loaded : load_times) {
+      std::fprintf(
+          output, "Loaded voice \"%s\" in %.3f ms.\n",
+          loaded.voice_name.c_str(),
+          std::chrono::duration<double, std::milli>(loaded.duration)
+              .count());
+    }
+  }
+
+private:
+  void load(std::string const& voice_name) {
+    // Forget the current voice first in case loading fails part way.
+    current_voice_name.clear();
+    auto const identifier =
+        inventory ? inventory->find(voice_name) : nullptr;
+    throw_if_not_ok(
+        identifier ? espeak_ng_SetVoiceByFile(identifier->c_str())
+                   : espeak_ng_SetVoiceByName(voice_name.c_str()));
+    current_voice_name = voice_name;
+  }
+
+  /** \brief Voices to load by file, if not `nullptr`. */
+  voice_inventory const* inventory{nullptr};
+  /** \brief Voice eSpeak NG has loaded, or empty if not known. */
+  std::string current_voice_name;
+  std::vector<voice_load_time> load_times;
+  std::uint64_t switch_count{0u};
+};
+
+/** \brief Runs eSpeak NG synthesis jobs on a dedicated thread.
+ *
+ *  \par Purpose
+ *  The C API of eSpeak NG is not thread-safe
+ *  and synthesises one text at a time using global state.
+ *  This class owns the \ref service and makes every C API call
+ *  from a single thread,
+ *  while any number of other threads \ref submit text to it
+ *  through a bounded queue.
+ *  A full queue makes \ref submit wait,
+ *  so that producers are slowed down to the synthesis speed
+ *  instead of queueing unbounded amounts of text.
+ *
+ *  \par Scheduling
+ *  Jobs are run in the order of a \ref job_scheduler,
+ *  so interactive jobs go before bulk ones,
+ *  and tenants share the synthesis thread fairly.
+ *  A bulk job also gives way when an interactive job is waiting,
+ *  at the start of its next sentence,
+ *  by returning `1` from the synthesis callback.
+ *  The samples up to there are kept,
+ *  and the rest of its text is synthesised once it is next in turn,
+ *  with the events of the parts joined into one timeline.
+ *  SSML jobs are not cut, since the rest of a document
+ *  would not be well-formed on its own.
+ *
+ *  \par Usage
+ *  Only one engine, or one \ref service, should exist at a time,
+ *  since they share the global state of eSpeak NG.
+ *  ```cpp
+ *  espeak_ng::engine engine;
+ *  auto pending = engine.submit("Hello world.");
+ *  // Do other things in the mean time.
+ *  auto const result = pending.get();
+ *  ```
+ */
+class engine {
+public:
+  /** \brief Starts the synthesis thread and initialises eSpeak NG.
+   *
+   *  \param queue_capacity
+   *  Number of submitted jobs of each \ref job_priority
+   *  that can wait for synthesis before \ref submit starts waiting.
+   *  \param preloaded_voices
+   *  Voices to load, and time, as part of initialisation.
+   *  \exception std::runtime_error
+   *  If initialisation, including loading a voice, fails.
+   *
+   *  Returns only after initialisation has finished,
+   *  so that the sample rate can be queried immediately
+   *  and the first job does not wait for voices to load.
+   */
+  explicit engine(
+      std::size_t queue_capacity = 64u,
+      std::vector<std::string> preloaded_voices = {})
+      : jobs{queue_capacity},
+        preloaded_voices{std::move(preloaded_voices)} {
+    std::promise<int> started;
+    auto started_future = started.get_future();
+    synthesis_thread = std::thread{
+        [this, &started] { run(std::move(started)); }};
+    try {
+      sample_rate = started_future.get();
+    } catch (...) {
+      synthesis_thread.join();
+      throw;
+    }
+  }
+
+  // The synthesis thread refers to `this`.
+  engine(engine const&) = delete;
+  engine& operator=(engine const&) = delete;
+
+  /** \brief Finishes all submitted jobs and terminates eSpeak NG. */
+  ~engine() {
+    jobs.close();
+    synthesis_thread.join();
+  }
+
+  /** \brief Queues `request` for synthesis.
+   *
+   *  \param stream
+   *  If not `nullptr`, receives the samples as they are synthesised,
+   *  on the synthesis thread, instead of them being kept in the output.
+   *  It is finished once synthesis succeeds,
+   *  before the future becomes ready.
+   *  An exception from it stops the synthesis
+   *  and is passed on through the future.
+   *  It must stay alive until the future is ready.
+   *  \param schedule
+   *  Where the job goes in the queue. Interactive by default.
+   *  \return A future for the samples and events produced,
+   *  along with `request`.
+   *  It holds an exception instead if synthesis failed,
+   *  and text borrowed by `request` is no longer in use
+   *  once it is ready either way.
+   *
+   *  Waits if the queue of its priority is full.
+   *  Safe to call from any number of threads.
+   */
+  std::future<synthesis_result> submit(
+      synthesis_request request, audio::sink* stream = nullptr,
+      job_schedule schedule = {}) {
+    return submit_with(
+        synthesis_callback<audio::sink>, std::move(request), stream,
+        std::move(schedule));
+  }
+
+  /** \brief Queues `request`, streaming to a sink of known type.
+   *
+   *  As the other overload, but chosen for a `final` sink,
+   *  so that the synthesis callback made for `stream_type`
+   *  writes each chunk with a direct call instead of a virtual one.
+   */
+  template <
+      typename stream_type,
+      typename = std::enable_if_t<
+          std::is_base_of<audio::sink, stream_type>::value &&
+          std::is_final<stream_type>::value>>
+  std::future<synthesis_result> submit(
+      synthesis_request request, stream_type* stream,
+      job_schedule schedule = {}) {
+    return submit_with(
+        synthesis_callback<stream_type>, std::move(request), stream,
+        std::move(schedule));
+  }
+
+  /** \brief Queues `text`, owned by the request, for synthesis. */
+  std::future<synthesis_result> submit(
+      std::string text, synthesis_options options = {},
+      audio::sink* stream = nullptr, job_schedule schedule = {}) {
+    return submit(
+        synthesis_request{std::move(text), std::move(options)}, stream,
+        std::move(schedule));
+  }
+
+  /** \brief Queues `text`, streaming to a sink of known type. */
+  template <
+      typename stream_type,
+      typename = std::enable_if_t<
+          std::is_base_of<audio::sink, stream_type>::value &&
+          std::is_final<stream_type>::value>>
+  std::future<synthesis_result> submit(
+      std::string text, synthesis_options options,
+      stream_type* stream, job_schedule schedule = {}) {
+    return submit(
+        synthesis_request{std::move(text), std::move(options)}, stream,
+        std::move(schedule));
+  }
+
+  /** \brief Sample rate of all \ref synthesis_output::samples. */
+  int get_sample_rate() const { return sample_rate; }
+
+  /** \brief Time taken to load each of the preloaded voices. */
+  std::vector<voice_load_time> const& get_load_times() const {
+    return load_times;
+  }
+
+  /** \brief Number of times a bulk job gave way. */
+  std::uint64_t preemptions() const {
+    return preemption_count.load(std::memory_order_relaxed);
+  }
+
+private:
+  /** \brief A submitted request and where to put its result. */
+  struct job {
+    job(synthesis_request request, audio::sink* stream,
+        t_espeak_callback* callback)
+        : request{std::move(request)}, stream{stream},
+          callback{callback} {}
+
+    synthesis_request request;
+    /** \brief Receives the samples if not `nullptr`. */
+    audio::sink* stream;
+    /** \brief \ref synthesis_callback for the type of \ref stream. */
+    t_espeak_callback* callback;
+    std::promise<synthesis_result> result;
+    /** \brief Synthesised before giving way, if it has. */
+    synthesis_output output;
+    /** \brief Bytes of the text already synthesised. */
+    std::size_t text_offset{0u};
+    /** \brief The same text, in characters as eSpeak NG counts them. */
+    std::int32_t character_offset{0};
+    /** \brief Samples already synthesised. */
+    std::uint64_t sample_offset{0u};
+    /** \brief When first taken up, if it has been, even if resumed. */
+    std::optional<std::chrono::steady_clock::time_point> started_at;
+  };
+
+  /** \brief The `user_data` of a synthesis. */
+  struct job_state {
+    synthesis_output* output;
+    audio::sink* stream;
+    /** \brief Thrown by \ref stream, to be rethrown after synthesis. */
+    std::exception_ptr stream_error;
+    /** \brief Given way to if not `nullptr`. */
+    job_scheduler<job> const* pre_emptor;
+    /** \brief Added to the offsets of events, if resumed. */
+    std::uint64_t sample_shift;
+    std::int32_t text_shift;
+    /** \brief Samples kept from this call of `espeak_ng_Synthesize`. */
+    std::uint64_t run_samples{0u};
+    /** \brief Text position of the sentence given way at, or `0`. */
+    std::int32_t pre_empted_at{0};
+    /** \brief Sample offset of that sentence in this call. */
+    std::uint64_t pre_empted_sample{0u};
+  };
+
+  /** \brief Queues a job synthesised through `callback`. */
+  std::future<synthesis_result> submit_with(
+      t_espeak_callback* callback, synthesis_request request,
+      audio::sink* stream, job_schedule schedule) {
+    job new_job{std::move(request), stream, callback};
+    auto result = new_job.result.get_future();
+    if (!jobs.push(std::move(new_job), std::move(schedule))) {
+      throw std::logic_error("eSpeak NG engine is shutting down");
+    }
+    return result;
+  }
+
+  /** \brief Body of the synthesis thread. */
+  void run(std::promise<int> started) {
+    std::unique_ptr<service> running_service;
+    try {
+      espeak_ng_InitializePath(nullptr);
+      running_service = std::make_unique<service>();
+      throw_if_not_ok(espeak_ng_InitializeOutput(
+          ENOUTPUT_MODE_SYNCHRONOUS, 0, nullptr));
+      voices.preload(preloaded_voices);
+      // Read by other threads only after `started` is satisfied.
+      load_times = voices.get_load_times();
+      started.set_value(espeak_ng_GetSampleRate());
+    } catch (...) {
+      started.set_exception(std::current_exception());
+      return;
+    }
+    while (auto next = jobs.pop()) {
+      auto& next_job = next->job;
+      auto const is_preemptible =
+          next->schedule.priority == job_priority::bulk;
+      auto const start = std::chrono::steady_clock::now();
+      if (!next_job.started_at) {
+        next_job.started_at = start;
+      }
+      auto const charge = [&] {
+        jobs.charge(
+            next->schedule.tenant,
+            std::chrono::steady_clock::now() - start);
+      };
+      try {
+        auto const is_finished = synthesise(next_job, is_preemptible);
+        charge();
+        if (!is_finished) {
+          preemption_count.fetch_add(1u, std::memory_order_relaxed);
+          jobs.resume(std::move(*next));
+          continue;
+        }
+        next_job.result.set_value(synthesis_result{
+            std::move(next_job.request), std::move(next_job.output),
+            *next_job.started_at});
+      } catch (...) {
+        charge();
+        next_job.result.set_exception(std::current_exception());
+      }
+    }
+  }
+
+  /** \brief Applies the options of `current_job` and synthesises it.
+   *
+   *  \return Whether the job finished,
+   *  instead of giving way to an interactive job.
+   *  It can only give way if `is_preemptible`.
+   */
+  bool synthesise(job& current_job, bool is_preemptible) {
+    auto const& request = current_job.request;
+    auto const& options = request.options();
+    voices.select(options.voice_name);
+    throw_if_not_ok(
+        espeak_ng_SetParameter(espeakRATE, options.rate, 0));
+    throw_if_not_ok(
+        espeak_ng_SetParameter(espeakPITCH, options.pitch, 0));
+    auto const can_give_way = is_preemptible &&
+                              (options.flags & espeakSSML) == 0u &&
+                              is_resumable(options.flags);
+    job_state state{
+        &current_job.output,
+        current_job.stream,
+        nullptr,
+        can_give_way ? &jobs : nullptr,
+        current_job.sample_offset,
+        current_job.character_offset};
+    // The rest of a terminated text is terminated too.
+    auto const text = request.text().substr(current_job.text_offset);
+    auto terminated_text = text.data();
+    if (!request.is_null_terminated()) {
+      terminated_copy.assign(text);
+      terminated_text = terminated_copy.c_str();
+    }
+    // Only stores a pointer, matching it to the type of the stream.
+    espeak_SetSynthCallback(current_job.callback);
+    auto const status = espeak_ng_Synthesize(
+        terminated_text, text.size() + 1, 0, POS_CHARACTER, 0,
+        options.flags, nullptr, &state);
+    if (state.stream_error) {
+      // Restores parameters the stopped text may have changed.
+      throw_if_not_ok(espeak_ng_Cancel());
+      std::rethrow_exception(state.stream_error);
+    }
+    if (state.pre_empted_at > 0) {
+      throw_if_not_ok(espeak_ng_Cancel());
+      auto const characters = state.pre_empted_at - 1;
+      current_job.text_offset +=
+          prefix_size(text, characters, options.flags);
+      current_job.character_offset += characters;
+      current_job.sample_offset += state.run_samples;
+      return false;
+    }
+    throw_if_not_ok(status);
+    if (state.stream) {
+      state.stream->finish();
+    }
+    return true;
+  }
+
+  /** \brief Whether \ref prefix_size knows the encoding in `flags`.
+   *
+   *  Text in `espeakCHARS_WCHAR` or `espeakCHARS_16BIT`
+   *  is not cut, since it is not stored as bytes of its characters.
+   */
+  static bool is_resumable(unsigned int flags) {
+    auto const encoding = flags & 7u;
+    return encoding == espeakCHARS_AUTO ||
+           encoding == espeakCHARS_UTF8 || encoding == espeakCHARS_8BIT;
+  }
+
+  /** \brief Bytes taken by the first `characters` of `text`.
+   *
+   *  eSpeak NG counts text positions in characters,
+   *  which are bytes only for 8-bit encodings.
+   *  UTF-8 is decoded as eSpeak NG does, see \ref utf8_character.
+   *  With `espeakCHARS_AUTO`, eSpeak NG reads the rest of the text
+   *  as 8-bit from the first invalid UTF-8 sequence on.
+   *  The encoding must be one that \ref is_resumable.
+   */
+  static std::size_t prefix_size(
+      std::string_view text, std::int32_t characters,
+      unsigned int flags) {
+    assert(is_resumable(flags));
+    auto const count = static_cast<std::size_t>(characters);
+    auto const encoding = flags & 7u;
+    if (encoding == espeakCHARS_8BIT) {
+      return std::min(count, text.size());
+    }
+    std::size_t offset = 0u;
+    for (std::size_t decoded = 0u;
+         decoded < count && offset < text.size(); ++decoded) {
+      auto const [size, is_valid] = utf8_character(text.substr(offset));
+      if (!is_valid && encoding == espeakCHARS_AUTO) {
+        return std::min(offset + (count - decoded), text.size());
+      }
+      offset += size;
+    }
+    return offset;
+  }
+
+  /** \brief Bytes eSpeak NG takes as the first character of `text`,
+   *  and whether they are a valid UTF-8 sequence.
+   *
+   *  A stray continuation byte is one character.
+   *  A sequence cut short by a byte that does not continue it
+   *  is one character, up to that byte.
+   *  `text` must not be empty.
+   */
+  static std::pair<std::size_t, bool>
+  utf8_character(std::string_view text) {
+    auto const byte = [&text](std::size_t index) {
+      return static_cast<unsigned char>(text[index]);
+    };
+    auto const lead = byte(0u);
+    std::size_t const length = lead < 0x80u   ? 1u
+                               : lead < 0xc0u ? 0u
+                               : lead < 0xe0u ? 2u
+                               : lead < 0xf0u ? 3u
+                               : lead < 0xf8u ? 4u
+                                              : 0u;
+    if (length == 0u) {
+      return {1u, false};
+    }
+    std::size_t size = 1u;
+    while (size < length && size < text.size() &&
+           (byte(size) & 0xc0u) == 0x80u) {
+      ++size;
+    }
+    return {size, size == length};
+  }
+
+  /** \brief Appends eSpeak NG output to the \ref job_state
+   *  given as `user_data`.
+   *
+   *  The stream of the state is a `stream_type`,
+   *  so that writing to a `final` sink is a direct call
+   *  the compiler can inline, instead of a virtual one per chunk.
+   */
+  template <typename stream_type>
+  static int
+  synthesis_callback(short* wav, int numsamples, espeak_EVENT* events) {
+    static_assert(
+        std::is_final<stream_type>::value ||
+            std::is_abstract<stream_type>::value,
+        "A derivable concrete sink is called virtually.");
+    assert(events != nullptr); // Pre-condition.
+    auto& metrics = instrumentation::local_metrics();
+    metrics.record_callback(instrumentation::now_ns());
+    auto& state = *static_cast<job_state*>(events->user_data);
+    auto const sample_rate = espeak_ng_GetSampleRate();
+    auto& timeline = state.output->timeline;
+    for (; events->type != espeakEVENT_LIST_TERMINATED; ++events) {
+      metrics.record_event(events->type);
+      if (state.pre_emptor && events->type == espeakEVENT_SENTENCE &&
+          events->text_position > 1 &&
+          state.pre_emptor->is_waiting(job_priority::interactive)) {
+        state.pre_empted_at = events->text_position;
+        state.pre_empted_sample =
+            static_cast<std::uint64_t>(events->audio_position) *
+            sample_rate / 1000u;
+        break;
+      }
+      auto const previous_size = timeline.size();
+      timeline.append(*events, sample_rate);
+      if (timeline.size() > previous_size) {
+        timeline.sample_offsets.back() +=
+            static_cast<std::uint32_t>(state.sample_shift);
+        timeline.text_positions.back() += state.text_shift;
+      }
+    }
+    auto const give_way = state.pre_empted_at > 0 ? 1 : 0;
+    if (wav == nullptr || numsamples <= 0) {
+      return give_way;
+    }
+    metrics.samples_per_chunk.record(
+        static_cast<std::uint64_t>(numsamples));
+    auto sample_count = static_cast<std::size_t>(numsamples);
+    if (give_way) {
+      // Keep only the samples before the sentence given way at.
+      sample_count = static_cast<std::size_t>(std::min<std::uint64_t>(
+          sample_count,
+          state.pre_empted_sample -
+              std::min(state.pre_empted_sample, state.run_samples)));
+    }
+    state.run_samples += sample_count;
+    if (!state.stream) {
+      state.output->samples.append(wav, sample_count);
+      return give_way;
+    }
+    // Exceptions must not pass through eSpeak NG, which is C.
+    try {
+      auto const start_ns = instrumentation::now_ns();
+      static_cast<stream_type*>(state.stream)
+          ->write(wav, sample_count);
+      metrics.sink_time_ns.record(instrumentation::now_ns() - start_ns);
+    } catch (...) {
+      state.stream_error = std::current_exception();
+      return 1;
+    }
+    return give_way;
+  }
+
+  /** \brief Jobs waiting for the synthesis thread. */
+  job_scheduler<job> jobs;
+  /** \brief Voices to load before the first job. */
+  std::vector<std::string> const preloaded_voices;
+  /** \brief Copy of the load times of \ref voices. */
+  std::vector<voice_load_time> load_times;
+  /** \brief Voices loaded. Only used by the synthesis thread. */
+  voice_pool voices;
+  /** \brief Reused for borrowed text with no null terminator.
+   *
+   *  Only used by the synthesis thread.
+   */
+  std::string terminated_copy;
+  /** \brief Sample rate reported by eSpeak NG after initialisation. */
+  int sample_rate{0};
+  std::atomic<std::uint64_t> preemption_count{0u};
+  /** \brief Makes all the eSpeak NG calls. Started last. */
+  std::thread synthesis_thread;
+};
+
 } // namespace espeak_ng
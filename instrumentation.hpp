@@ -0,0 +1,500 @@
+#pragma once
+
+// Local dependencies.
+#include "boni.hpp"
+
+// Standard C++ libraries.
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+
+// External dependencies.
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+// Standard C libraries.
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+/** \brief Counters and histograms for the synthesis hot path.
+ *
+ *  \par Purpose
+ *  Glitches in playback are usually caused by synthesis
+ *  falling behind the audio device.
+ *  The metrics here record what the synthesis callback
+ *  and the audio buffer are doing,
+ *  cheaply enough to be left on in production,
+ *  so that glitches can be correlated with synthesis stalls.
+ *
+ *  \par Cost
+ *  Each thread recording metrics gets its own \ref thread_metrics,
+ *  claimed once on first use.
+ *  Recording is then a relaxed atomic increment
+ *  on a cache line no other thread writes,
+ *  with no locks and no allocations.
+ *  Only \ref take_snapshot reads all threads.
+ *
+ *  \par Usage
+ *  ```cpp
+ *  auto& metrics = instrumentation::local_metrics();
+ *  metrics.sink_time_ns.record(elapsed_ns);
+ *  // Elsewhere, possibly on another thread.
+ *  instrumentation::take_snapshot().write_text(stderr);
+ *  ```
+ */
+namespace instrumentation {
+
+/** \brief Clock used for all durations. */
+using clock = std::chrono::steady_clock;
+
+/** \brief Nanoseconds since an arbitrary epoch of \ref clock. */
+inline std::uint64_t now_ns() {
+  return static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          clock::now().time_since_epoch())
+          .count());
+}
+
+/** \brief Number of buckets in a \ref histogram. */
+constexpr std::size_t bucket_count = 40u;
+
+/** \brief Plain copy of a \ref histogram at some point in time. */
+struct histogram_snapshot {
+  /** \brief Values recorded in each bucket. */
+  std::array<std::uint64_t, bucket_count> counts{};
+  /** \brief Sum of all values recorded. */
+  std::uint64_t sum{0u};
+
+  /** \brief Number of values recorded. */
+  std::uint64_t count() const {
+    std::uint64_t total = 0u;
+    for (auto const bucket : counts) {
+      total += bucket;
+    }
+    return total;
+  }
+
+  /** \brief Upper bound of the bucket holding the `fraction` quantile.
+   *
+   *  Buckets double in width,
+   *  so this over-estimates the quantile by at most a factor of two.
+   */
+  std::uint64_t quantile(double fraction) const {
+    auto const total = count();
+    if (total == 0u) {
+      return 0u;
+    }
+    auto const rank = static_cast<std::uint64_t>(fraction * total);
+    std::uint64_t seen = 0u;
+    for (std::size_t index = 0u; index < bucket_count; ++index) {
+      seen += counts[index];
+      if (seen > rank) {
+        return (std::uint64_t{1u} << index) - 1u;
+      }
+    }
+    return (std::uint64_t{1u} << (bucket_count - 1u)) - 1u;
+  }
+
+  /** \brief Adds the values of `other` to these. */
+  void merge(histogram_snapshot const& other) {
+    for (std::size_t index = 0u; index < bucket_count; ++index) {
+      counts[index] += other.counts[index];
+    }
+    sum += other.sum;
+  }
+};
+
+/** \brief Counts values in buckets of power-of-two width.
+ *
+ *  Bucket `0` holds `0`, and bucket `i` holds values
+ *  of at least `2^(i-1)` and less than `2^i`.
+ *  The last bucket also holds everything larger.
+ *  For nanoseconds, that covers up to about nine minutes.
+ */
+class histogram {
+public:
+  /** \brief Counts `value` in its bucket. */
+  void record(std::uint64_t value) {
+    counts[bucket_of(value)].fetch_add(1u, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  /** \brief Returns the counts so far.
+   *
+   *  Values recorded concurrently may or may not be included.
+   */
+  histogram_snapshot snapshot() const {
+    histogram_snapshot result;
+    for (std::size_t index = 0u; index < bucket_count; ++index) {
+      result.counts[index] =
+          counts[index].load(std::memory_order_relaxed);
+    }
+    result.sum = sum.load(std::memory_order_relaxed);
+    return result;
+  }
+
+private:
+  /** \brief Index of the bucket `value` is counted in. */
+  static std::size_t bucket_of(std::uint64_t value) {
+    std::size_t index = 0u;
+    while (value != 0u && index < bucket_count - 1u) {
+      value >>= 1u;
+      ++index;
+    }
+    return index;
+  }
+
+  std::array<std::atomic<std::uint64_t>, bucket_count> counts{};
+  std::atomic<std::uint64_t> sum{0u};
+};
+
+/** \brief Number of `espeak_EVENT` types counted separately.
+ *
+ *  Larger types, from newer eSpeak NG versions, share the last count.
+ */
+constexpr std::size_t event_type_count = 10u;
+
+/** \brief Metrics recorded by one thread. */
+struct alignas(boni::cache_line_size) thread_metrics {
+  /** \brief Records the time of a synthesis callback.
+   *
+   *  The interval since the previous callback on this thread
+   *  is added to \ref callback_interval_ns.
+   */
+  void record_callback(std::uint64_t time_ns) {
+    callback_count.fetch_add(1u, std::memory_order_relaxed);
+    auto const previous =
+        last_callback_ns.exchange(time_ns, std::memory_order_relaxed);
+    if (previous != 0u && time_ns >= previous) {
+      callback_interval_ns.record(time_ns - previous);
+    }
+  }
+
+  /** \brief Counts an event of `type`. */
+  void record_event(int type) {
+    auto const index = static_cast<std::size_t>(type) < event_type_count
+                           ? static_cast<std::size_t>(type)
+                           : event_type_count - 1u;
+    event_counts[index].fetch_add(1u, std::memory_order_relaxed);
+  }
+
+  std::atomic<std::uint64_t> callback_count{0u};
+  /** \brief Time of the last callback, or `0` before the first. */
+  std::atomic<std::uint64_t> last_callback_ns{0u};
+  /** \brief Time between consecutive synthesis callbacks. */
+  histogram callback_interval_ns;
+  /** \brief Samples given to each synthesis callback. */
+  histogram samples_per_chunk;
+  /** \brief Time spent writing each chunk to its sink. */
+  histogram sink_time_ns;
+  /** \brief Samples waiting in the audio buffer at each write. */
+  histogram queue_depth;
+  /** \brief Time from cancelling an utterance to its silence. */
+  histogram cancel_latency_ns;
+  /** \brief How far each audio device callback strayed from its period.
+   *
+   *  That is, the difference between the time since the previous
+   *  callback and the duration of the samples it was asked for.
+   */
+  histogram device_jitter_ns;
+  /** \brief Samples of silence played in place of each underrun. */
+  histogram underrun_samples;
+  /** \brief Events received, indexed by `espeak_EVENT_TYPE`. */
+  std::array<std::atomic<std::uint64_t>, event_type_count>
+      event_counts{};
+};
+
+/** \brief A level going up and down, and the highest it has been.
+ *
+ *  Unlike \ref thread_metrics, it is shared by all threads,
+ *  since the peak of a sum is not the sum of the peaks.
+ *  The level is signed, so that a consumer subtracting
+ *  just before the producer adds does not wrap around.
+ */
+class alignas(boni::cache_line_size) gauge {
+public:
+  /** \brief Raises the level by `amount`. */
+  void add(std::uint64_t amount) {
+    auto const level =
+        current.fetch_add(
+            static_cast<std::int64_t>(amount),
+            std::memory_order_relaxed) +
+        static_cast<std::int64_t>(amount);
+    auto highest = highest_level.load(std::memory_order_relaxed);
+    while (level > highest &&
+           !highest_level.compare_exchange_weak(
+               highest, level, std::memory_order_relaxed)) {
+    }
+  }
+
+  /** \brief Lowers the level by `amount`. */
+  void subtract(std::uint64_t amount) {
+    current.fetch_sub(
+        static_cast<std::int64_t>(amount), std::memory_order_relaxed);
+  }
+
+  std::uint64_t value() const {
+    return static_cast<std::uint64_t>(std::max<std::int64_t>(
+        current.load(std::memory_order_relaxed), 0));
+  }
+
+  std::uint64_t peak() const {
+    return static_cast<std::uint64_t>(
+        highest_level.load(std::memory_order_relaxed));
+  }
+
+private:
+  std::atomic<std::int64_t> current{0};
+  std::atomic<std::int64_t> highest_level{0};
+};
+
+/** \brief Sum of all \ref thread_metrics at some point in time. */
+struct snapshot {
+  std::uint64_t callback_count{0u};
+  histogram_snapshot callback_interval_ns;
+  histogram_snapshot samples_per_chunk;
+  histogram_snapshot sink_time_ns;
+  histogram_snapshot queue_depth;
+  histogram_snapshot cancel_latency_ns;
+  histogram_snapshot device_jitter_ns;
+  histogram_snapshot underrun_samples;
+  std::array<std::uint64_t, event_type_count> event_counts{};
+  /** \brief PCM bytes waiting for a consumer, and the most there were.
+   *
+   *  See \ref registry::buffered_pcm_bytes.
+   */
+  std::uint64_t buffered_pcm_bytes{0u};
+  std::uint64_t peak_buffered_pcm_bytes{0u};
+  /** \brief Most memory the process taking the snapshot
+   *  has had resident, not counting forked workers.
+   */
+  std::uint64_t peak_rss_bytes{0u};
+
+  /** \brief Writes a human-readable summary to `output`. */
+  void write_text(std::FILE* output) const {
+    std::fprintf(
+        output, "Callbacks: %llu, events:",
+        static_cast<unsigned long long>(callback_count));
+    for (auto const count : event_counts) {
+      std::fprintf(
+          output, " %llu", static_cast<unsigned long long>(count));
+    }
+    std::fprintf(output, ".\n");
+    write_histogram(
+        output, "Callback interval ns", callback_interval_ns);
+    write_histogram(output, "Samples per chunk", samples_per_chunk);
+    write_histogram(output, "Sink time ns", sink_time_ns);
+    write_histogram(output, "Queue depth", queue_depth);
+    write_histogram(output, "Cancel latency ns", cancel_latency_ns);
+    write_histogram(output, "Device jitter ns", device_jitter_ns);
+    write_histogram(output, "Underrun samples", underrun_samples);
+    std::fprintf(
+        output,
+        "Buffered PCM: %llu bytes, peak %llu bytes; "
+        "peak RSS: %llu KiB.\n",
+        static_cast<unsigned long long>(buffered_pcm_bytes),
+        static_cast<unsigned long long>(peak_buffered_pcm_bytes),
+        static_cast<unsigned long long>(peak_rss_bytes >> 10));
+  }
+
+  /** \brief Returns the metrics as StatsD gauges named `prefix.*`.
+   *
+   *  Gauges are used throughout, with totals instead of deltas,
+   *  so that a lost datagram does not skew later values.
+   */
+  std::string to_statsd(std::string const& prefix) const {
+    std::string lines;
+    auto const add = [&](std::string const& name, std::uint64_t value) {
+      lines +=
+          prefix + "." + name + ":" + std::to_string(value) + "|g\n";
+    };
+    add("callbacks", callback_count);
+    for (std::size_t index = 0u; index < event_type_count; ++index) {
+      add("events." + std::to_string(index), event_counts[index]);
+    }
+    auto const add_histogram = [&](std::string const& name,
+                                   histogram_snapshot const& values) {
+      add(name + ".count", values.count());
+      add(name + ".p50", values.quantile(0.5));
+      add(name + ".p99", values.quantile(0.99));
+    };
+    add_histogram("callback_interval_ns", callback_interval_ns);
+    add_histogram("samples_per_chunk", samples_per_chunk);
+    add_histogram("sink_time_ns", sink_time_ns);
+    add_histogram("queue_depth", queue_depth);
+    add_histogram("cancel_latency_ns", cancel_latency_ns);
+    add_histogram("device_jitter_ns", device_jitter_ns);
+    add_histogram("underrun_samples", underrun_samples);
+    add("buffered_pcm_bytes", buffered_pcm_bytes);
+    add("peak_buffered_pcm_bytes", peak_buffered_pcm_bytes);
+    add("peak_rss_bytes", peak_rss_bytes);
+    return lines;
+  }
+
+private:
+  static void write_histogram(
+      std::FILE* output, char const* name,
+      histogram_snapshot const& values) {
+    auto const count = values.count();
+    std::fprintf(
+        output,
+        "%s: count %llu, mean %.1f, p50 <= %llu, p99 <= %llu.\n",
+        name, static_cast<unsigned long long>(count),
+        count == 0u ? 0.0 : static_cast<double>(values.sum) / count,
+        static_cast<unsigned long long>(values.quantile(0.5)),
+        static_cast<unsigned long long>(values.quantile(0.99)));
+  }
+};
+
+/** \brief Number of threads with their own \ref thread_metrics.
+ *
+ *  The threads of forked workers count too.
+ *  Threads beyond this share the last one,
+ *  which is still correct, if slower when contended.
+ */
+constexpr std::size_t max_thread_count = 64u;
+
+/** \brief Storage for the metrics of all threads. */
+class registry {
+public:
+  /** \brief Returns unused metrics for a new thread. */
+  thread_metrics& claim() {
+    auto const index = claimed.fetch_add(1u, std::memory_order_relaxed);
+    return slots[index < max_thread_count ? index
+                                          : max_thread_count - 1u];
+  }
+
+  /** \brief Sums the metrics of all threads. */
+  snapshot take_snapshot() const {
+    snapshot result;
+    auto const used = std::min(
+        claimed.load(std::memory_order_relaxed), max_thread_count);
+    for (std::size_t index = 0u; index < used; ++index) {
+      auto const& slot = slots[index];
+      result.callback_count +=
+          slot.callback_count.load(std::memory_order_relaxed);
+      result.callback_interval_ns.merge(
+          slot.callback_interval_ns.snapshot());
+      result.samples_per_chunk.merge(slot.samples_per_chunk.snapshot());
+      result.sink_time_ns.merge(slot.sink_time_ns.snapshot());
+      result.queue_depth.merge(slot.queue_depth.snapshot());
+      result.cancel_latency_ns.merge(slot.cancel_latency_ns.snapshot());
+      result.device_jitter_ns.merge(slot.device_jitter_ns.snapshot());
+      result.underrun_samples.merge(slot.underrun_samples.snapshot());
+      for (std::size_t type = 0u; type < event_type_count; ++type) {
+        result.event_counts[type] +=
+            slot.event_counts[type].load(std::memory_order_relaxed);
+      }
+    }
+    result.buffered_pcm_bytes = buffered_pcm_bytes.value();
+    result.peak_buffered_pcm_bytes = buffered_pcm_bytes.peak();
+    struct rusage usage;
+    if (0 == ::getrusage(RUSAGE_SELF, &usage)) {
+      // Linux gives kibibytes.
+      result.peak_rss_bytes =
+          static_cast<std::uint64_t>(usage.ru_maxrss) << 10;
+    }
+    return result;
+  }
+
+  /** \brief Bytes of samples synthesised but not yet consumed.
+   *
+   *  Added to by whatever holds samples for a consumer,
+   *  such as the audio device buffer or a streamed response,
+   *  and subtracted from as the consumer takes them,
+   *  so that memory held for slow consumers can be watched.
+   */
+  gauge buffered_pcm_bytes;
+
+private:
+  std::array<thread_metrics, max_thread_count> slots;
+  std::atomic<std::size_t> claimed{0u};
+};
+
+/** \brief The registry the program records to.
+ *
+ *  It is in memory shared with processes forked after its first use,
+ *  such as synthesis workers,
+ *  so that their metrics are summed with those of the parent.
+ */
+inline registry& global_registry() {
+  static registry& instance = []() -> registry& {
+    auto const memory = ::mmap(
+        nullptr, sizeof(registry), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      // Forked processes then only record for themselves.
+      static registry fallback;
+      return fallback;
+    }
+    // Never unmapped, as forked processes may still record to it.
+    return *new (memory) registry{};
+  }();
+  return instance;
+}
+
+/** \brief Metrics of the calling thread. */
+inline thread_metrics& local_metrics() {
+  thread_local thread_metrics& metrics = global_registry().claim();
+  return metrics;
+}
+
+/** \brief Sums the metrics of all threads of the program. */
+inline snapshot take_snapshot() {
+  return global_registry().take_snapshot();
+}
+
+/** \brief Hands a \ref snapshot to `report` every `interval`.
+ *
+ *  Reporting happens on a thread of its own,
+ *  which wakes up promptly when this is destroyed
+ *  to hand over one last snapshot.
+ */
+class periodic_reporter {
+public:
+  /** \brief Receives each snapshot. */
+  using report_type = std::function<void(snapshot const&)>;
+
+  periodic_reporter(
+      std::chrono::milliseconds interval, report_type report)
+      : interval{interval}, report{std::move(report)},
+        reporting_thread{[this]() { run(); }} {}
+
+  ~periodic_reporter() {
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      is_stopping = true;
+    }
+    stopping.notify_one();
+    reporting_thread.join();
+  }
+
+private:
+  void run() {
+    std::unique_lock<std::mutex> lock{mutex};
+    while (!stopping.wait_for(
+        lock, interval, [this]() { return is_stopping; })) {
+      report(take_snapshot());
+    }
+    report(take_snapshot());
+  }
+
+  std::chrono::milliseconds const interval;
+  report_type const report;
+  std::mutex mutex;
+  std::condition_variable stopping;
+  bool is_stopping{false};
+  /** \brief Started last, after everything it uses. */
+  std::thread reporting_thread;
+};
+
+} // namespace instrumentation
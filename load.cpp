@@ -0,0 +1,722 @@
+// Local dependencies.
+#include "audio.hpp"
+#include "boni.hpp"
+#include "espeak-ng-server.hpp"
+#include "espeak-ng-worker-pool.hpp"
+#include "espeak-ng.hpp"
+#include "posix.hpp"
+
+// External dependencies.
+#include <espeak-ng/espeak_ng.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Standard C++ libraries.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Standard C libraries.
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+/** \brief Clock used for all measurements. */
+using load_clock = std::chrono::steady_clock;
+
+/** \brief One recorded request to replay. */
+struct trace_request {
+  /** \brief When it arrived, from the start of the trace. */
+  std::chrono::microseconds arrival;
+  /** \brief Voice to synthesise `text` with, or empty for default. */
+  std::string voice_name;
+  std::string text;
+};
+
+/** \brief Reads the trace at `path`.
+ *
+ *  Each line is an arrival time in milliseconds,
+ *  a voice name, which may be empty, and a text,
+ *  separated by tabs.
+ *  Arrival times need not start at zero, and are sorted here.
+ *  Empty lines and lines starting with `#` are skipped.
+ *
+ *  \exception std::runtime_error
+ *  If the file cannot be read or a line does not have three fields.
+ */
+std::vector<trace_request> read_trace(std::string const& path) {
+  std::ifstream trace{path};
+  if (!trace) {
+    throw std::runtime_error("Unable to open trace: " + path);
+  }
+  std::vector<trace_request> requests;
+  std::string line;
+  for (std::size_t line_number = 1u; std::getline(trace, line);
+       ++line_number) {
+    if (line.empty() || line.front() == '#') {
+      continue;
+    }
+    auto const first_tab = line.find('\t');
+    auto const second_tab = first_tab == std::string::npos
+                                ? std::string::npos
+                                : line.find('\t', first_tab + 1u);
+    char* end = nullptr;
+    auto const milliseconds = std::strtod(line.c_str(), &end);
+    if (second_tab == std::string::npos ||
+        end != line.c_str() + first_tab || milliseconds < 0.0) {
+      throw std::runtime_error(
+          "Trace line " + std::to_string(line_number) +
+          " is not \"milliseconds<TAB>voice<TAB>text\"");
+    }
+    requests.push_back(trace_request{
+        std::chrono::microseconds{
+            static_cast<std::int64_t>(milliseconds * 1e3)},
+        line.substr(first_tab + 1u, second_tab - first_tab - 1u),
+        line.substr(second_tab + 1u)});
+  }
+  std::stable_sort(
+      requests.begin(), requests.end(),
+      [](trace_request const& left, trace_request const& right) {
+        return left.arrival < right.arrival;
+      });
+  if (!requests.empty()) {
+    auto const first_arrival = requests.front().arrival;
+    for (auto& request : requests) {
+      request.arrival -= first_arrival;
+    }
+  }
+  return requests;
+}
+
+/** \brief What happened to one replayed request. */
+struct request_timing {
+  /** \brief When it was due to arrive, after speeding up. */
+  load_clock::time_point due;
+  /** \brief When synthesis of it started, as far as can be seen. */
+  std::optional<load_clock::time_point> started;
+  std::optional<load_clock::time_point> first_sample;
+  std::optional<load_clock::time_point> finished;
+  std::uint64_t sample_count{0u};
+  /** \brief Whether the target refused it for being busy. */
+  bool is_rejected{false};
+  /** \brief Whether synthesising it failed otherwise. */
+  bool is_failed{false};
+};
+
+/** \brief Sink recording when the first and last samples arrived.
+ *
+ *  Samples are otherwise discarded,
+ *  so that the load is of synthesis and not of a consumer.
+ */
+class timing_sink final : public audio::sink {
+public:
+  explicit timing_sink(request_timing& timing) : timing{timing} {}
+
+  void write(short const*, std::size_t sample_count) override {
+    if (!timing.first_sample && sample_count > 0u) {
+      timing.first_sample = load_clock::now();
+    }
+    timing.sample_count += sample_count;
+  }
+
+  /** \brief Called by the engine once the job is done. */
+  void finish() override { timing.finished = load_clock::now(); }
+
+private:
+  request_timing& timing;
+};
+
+/** \brief CPU time and memory used by one process. */
+struct process_usage {
+  pid_t process_id;
+  /** \brief User and system time, from `/proc`. */
+  std::chrono::milliseconds cpu_time{0};
+  std::uint64_t rss_kib{0u};
+  std::uint64_t peak_rss_kib{0u};
+};
+
+/** \brief Reads what `process_id` has used so far from `/proc`.
+ *
+ *  Figures that cannot be read are left at zero,
+ *  as on systems without `/proc`.
+ */
+process_usage read_process_usage(pid_t process_id) {
+  process_usage usage{process_id};
+  auto const directory = "/proc/" + std::to_string(process_id);
+  std::ifstream stat{directory + "/stat"};
+  std::string line;
+  if (std::getline(stat, line)) {
+    // The command name may contain spaces, but not the closing `)`.
+    std::istringstream fields{line.substr(line.rfind(')') + 2u)};
+    std::string field;
+    unsigned long long ticks = 0u;
+    // Fields from the state on, where `utime` and `stime`
+    // are the 12th and 13th.
+    for (int index = 1; index <= 13 && fields >> field; ++index) {
+      if (index >= 12) {
+        ticks += std::strtoull(field.c_str(), nullptr, 10);
+      }
+    }
+    auto const ticks_per_second = ::sysconf(_SC_CLK_TCK);
+    if (ticks_per_second > 0) {
+      usage.cpu_time = std::chrono::milliseconds{
+          static_cast<std::int64_t>(ticks * 1000u / ticks_per_second)};
+    }
+  }
+  std::ifstream status{directory + "/status"};
+  while (std::getline(status, line)) {
+    auto const value = [&line]() {
+      return std::strtoull(
+          line.c_str() + line.find(':') + 1u, nullptr, 10);
+    };
+    if (line.rfind("VmRSS:", 0u) == 0u) {
+      usage.rss_kib = value();
+    } else if (line.rfind("VmHWM:", 0u) == 0u) {
+      usage.peak_rss_kib = value();
+    }
+  }
+  return usage;
+}
+
+/** \brief When each request of `trace` is due, `speed` times faster. */
+std::vector<request_timing> schedule_requests(
+    std::vector<trace_request> const& trace, double speed,
+    load_clock::time_point start) {
+  std::vector<request_timing> timings(trace.size());
+  for (std::size_t index = 0u; index < trace.size(); ++index) {
+    timings[index].due =
+        start + std::chrono::duration_cast<load_clock::duration>(
+                    std::chrono::duration<double, std::micro>{
+                        trace[index].arrival.count() / speed});
+  }
+  return timings;
+}
+
+/** \brief Voice settings of `request`. */
+espeak_ng::synthesis_options
+options_of(trace_request const& request) {
+  espeak_ng::synthesis_options options;
+  if (!request.voice_name.empty()) {
+    options.voice_name = request.voice_name;
+  }
+  return options;
+}
+
+/** \brief Replays `trace` against an \ref espeak_ng::engine.
+ *
+ *  Requests are submitted when due, and synthesis starts
+ *  when the engine thread takes them up,
+ *  so queue wait is the time between the two.
+ *
+ *  \return The sample rate of the engine.
+ */
+int replay_on_engine(
+    std::vector<trace_request> const& trace,
+    std::vector<request_timing>& timings) {
+  // Submitting should never wait, so that arrivals are on time.
+  espeak_ng::engine speech{std::max<std::size_t>(trace.size(), 1u)};
+  std::vector<std::unique_ptr<timing_sink>> sinks;
+  std::vector<std::future<espeak_ng::synthesis_result>> results;
+  for (std::size_t index = 0u; index < trace.size(); ++index) {
+    std::this_thread::sleep_until(timings[index].due);
+    sinks.push_back(std::make_unique<timing_sink>(timings[index]));
+    results.push_back(speech.submit(
+        trace[index].text, options_of(trace[index]),
+        sinks.back().get()));
+  }
+  for (std::size_t index = 0u; index < results.size(); ++index) {
+    auto& timing = timings[index];
+    try {
+      auto const result = results[index].get();
+      timing.started = result.started_at;
+    } catch (std::exception const& error) {
+      std::fprintf(stderr, "Request failed: %s\n", error.what());
+      timing.is_failed = true;
+    }
+  }
+  return speech.get_sample_rate();
+}
+
+/** \brief Replays `trace` on a \ref espeak_ng::worker_pool.
+ *
+ *  As when the example plays with workers,
+ *  results are collected in submission order on this thread,
+ *  so a long job holds back those after it,
+ *  and requests arriving while the pool is full,
+ *  or while a result is being collected, are submitted late.
+ *  Queue wait is then the time from arrival to submission,
+ *  since when a worker starts a job is not reported.
+ *
+ *  \return The usage of each worker, read before they exit.
+ */
+std::vector<process_usage> replay_on_workers(
+    espeak_ng::worker_pool& pool,
+    std::vector<trace_request> const& trace,
+    std::vector<request_timing>& timings) {
+  std::size_t next_submission = 0u;
+  std::size_t next_collection = 0u;
+  while (next_collection < trace.size()) {
+    auto const is_due =
+        next_submission < trace.size() &&
+        (pool.in_flight() == 0u ||
+         load_clock::now() >= timings[next_submission].due);
+    if (is_due && !pool.is_full()) {
+      auto& timing = timings[next_submission];
+      std::this_thread::sleep_until(timing.due);
+      pool.submit(
+          trace[next_submission].text,
+          options_of(trace[next_submission]));
+      timing.started = load_clock::now();
+      ++next_submission;
+      continue;
+    }
+    auto& timing = timings[next_collection++];
+    timing_sink sink{timing};
+    try {
+      pool.collect([&sink](short const* samples, std::size_t count) {
+        sink.write(samples, count);
+      });
+    } catch (std::exception const& error) {
+      std::fprintf(stderr, "Request failed: %s\n", error.what());
+      timing.is_failed = true;
+    }
+    timing.finished = load_clock::now();
+  }
+  std::vector<process_usage> usage;
+  for (auto const process_id : pool.process_ids()) {
+    usage.push_back(read_process_usage(process_id));
+  }
+  return usage;
+}
+
+/** \brief Forks a process serving speech on `port` of the loopback.
+ *
+ *  It runs an \ref espeak_ng::streaming_server
+ *  accepting up to `max_in_flight` requests at a time,
+ *  and is ready once this returns.
+ *
+ *  \exception std::runtime_error
+ *  If forking fails or the server does not start.
+ */
+pid_t start_server(std::string const& port, std::size_t max_in_flight) {
+  auto ready = posix::make_pipe();
+  std::fflush(nullptr);
+  auto const process_id = ::fork();
+  posix::throw_if(process_id == -1);
+  if (process_id == 0) {
+    ready.read_end.reset();
+    try {
+      espeak_ng::engine speech{max_in_flight};
+      espeak_ng::streaming_server server{
+          speech, "127.0.0.1", port, max_in_flight};
+      char const started = 1;
+      posix::write_all(ready.write_end, &started, 1u);
+      ready.write_end.reset();
+      server.run();
+    } catch (std::exception const& error) {
+      std::fprintf(stderr, "Server failed: %s\n", error.what());
+    }
+    // Skip destructors and `atexit` handlers of the parent.
+    std::_Exit(EXIT_FAILURE);
+  }
+  ready.write_end.reset();
+  char started = 0;
+  if (!posix::read_all(ready.read_end, &started, 1u)) {
+    ::waitpid(process_id, nullptr, 0);
+    throw std::runtime_error("Speech server failed to start");
+  }
+  return process_id;
+}
+
+/** \brief Percent-encodes `text` for a URL query. */
+std::string url_encode(std::string_view text) {
+  static char const digits[] = "0123456789ABCDEF";
+  std::string encoded;
+  for (auto const character : text) {
+    auto const byte = static_cast<unsigned char>(character);
+    if (std::isalnum(byte) || byte == '-' || byte == '_' ||
+        byte == '.' || byte == '~') {
+      encoded.push_back(character);
+    } else {
+      encoded.push_back('%');
+      encoded.push_back(digits[byte >> 4u]);
+      encoded.push_back(digits[byte & 0xfu]);
+    }
+  }
+  return encoded;
+}
+
+/** \brief Sends `request` to the server on `port` and times it.
+ *
+ *  Synthesis starts when the server sends the response headers,
+ *  since it submits the request just before.
+ *  A `503` counts as rejected, and any other failure as failed.
+ *  The rate of the samples is stored in `sample_rate`.
+ */
+void request_speech(
+    std::string const& port, trace_request const& request,
+    request_timing& timing, std::atomic<int>& sample_rate) {
+  auto const connection = posix::connect_tcp_socket("127.0.0.1", port);
+  std::string message = "POST /speak";
+  if (!request.voice_name.empty()) {
+    message += "?voice=" + url_encode(request.voice_name);
+  }
+  message += " HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: " +
+             std::to_string(request.text.size()) + "\r\n\r\n" +
+             request.text;
+  posix::write_all(connection, message.data(), message.size());
+
+  std::string received;
+  std::size_t parsed = 0u;
+  auto is_body = false;
+  std::uint64_t body_bytes = 0u;
+  char buffer[1u << 14];
+  for (;;) {
+    auto const count = ::read(connection, buffer, sizeof(buffer));
+    if (count == -1 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      break;
+    }
+    received.append(buffer, static_cast<std::size_t>(count));
+    if (!is_body) {
+      auto const header_end = received.find("\r\n\r\n");
+      if (header_end == std::string::npos) {
+        continue;
+      }
+      timing.started = load_clock::now();
+      // After `HTTP/1.1 `.
+      auto const status = std::string_view{received}.substr(
+          std::min<std::size_t>(9u, header_end), 3u);
+      if (status == "503") {
+        timing.is_rejected = true;
+        return;
+      }
+      if (status != "200") {
+        timing.is_failed = true;
+        return;
+      }
+      auto const rate = received.find("rate=");
+      if (rate < header_end) {
+        sample_rate.store(
+            std::atoi(received.c_str() + rate + 5u),
+            std::memory_order_relaxed);
+      }
+      is_body = true;
+      parsed = header_end + 4u;
+    }
+    // Chunks are a hexadecimal size line and that many bytes.
+    for (;;) {
+      auto const line_end = received.find("\r\n", parsed);
+      if (line_end == std::string::npos) {
+        break;
+      }
+      auto const size = std::strtoull(
+          received.c_str() + parsed, nullptr, 16);
+      if (received.size() < line_end + 2u + size + 2u) {
+        break;
+      }
+      if (size == 0u) {
+        timing.finished = load_clock::now();
+        timing.sample_count = body_bytes / sizeof(short);
+        return;
+      }
+      if (!timing.first_sample) {
+        timing.first_sample = load_clock::now();
+      }
+      body_bytes += size;
+      parsed = line_end + 2u + size + 2u;
+    }
+    received.erase(0u, parsed);
+    parsed = 0u;
+  }
+  // The server closed the connection before the last chunk.
+  timing.is_failed = true;
+}
+
+/** \brief Replays `trace` over HTTP against the server on `port`.
+ *
+ *  Requests are sent by `connection_count` client threads,
+ *  each one request at a time,
+ *  so that a request due while all of them are busy
+ *  is sent once one is free, as a client with a connection pool would.
+ *
+ *  \return The sample rate of the server, or `0` if none succeeded.
+ */
+int replay_on_server(
+    std::string const& port, std::size_t connection_count,
+    std::vector<trace_request> const& trace,
+    std::vector<request_timing>& timings) {
+  boni::bounded_queue<std::size_t> due_requests{connection_count};
+  std::atomic<int> sample_rate{0};
+  std::vector<std::thread> clients;
+  for (std::size_t index = 0u; index < connection_count; ++index) {
+    clients.emplace_back([&]() {
+      while (auto const next = due_requests.pop()) {
+        try {
+          request_speech(
+              port, trace[*next], timings[*next], sample_rate);
+        } catch (std::exception const& error) {
+          std::fprintf(stderr, "Request failed: %s\n", error.what());
+          timings[*next].is_failed = true;
+        }
+      }
+    });
+  }
+  for (std::size_t index = 0u; index < trace.size(); ++index) {
+    std::this_thread::sleep_until(timings[index].due);
+    auto next = index;
+    due_requests.push(std::move(next));
+  }
+  due_requests.close();
+  for (auto& client : clients) {
+    client.join();
+  }
+  return sample_rate.load(std::memory_order_relaxed);
+}
+
+/** \brief Returns the `fraction` quantile by nearest rank.
+ *
+ *  `values` is sorted in place.
+ */
+double percentile(std::vector<double>& values, double fraction) {
+  if (values.empty()) {
+    return 0.0;
+  }
+  std::sort(values.begin(), values.end());
+  auto const rank = static_cast<std::size_t>(
+      std::ceil(fraction * static_cast<double>(values.size())));
+  return values[std::max<std::size_t>(rank, 1u) - 1u];
+}
+
+/** \brief Writes the percentiles of `values` as a JSON object. */
+void write_distribution(
+    std::FILE* output, char const* name, std::vector<double> values) {
+  auto const maximum =
+      values.empty() ? 0.0
+                     : *std::max_element(values.begin(), values.end());
+  std::fprintf(
+      output,
+      "  \"%s\": {\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, "
+      "\"max\": %.3f},\n",
+      name, percentile(values, 0.5), percentile(values, 0.95),
+      percentile(values, 0.99), maximum);
+}
+
+/** \brief Replays a recorded trace against a synthesis target.
+ *
+ *  Usage:
+ *  `espeak-ng-example-load --trace path [--target target]
+ *  [--speed factor] [--workers count] [--port port]
+ *  [--connections count] [--output path]`
+ *
+ *  Each request of the trace, see \ref read_trace,
+ *  is made when due, `factor` times faster than recorded,
+ *  against `target`, one of
+ *  `engine`, an \ref espeak_ng::engine in this process, the default,
+ *  `workers`, an \ref espeak_ng::worker_pool of `count` processes,
+ *  or `server`, an \ref espeak_ng::streaming_server forked
+ *  to listen on the loopback at `port`, 8080 by default,
+ *  and sent requests over `count` connections, 16 by default.
+ *  Results are written to `path`, or standard output, as JSON:
+ *  throughput, percentiles in milliseconds from arrival of
+ *  queue wait, time to first sample and end-to-end latency,
+ *  and the CPU time and memory of each synthesising process.
+ *  For the engine, that process is this one.
+ *  Errors, such as a trace or output that cannot be opened,
+ *  are printed and exit with failure.
+ */
+int main(int argc, char* argv[]) {
+  std::string trace_path;
+  std::string target{"engine"};
+  double speed = 1.0;
+  std::size_t worker_count = 0u;
+  std::string port{"8080"};
+  std::size_t connection_count = 16u;
+  std::string output_path;
+  try {
+    for (int index = 1; index < argc; ++index) {
+      auto const argument = std::string{argv[index]};
+      if (argument == "--trace" && index + 1 < argc) {
+        trace_path = argv[++index];
+      } else if (argument == "--target" && index + 1 < argc) {
+        target = argv[++index];
+      } else if (argument == "--speed" && index + 1 < argc) {
+        speed = boni::parse_number<double>(argument, argv[++index]);
+      } else if (argument == "--workers" && index + 1 < argc) {
+        worker_count =
+            boni::parse_number<std::size_t>(argument, argv[++index]);
+      } else if (argument == "--port" && index + 1 < argc) {
+        port = argv[++index];
+      } else if (argument == "--connections" && index + 1 < argc) {
+        connection_count =
+            boni::parse_number<std::size_t>(argument, argv[++index]);
+      } else if (argument == "--output" && index + 1 < argc) {
+        output_path = argv[++index];
+      } else {
+        throw std::invalid_argument("Unknown argument: " + argument);
+      }
+    }
+    if (trace_path.empty()) {
+      throw std::invalid_argument("A trace must be given with --trace");
+    }
+    if (!(speed > 0.0) || connection_count == 0u) {
+      throw std::invalid_argument(
+          "Speed and connections must be positive");
+    }
+    if (target != "engine" && target != "workers" &&
+        target != "server") {
+      throw std::invalid_argument("Unknown target: " + target);
+    }
+    if (worker_count > 0u && target != "workers") {
+      throw std::invalid_argument(
+          "--workers can only be used with --target workers");
+    }
+    auto const trace = read_trace(trace_path);
+    // A client the server gave up on should fail, not kill the run.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    boni::file output_file;
+    if (!output_path.empty()) {
+      output_file.reset(std::fopen(output_path.c_str(), "w"));
+      if (output_file.get() == nullptr) {
+        throw std::runtime_error("Unable to open file: " + output_path);
+      }
+    }
+    std::FILE* const output =
+        output_file.get() != nullptr ? output_file.get() : stdout;
+
+    // Fork before any thread is started.
+    std::optional<espeak_ng::worker_pool> pool;
+    pid_t server_process_id = -1;
+    if (target == "workers") {
+      if (worker_count == 0u) {
+        worker_count =
+            std::max(1u, std::thread::hardware_concurrency());
+      }
+      pool.emplace(worker_count);
+    } else if (target == "server") {
+      server_process_id = start_server(port, connection_count);
+    }
+
+    auto const start = load_clock::now();
+    auto timings = schedule_requests(trace, speed, start);
+    std::vector<process_usage> usage;
+    auto sample_rate = 0;
+    if (pool) {
+      usage = replay_on_workers(*pool, trace, timings);
+      sample_rate = pool->get_sample_rate();
+    } else if (server_process_id != -1) {
+      sample_rate =
+          replay_on_server(port, connection_count, trace, timings);
+      usage.push_back(read_process_usage(server_process_id));
+      ::kill(server_process_id, SIGTERM);
+      ::waitpid(server_process_id, nullptr, 0);
+    } else {
+      sample_rate = replay_on_engine(trace, timings);
+      usage.push_back(read_process_usage(::getpid()));
+    }
+
+    auto end = start;
+    std::uint64_t completed_count = 0u;
+    std::uint64_t rejected_count = 0u;
+    std::uint64_t failed_count = 0u;
+    std::uint64_t sample_count = 0u;
+    std::vector<double> queue_wait_ms;
+    std::vector<double> first_sample_ms;
+    std::vector<double> end_to_end_ms;
+    auto const since_due = [](request_timing const& timing,
+                              load_clock::time_point time) {
+      return std::chrono::duration<double, std::milli>(
+                 time - timing.due)
+          .count();
+    };
+    for (auto const& timing : timings) {
+      if (timing.is_rejected) {
+        ++rejected_count;
+        continue;
+      }
+      if (timing.is_failed || !timing.finished) {
+        ++failed_count;
+        continue;
+      }
+      ++completed_count;
+      sample_count += timing.sample_count;
+      end = std::max(end, *timing.finished);
+      if (timing.started) {
+        queue_wait_ms.push_back(since_due(timing, *timing.started));
+      }
+      if (timing.first_sample) {
+        first_sample_ms.push_back(
+            since_due(timing, *timing.first_sample));
+      }
+      end_to_end_ms.push_back(since_due(timing, *timing.finished));
+    }
+    auto const wall_seconds =
+        std::chrono::duration<double>(end - start).count();
+    auto const per_second = [wall_seconds](double value) {
+      return wall_seconds > 0.0 ? value / wall_seconds : 0.0;
+    };
+
+    std::fprintf(
+        output,
+        "{\n  \"espeak_ng_version\": \"%s\",\n"
+        "  \"target\": \"%s\",\n  \"speed\": %.3f,\n"
+        "  \"request_count\": %zu,\n  \"completed_count\": %llu,\n"
+        "  \"rejected_count\": %llu,\n  \"failed_count\": %llu,\n"
+        "  \"wall_time_ms\": %.3f,\n"
+        "  \"requests_per_second\": %.3f,\n"
+        "  \"audio_seconds_per_second\": %.3f,\n",
+        espeak_Info(nullptr), target.c_str(), speed, trace.size(),
+        static_cast<unsigned long long>(completed_count),
+        static_cast<unsigned long long>(rejected_count),
+        static_cast<unsigned long long>(failed_count),
+        wall_seconds * 1e3,
+        per_second(static_cast<double>(completed_count)),
+        per_second(
+            sample_rate > 0 ? static_cast<double>(sample_count) /
+                                  sample_rate
+                            : 0.0));
+    write_distribution(
+        output, "queue_wait_ms", std::move(queue_wait_ms));
+    write_distribution(
+        output, "time_to_first_sample_ms", std::move(first_sample_ms));
+    write_distribution(
+        output, "end_to_end_ms", std::move(end_to_end_ms));
+    std::fprintf(output, "  \"processes\": [");
+    auto is_first = true;
+    for (auto const& process : usage) {
+      std::fprintf(
+          output,
+          "%s\n    {\"pid\": %ld, \"cpu_time_ms\": %lld, "
+          "\"rss_kib\": %llu, \"peak_rss_kib\": %llu}",
+          is_first ? "" : ",", static_cast<long>(process.process_id),
+          static_cast<long long>(process.cpu_time.count()),
+          static_cast<unsigned long long>(process.rss_kib),
+          static_cast<unsigned long long>(process.peak_rss_kib));
+      is_first = false;
+    }
+    std::fprintf(output, "\n  ]\n}\n");
+  } catch (std::exception const& error) {
+    std::fprintf(stderr, "%s\n", error.what());
+    return EXIT_FAILURE;
+  }
+}
@@ -1,74 +1,688 @@
 // Local dependencies.
+#include "audio.hpp"
+#include "audio-conversion.hpp"
 #include "boni.hpp"
 #include "espeak-ng.hpp"
+#include "espeak-ng-cache.hpp"
+#include "espeak-ng-disk-cache.hpp"
+#include "espeak-ng-document.hpp"
+#include "espeak-ng-server.hpp"
+#include "espeak-ng-startup.hpp"
+#include "espeak-ng-template.hpp"
+#include "espeak-ng-worker-pool.hpp"
+#include "instrumentation.hpp"
+#include "posix.hpp"
 /** \brief Ask SDL2 to not change `main` into a macro. */
 #define SDL_MAIN_HANDLED
 #include "sdl2.hpp"
+#include "synthesis.hpp"
+#include "text.hpp"
 
 // External dependencies.
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_audio.h>
-#include <SDL2/SDL_timer.h>
 #include <espeak-ng/espeak_ng.h>
+#include <unistd.h>
 
 // Standard C++ libraries.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 // Standard C libraries.
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 
-/** \param wav
- *  Speech data produced (since last callback?)
- *  It is `nullptr` if the synthesis has been completed (and paused?)
- *  \param numsamples
- *  Length, possibly zero, of the array pointed to by `wav`.
- *  \param events
- *  A `type`-`0`-terminated array of `espeak_EVENT` items
- *  indicating word and sentences events,
- *  the occurance of mark and audio elements within the text.
- *  \return `0` if synthesis should continue, `1` to abort.
- */
-int SynthCallback(short* wav, int numsamples, espeak_EVENT* events) {
-  assert(events != nullptr); // Pre-condition.
-
-  for (; events->type != espeakEVENT_LIST_TERMINATED; ++events) {
-    auto& event = *events;
-    switch (event.type) {
-    case espeakEVENT_LIST_TERMINATED:
-    case espeakEVENT_WORD:
-    case espeakEVENT_SENTENCE:
-    case espeakEVENT_MARK:
-    case espeakEVENT_PLAY:
-    case espeakEVENT_END:
-    case espeakEVENT_MSG_TERMINATED:
-    case espeakEVENT_PHONEME:
-    case espeakEVENT_SAMPLERATE:
-      break;
-    }
-  }
-  auto& event = *events;
-  if (wav != nullptr && numsamples != 0) {
-    // Cannot do anything with the data without the audio device.
-    auto audio_device =
-        static_cast<sdl2::audio_device*>(event.user_data);
-    if (audio_device) {
-      sdl2::throw_if(
-          0 != SDL_QueueAudio(*audio_device, wav, numsamples * 2));
-    }
-  }
-  return 0;
-}
-
-int main() {
+/** \brief Devices shared by every \ref playback_sink.
+ *
+ *  Devices left idle for 30 s are closed, and SDL2 audio with them,
+ *  so that a service waiting for text stops waking up for audio.
+ */
+sdl2::device_pool& playback_devices() {
+  static sdl2::device_pool devices{std::chrono::seconds{30}};
+  return devices;
+}
+
+/** \brief Plays samples on the default audio device.
+ *
+ *  \par Opening
+ *  SDL2 audio is only started, and the device opened,
+ *  by the first write,
+ *  so that start-up, and runs that never play anything,
+ *  do not wait for the sound server.
+ *  At the end of each utterance,
+ *  the device is handed back to \ref playback_devices,
+ *  where it keeps playing what it was given,
+ *  and the next utterance takes it back unless it was left idle.
+ *
+ *  \par Latency
+ *  By default, the device period is 4096 samples,
+ *  which is about 186 ms at 22050 Hz,
+ *  and a few seconds of speech are buffered before synthesis waits.
+ *  Given a target latency instead,
+ *  the period is the largest power of two
+ *  fitting twice into the target,
+ *  since the device holds one period while the next is filled.
+ *  The device may pick another period,
+ *  and the ring buffer is then sized from the one obtained.
+ *
+ *  \par Scheduling
+ *  Given real-time settings,
+ *  the audio thread of every device lent out is asked to use them,
+ *  see \ref sdl2::buffered_audio_device::request_realtime.
+ */
+class playback_sink : public audio::sink {
+public:
+  /** \brief Settings of the audio thread, if not the default. */
+  using realtime_settings = std::optional<
+      sdl2::buffered_audio_device::realtime_settings>;
+
+  /** \brief Plays at `sample_rate` once written to.
+   *
+   *  \param target_latency_ms
+   *  Latency to size the device period for, or `0` for the default.
+   */
+  playback_sink(
+      int sample_rate, std::size_t target_latency_ms,
+      realtime_settings realtime = std::nullopt)
+      : realtime{realtime},
+        required_audio_spec{make_audio_spec(
+            sample_rate, target_latency_ms)},
+        // Without a target, a few seconds of speech
+        // are buffered before synthesis waits.
+        buffer_capacity{
+            target_latency_ms == 0u
+                ? static_cast<std::size_t>(sample_rate) * 4u
+                : 0u},
+        allowed_changes{
+            target_latency_ms == 0u ? 0
+                                    : SDL_AUDIO_ALLOW_SAMPLES_CHANGE},
+        // With a target, enough periods for a synthesis chunk.
+        buffer_periods{target_latency_ms == 0u ? 0u : 16u} {}
+
+  /** \brief Opens the device first if needed. */
+  void write(short const* samples, std::size_t sample_count) override {
+    if (!playback) {
+      open();
+    }
+    instrumentation::local_metrics().queue_depth.record(
+        playback->buffer.size());
+    playback->push(samples, sample_count);
+  }
+
+  /** \brief Samples the device is asked to take at a time. */
+  std::size_t period_samples() const {
+    return required_audio_spec.samples;
+  }
+
+  /** \brief Hands the device back to \ref playback_devices. */
+  void flush() override { playback.reset(); }
+
+  /** \brief Stops playback within one device period. */
+  void discard_pending() override {
+    if (!playback) {
+      // The last utterance may still be playing.
+      playback = reclaim();
+    }
+    if (playback) {
+      playback->discard().wait();
+    }
+  }
+
+  /** \brief Waits for playback to finish. */
+  void finish() override {
+    if (!playback) {
+      playback = reclaim();
+    }
+    if (!playback) {
+      std::fprintf(stderr, "Nothing left playing.\n");
+      return;
+    }
+    std::fprintf(stderr, "Waiting for playback to finish.\n");
+    playback->drain().wait();
+    std::fprintf(
+        stderr, "Audio buffer underruns: %llu, late samples: %llu.\n",
+        static_cast<unsigned long long>(playback->underruns()),
+        static_cast<unsigned long long>(playback->late_samples()));
+    // Samples taken by the audio thread play over the next period.
+    using milliseconds = std::chrono::duration<double, std::milli>;
+    std::fprintf(
+        stderr,
+        "Output latency over %llu starts: mean %.1f ms, "
+        "max %.1f ms.\n",
+        static_cast<unsigned long long>(playback->starts()),
+        milliseconds{
+            playback->mean_start_latency() + playback->period()}
+            .count(),
+        milliseconds{
+            playback->max_start_latency() + playback->period()}
+            .count());
+    if (realtime) {
+      print_realtime_status(*playback);
+    }
+    playback.reset();
+  }
+
+private:
+  /** \brief Takes a device from \ref playback_devices and unpauses it.
+   *
+   *  Where one is opened, its period is reported the first time.
+   */
+  void open() {
+    auto& devices = playback_devices();
+    auto const opens_before = devices.opens();
+    playback = devices.acquire(
+        required_audio_spec, buffer_capacity, allowed_changes,
+        buffer_periods);
+    if (devices.opens() != opens_before) {
+      auto const& obtained = playback->obtained_audio_spec;
+      std::fprintf(
+          stderr,
+          "Audio device period: %u samples at %d Hz, %.1f ms; "
+          "buffer: %zu samples.\n",
+          static_cast<unsigned int>(obtained.samples), obtained.freq,
+          std::chrono::duration<double, std::milli>(playback->period())
+              .count(),
+          playback->buffer.capacity());
+    }
+    if (realtime) {
+      playback->request_realtime(*realtime);
+    }
+    // Play while the ring buffer is being filled.
+    SDL_PauseAudioDevice(playback->device, 0);
+  }
+
+  /** \brief Prints what `device` obtained of \ref realtime. */
+  void print_realtime_status(
+      sdl2::buffered_audio_device const& device) const {
+    auto const status = device.get_realtime_status();
+    if (!status.is_applied) {
+      std::fprintf(stderr, "Audio thread not rescheduled yet.\n");
+      return;
+    }
+    std::fprintf(
+        stderr, "Audio thread scheduling: %s, %s, memory %s.\n",
+        status.is_fifo    ? "SCHED_FIFO"
+        : status.is_rtkit ? "real-time from RealtimeKit"
+                          : "default, real-time refused",
+        status.is_pinned ? "pinned" : "not pinned",
+        status.is_memory_locked ? "locked" : "not locked");
+  }
+
+  /** \brief The device last handed back, if still open. */
+  sdl2::device_pool::lease reclaim() {
+    return playback_devices().reclaim(
+        required_audio_spec, buffer_capacity, allowed_changes,
+        buffer_periods);
+  }
+
+  /** \brief The specification requested from SDL2. */
+  static SDL_AudioSpec
+  make_audio_spec(int sample_rate, std::size_t target_latency_ms) {
+    SDL_AudioSpec required_audio_spec;
+    SDL_zero(required_audio_spec);
+    required_audio_spec.freq = sample_rate;
+    required_audio_spec.format = AUDIO_S16SYS;
+    required_audio_spec.channels = 1u;
+    required_audio_spec.samples = 4096u;
+    if (target_latency_ms != 0u) {
+      auto const target_samples = std::min<std::size_t>(
+          static_cast<std::size_t>(sample_rate) * target_latency_ms /
+              2000u,
+          4096u);
+      // Smaller periods cost more wake-ups than they save latency.
+      std::size_t period = 64u;
+      while (period * 2u <= target_samples) {
+        period *= 2u;
+      }
+      required_audio_spec.samples = static_cast<Uint16>(period);
+    }
+    return required_audio_spec;
+  }
+
+  realtime_settings const realtime;
+  SDL_AudioSpec const required_audio_spec;
+  std::size_t const buffer_capacity;
+  int const allowed_changes;
+  std::size_t const buffer_periods;
+  /** \brief The device samples are pushed to, while lent out. */
+  sdl2::device_pool::lease playback;
+};
+
+/** \brief Settings given on the command line. */
+struct program_options {
+  /** \brief Number of worker processes, or `0` to not use any. */
+  std::size_t worker_count{0u};
+  /** \brief Budget of the in-memory cache. */
+  std::size_t cache_bytes{std::size_t{16u} << 20};
+  /** \brief Prefix of the cache files, or empty to not use them. */
+  std::string cache_file;
+  /** \brief Start-up manifest to use, or empty to not use one.
+   *
+   *  See \ref espeak_ng::startup_manifest.
+   */
+  std::string startup_manifest;
+  /** \brief Whether to read text from standard input. */
+  bool is_reading_stdin{false};
+  /** \brief Whether to print word, sentence and mark timings. */
+  bool is_printing_events{false};
+  /** \brief Whether to normalise texts and cut them into chunks. */
+  bool is_normalising{false};
+  /** \brief Template each text fills the slots of, if not empty.
+   *
+   *  See \ref espeak_ng::prompt_template.
+   */
+  std::string template_pattern;
+  /** \brief Path of a Unix socket to read text from, if not empty. */
+  std::string socket_path;
+  /** \brief File to write samples to instead of playing them.
+   *
+   *  Ending with `.wav` gives a WAV file, and raw samples otherwise.
+   */
+  std::string output_path;
+  /** \brief Format and rate of samples written to files. */
+  audio::conversion output_conversion;
+  /** \brief `[host:]port` to stream speech over HTTP on, if not empty.
+   */
+  std::string serve_address;
+  /** \brief Document to speak with the worker pool, if not empty. */
+  std::string document_path;
+  /** \brief Voices of the speakers labelled in the document. */
+  espeak_ng::speaker_voices speakers;
+  /** \brief Manifest of utterances to render, if not empty. */
+  std::string batch_path;
+  /** \brief Directory the rendered utterances are written to. */
+  std::string output_directory{"."};
+  /** \brief Audio latency to aim for, or `0` for the default. */
+  std::size_t target_latency_ms{0u};
+  /** \brief `SCHED_FIFO` priority of the audio thread, or `0`.
+   *
+   *  With a priority, the audio thread gets the last CPU
+   *  and worker processes the others, see \ref reserved_audio_cpu.
+   */
+  int realtime_priority{0};
+  /** \brief Bytes of samples to buffer for consumers, or `0`.
+   *
+   *  That is shared between the worker rings,
+   *  or between the responses of the server,
+   *  and also bounds the recording kept of each text for the cache.
+   *  With `0`, the defaults of each are used.
+   */
+  std::size_t memory_budget{0u};
+  /** \brief Milliseconds between metrics reports, or `0` for none. */
+  std::size_t stats_interval_ms{0u};
+  /** \brief `host:port` of a StatsD server, if not empty. */
+  std::string statsd_address;
+  /** \brief Voices to load before the first text. */
+  std::vector<std::string> preloaded_voices;
+  /** \brief Texts given as arguments. */
+  std::vector<std::string> texts;
+};
+
+/** \brief CPU kept for the audio thread, or `-1` if none.
+ *
+ *  Only with `options.realtime_priority`, and more than one CPU.
+ *  The last CPU is taken, being the least likely
+ *  to be handling interrupts.
+ */
+int reserved_audio_cpu(program_options const& options) {
+  auto const cpu_count =
+      static_cast<int>(std::thread::hardware_concurrency());
+  if (options.realtime_priority == 0 || cpu_count < 2) {
+    return -1;
+  }
+  return cpu_count - 1;
+}
+
+/** \brief CPUs worker processes are pinned to, or none for any.
+ *
+ *  These are the CPUs other than \ref reserved_audio_cpu.
+ */
+std::vector<int> worker_cpus(program_options const& options) {
+  std::vector<int> cpus;
+  auto const audio_cpu = reserved_audio_cpu(options);
+  for (int cpu = 0; cpu < audio_cpu; ++cpu) {
+    cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+/** \brief Bytes of samples each of `worker_count` workers buffers.
+ *
+ *  Their share of `options.memory_budget`, or 1 MiB without one.
+ *  Rings are kept large enough for a few synthesis chunks.
+ */
+std::size_t worker_ring_capacity(
+    program_options const& options, std::size_t worker_count) {
+  if (options.memory_budget == 0u) {
+    return std::size_t{1u} << 20;
+  }
+  return std::max(
+      options.memory_budget / worker_count, std::size_t{64u} << 10);
+}
+
+/** \brief Prints the most samples buffered and memory resident. */
+void print_memory_usage() {
+  auto const metrics = instrumentation::take_snapshot();
+  std::fprintf(
+      stderr, "Peak buffered PCM: %llu bytes, peak RSS: %llu KiB.\n",
+      static_cast<unsigned long long>(metrics.peak_buffered_pcm_bytes),
+      static_cast<unsigned long long>(metrics.peak_rss_bytes >> 10));
+}
+
+/** \brief Reports metrics as requested in `options`.
+ *
+ *  \return No reporter if no reports were asked for.
+ *
+ *  Only metrics of this process are reported,
+ *  and not those of worker processes.
+ *  The reporter runs a thread,
+ *  so a \ref espeak_ng::worker_pool must be forked before this.
+ */
+std::unique_ptr<instrumentation::periodic_reporter>
+make_metrics_reporter(program_options const& options) {
+  if (options.stats_interval_ms == 0u &&
+      options.statsd_address.empty()) {
+    return nullptr;
+  }
+  auto statsd = std::make_shared<posix::file_descriptor>();
+  if (!options.statsd_address.empty()) {
+    auto const separator = options.statsd_address.rfind(':');
+    if (separator == std::string::npos) {
+      throw std::runtime_error("Expected host:port for --statsd");
+    }
+    *statsd = posix::connect_udp_socket(
+        options.statsd_address.substr(0u, separator),
+        options.statsd_address.substr(separator + 1u));
+  }
+  auto const is_writing_text = options.stats_interval_ms != 0u;
+  auto const interval = std::chrono::milliseconds{
+      is_writing_text ? options.stats_interval_ms : 10000u};
+  return std::make_unique<instrumentation::periodic_reporter>(
+      interval,
+      [statsd, is_writing_text](
+          instrumentation::snapshot const& metrics) {
+        if (is_writing_text) {
+          metrics.write_text(stderr);
+        }
+        if (*statsd) {
+          // Lost datagrams are acceptable, so errors are ignored.
+          auto const lines = metrics.to_statsd("espeak_ng_example");
+          static_cast<void>(
+              ::send(*statsd, lines.data(), lines.size(), 0));
+        }
+      });
+}
+
+/** \brief Creates the sink chosen by `options`.
+ *
+ *  Synthesis chunks are collected into blocks before reaching it,
+ *  of the device period asked for, for playback,
+ *  so that the ring buffer is given whole periods,
+ *  and of one \ref audio::sample_block for files,
+ *  so that any conversion runs over longer stretches.
+ */
+std::unique_ptr<audio::coalescing_sink>
+make_sink(program_options const& options, int sample_rate) {
+  if (!options.output_path.empty()) {
+    std::fprintf(
+        stderr, "Writing to \"%s\".\n", options.output_path.c_str());
+    auto file = audio::make_file_sink(
+        options.output_path, sample_rate, options.output_conversion);
+    return std::make_unique<audio::coalescing_sink>(
+        std::move(file), audio::block_sample_count);
+  }
+  playback_sink::realtime_settings realtime;
+  if (options.realtime_priority != 0) {
+    realtime.emplace();
+    realtime->priority = options.realtime_priority;
+    realtime->cpu = reserved_audio_cpu(options);
+  }
+  auto playback = std::make_unique<playback_sink>(
+      sample_rate, options.target_latency_ms, realtime);
+  auto const period = playback->period_samples();
+  return std::make_unique<audio::coalescing_sink>(
+      std::move(playback), period);
+}
+
+/** \brief Prints the timing of words, sentences and marks.
+ *
+ *  This is what a captioning or lip-sync client would consume.
+ */
+class event_printer : public espeak_ng::event_subscriber {
+public:
+  /** \brief Prints events of the synthesis of `text`, not owned. */
+  explicit event_printer(std::string_view text) : text{text} {}
+
+  void on_events(
+      espeak_ng::event_timeline const& timeline,
+      std::size_t first) override {
+    for (auto index = first; index < timeline.size(); ++index) {
+      auto const sample_offset = timeline.sample_offsets[index];
+      switch (timeline.types[index]) {
+      case espeakEVENT_WORD: {
+        // Text positions start at `1`.
+        auto const position = static_cast<std::size_t>(
+            timeline.text_positions[index] - 1);
+        auto const length =
+            static_cast<std::size_t>(timeline.lengths[index]);
+        auto const word =
+            text.substr(std::min(position, text.size()), length);
+        std::fprintf(
+            stderr, "Word at sample %u: \"%.*s\".\n", sample_offset,
+            static_cast<int>(word.size()), word.data());
+        break;
+      }
+      case espeakEVENT_SENTENCE:
+        std::fprintf(stderr, "Sentence at sample %u.\n", sample_offset);
+        break;
+      case espeakEVENT_MARK:
+        std::fprintf(
+            stderr, "Mark \"%s\" at sample %u.\n",
+            timeline.name(index), sample_offset);
+        break;
+      default:
+        break;
+      }
+    }
+  }
+
+private:
+  std::string_view const text;
+};
+
+/** \brief Produces the next text to speak, or nothing at the end. */
+using text_source = std::function<std::optional<std::string>()>;
+
+/** \brief Reads text from a file descriptor and yields sentences.
+ *
+ *  Each sentence is returned as soon as its end has been read,
+ *  so that it can be spoken while the rest is still arriving.
+ */
+class sentence_reader {
+public:
+  /** \brief Reads from `input`, which is not owned.
+   *
+   *  \param interrupt
+   *  If not `-1`, a descriptor, also not owned,
+   *  whose becoming readable stops the reading,
+   *  such as a socket listening for a client taking over.
+   */
+  explicit sentence_reader(int input, int interrupt = -1)
+      : input{input}, interrupt{interrupt} {}
+
+  /** \brief Returns the next sentence, reading more text if needed.
+   *
+   *  \return No value once `input` has reached end of file
+   *  and everything read has been returned,
+   *  or once `interrupt` is readable while waiting for more text,
+   *  in which case the incomplete sentence is dropped.
+   */
+  std::optional<std::string> operator()() {
+    for (;;) {
+      if (auto sentence = splitter.next_sentence()) {
+        return sentence;
+      }
+      if (is_at_end) {
+        return std::nullopt;
+      }
+      if (interrupt != -1 &&
+          posix::wait_until_readable_or(input, interrupt)) {
+        is_at_end = true;
+        return std::nullopt;
+      }
+      char buffer[4096];
+      auto const read = posix::read_some(input, buffer, sizeof(buffer));
+      if (read == 0u) {
+        is_at_end = true;
+        return splitter.finish();
+      }
+      splitter.append(std::string_view{buffer, read});
+    }
+  }
+
+private:
+  /** \brief Where text is read from. */
+  int const input;
+  /** \brief Stops reading when readable, unless `-1`. */
+  int const interrupt;
+  /** \brief Holds text read until a sentence is complete. */
+  text::sentence_splitter splitter;
+  /** \brief Whether `input` has reached end of file. */
+  bool is_at_end{false};
+};
+
+/** \brief Normalises the texts of another source into chunks.
+ *
+ *  Each text is cut at its sentence ends, and long sentences
+ *  at clause boundaries,
+ *  so that each chunk is synthesised and cached on its own,
+ *  and a text repeating a sentence of an earlier one reuses its audio.
+ */
+class normalising_source {
+public:
+  explicit normalising_source(text_source source)
+      : source{std::move(source)} {}
+
+  std::optional<std::string> operator()() {
+    for (;;) {
+      if (auto chunk = splitter.next_sentence()) {
+        return chunk;
+      }
+      // Each text is complete, so whatever is left is a chunk.
+      if (auto rest = splitter.finish()) {
+        return rest;
+      }
+      auto const next = source();
+      if (!next) {
+        return std::nullopt;
+      }
+      splitter.append(normaliser.normalise(*next));
+    }
+  }
+
+private:
+  text_source source;
+  text::normaliser normaliser;
+  text::sentence_splitter splitter;
+};
+
+/** \brief Splits `text` at each `|` into template slot values. */
+std::vector<std::string> split_slot_values(std::string_view text) {
+  std::vector<std::string> values;
+  for (;;) {
+    auto const separator = text.find('|');
+    values.emplace_back(text.substr(0u, separator));
+    if (separator == std::string_view::npos) {
+      return values;
+    }
+    text.remove_prefix(separator + 1u);
+  }
+}
+
+/** \brief Writes `count` samples to `sink` a block at a time.
+ *
+ *  Stops early once `cancellation` is cancelled, if not `nullptr`,
+ *  so that a long cached utterance can be interrupted
+ *  as quickly as one being synthesised.
+ */
+void write_until_cancelled(
+    audio::sink& sink, short const* samples, std::size_t count,
+    cancellation_token const* cancellation) {
+  while (count > 0u &&
+         !(cancellation && cancellation->is_cancelled())) {
+    auto const written = std::min(count, audio::block_sample_count);
+    sink.write(samples, written);
+    samples += written;
+    count -= written;
+  }
+}
+
+/** \brief Silences `sink` after its utterance has been cancelled.
+ *
+ *  The time from the cancellation to the silence is reported.
+ */
+void silence_cancelled(
+    audio::sink& sink, cancellation_token const& cancellation) {
+  sink.discard_pending();
+  auto const latency_ns =
+      instrumentation::now_ns() - cancellation.cancelled_at_ns();
+  instrumentation::local_metrics().cancel_latency_ns.record(latency_ns);
+  std::fprintf(
+      stderr, "Interrupted, silent %.3f ms after cancelling.\n",
+      static_cast<double>(latency_ns) / 1e6);
+}
+
+/** \brief Plays texts one after another until `next_text` runs out.
+ *
+ *  Synthesis happens on this thread,
+ *  with `synthesis_callback` pushing samples straight to the sink,
+ *  made for its type so that the write is not a virtual call.
+ *  That is the audio device or, with `options.output_path`, a file.
+ *  Synthesised texts are kept in a cache of `options.cache_bytes`
+ *  bytes, and repeated texts are played from there instead.
+ *  Texts too long for it, or for `options.memory_budget`,
+ *  are played without being recorded past that, nor cached.
+ *  If `options.cache_file` is not empty,
+ *  they are also kept in, and played from, a cache on disk.
+ *
+ *  Each text is a job of `barge_in`, if not `nullptr`.
+ *  Cancelling it stops synthesis at the next callback,
+ *  silences the sink and moves on to the next text.
+ *  Interrupted texts are not cached.
+ *
+ *  With `options.is_normalising`, texts are first given to a
+ *  \ref normalising_source, and passed on as UTF-8.
+ *
+ *  With `options.template_pattern`, each text is instead
+ *  the `|`-separated values filling its slots,
+ *  and is rendered by a \ref espeak_ng::template_renderer
+ *  sharing the cache.
+ */
+void play_directly(
+    text_source const& next_text, program_options const& options,
+    cancellation_token* barge_in = nullptr) {
+  auto const metrics_reporter = make_metrics_reporter(options);
   std::fprintf(stderr, "Starting eSpeak NG service.\n");
-  // Let eSpeak NG know where to find voice data.
-  // Use a default location by passing a `nullptr`.
-  // It must be given to eSpeak NG before initialisation.
-  espeak_ng_InitializePath(nullptr);
-  espeak_ng::service service;
+  espeak_ng::startup_timer startup;
+  // Gives eSpeak NG the location of its data before initialising,
+  // from the manifest if it is current, or the default location.
+  espeak_ng::quick_start const started{
+      options.startup_manifest, startup};
 
   {
     std::fprintf(stderr, "Initialising output.\n");
@@ -78,40 +692,131 @@ int main() {
         ENOUTPUT_MODE_SYNCHRONOUS, 0, nullptr);
     espeak_ng::throw_if_not_ok(status);
   }
+  startup.end_phase("initialise output");
 
   std::fprintf(stderr, "Getting sample rate.\n");
   auto sample_rate = espeak_ng_GetSampleRate();
 
-  std::fprintf(stderr, "Starting SDL2 audio service.\n");
-  sdl2::service audio_service{SDL_INIT_AUDIO};
+  auto const sink = make_sink(options, sample_rate);
 
-  sdl2::audio_device audio_device;
-  {
-    SDL_AudioSpec required_audio_spec;
-    {
-      SDL_zero(required_audio_spec);
-      required_audio_spec.freq = sample_rate;
-      required_audio_spec.format = AUDIO_S16LSB;
-      required_audio_spec.channels = 1u;
-      required_audio_spec.samples = 4096u;
+  text_source const next_chunk =
+      options.is_normalising
+          ? text_source{normalising_source{next_text}}
+          : next_text;
+  // The cache key includes the voice,
+  // so use a known one instead of the eSpeak NG default.
+  auto const voice = [&options]() {
+    espeak_ng::synthesis_options known;
+    if (options.is_normalising) {
+      // Normalised text is valid UTF-8, so needs no detection.
+      known.flags = espeakCHARS_UTF8;
     }
-    audio_device = sdl2::audio_device{SDL_OpenAudioDevice(
-        nullptr, 0, &required_audio_spec, nullptr, 0)};
-    sdl2::throw_if(nullptr == audio_device.get());
+    return known;
+  }();
+  espeak_ng::voice_pool voices{&started.get_voices()};
+  voices.preload(options.preloaded_voices);
+  voices.write_report(stderr);
+  voices.select(voice.voice_name);
+  startup.end_phase("load voices");
+  startup.write_report(stderr);
+  espeak_ng::pcm_cache cache{options.cache_bytes};
+  std::unique_ptr<espeak_ng::disk_pcm_cache> disk_cache;
+  if (!options.cache_file.empty()) {
+    disk_cache =
+        std::make_unique<espeak_ng::disk_pcm_cache>(options.cache_file);
   }
+  std::optional<espeak_ng::prompt_template> prompt;
+  if (!options.template_pattern.empty()) {
+    prompt.emplace(options.template_pattern);
+  }
+  // A recording larger than the cache would only be evicted,
+  // so stop recording there instead of holding a long text whole.
+  auto recording_bytes = options.cache_bytes;
+  if (options.memory_budget != 0u) {
+    recording_bytes = std::min(recording_bytes, options.memory_budget);
+  }
+  auto const recording_limit = recording_bytes / sizeof(short);
+  // A 5 ms crossfade hides a join without blurring what is around it.
+  espeak_ng::template_renderer renderer{
+      cache, static_cast<std::size_t>(sample_rate) / 200u,
+      recording_limit};
 
-  std::fprintf(stderr, "Setting synthesis callback.\n");
-  espeak_SetSynthCallback(SynthCallback);
-
-  {
+  while (auto const next = next_chunk()) {
+    auto const& text_to_speak = *next;
+    if (barge_in) {
+      barge_in->begin_job();
+    }
+    auto const is_cancelled = [barge_in]() {
+      return barge_in && barge_in->is_cancelled();
+    };
+    if (prompt) {
+      std::fprintf(stderr, "Rendering template.\n");
+      try {
+        if (!renderer.render(
+                *prompt, split_slot_values(text_to_speak), voice,
+                *sink, barge_in)) {
+          silence_cancelled(*sink, *barge_in);
+        }
+      } catch (std::invalid_argument const& error) {
+        // One badly filled text need not stop a live source.
+        std::fprintf(stderr, "Skipping text: %s\n", error.what());
+      }
+      continue;
+    }
+    if (auto const cached = cache.find(text_to_speak, voice)) {
+      std::fprintf(stderr, "Playing from cache.\n");
+      if (options.is_printing_events) {
+        event_printer{text_to_speak}.on_events(cached->timeline, 0u);
+      }
+      cached->samples.for_each_chunk(
+          [&](short const* chunk, std::size_t count) {
+            write_until_cancelled(*sink, chunk, count, barge_in);
+          });
+      if (is_cancelled()) {
+        silence_cancelled(*sink, *barge_in);
+      } else {
+        sink->flush();
+      }
+      continue;
+    }
+    if (disk_cache) {
+      auto const stored = disk_cache->find(text_to_speak, voice);
+      if (stored) {
+        std::fprintf(stderr, "Playing from cache file.\n");
+        write_until_cancelled(
+            *sink, stored->samples, stored->sample_count, barge_in);
+        if (is_cancelled()) {
+          silence_cancelled(*sink, *barge_in);
+        } else {
+          sink->flush();
+        }
+        continue;
+      }
+    }
     std::fprintf(stderr, "Start synthesis.\n");
-    auto const text_to_speak = std::string{"Hello world."};
-    auto const status = espeak_ng_Synthesize(
-        text_to_speak.c_str(), text_to_speak.size() + 1, 0,
-        POS_CHARACTER, text_to_speak.size(), espeakCHARS_AUTO, 0,
-        &audio_device);
-    SDL_PauseAudioDevice(audio_device, 0);
+    espeak_ng::synthesis_output recording;
+    event_printer printer{text_to_speak};
+    basic_synthesis_destination<audio::coalescing_sink> destination{
+        sink.get(), &recording,
+        options.is_printing_events ? &printer : nullptr, barge_in};
+    destination.recording_limit = recording_limit;
+    auto const status =
+        synthesise_to(text_to_speak, voice.flags, destination);
+    if (is_cancelled()) {
+      // Restores parameters an interrupted SSML text may have changed.
+      espeak_ng::throw_if_not_ok(espeak_ng_Cancel());
+      silence_cancelled(*sink, *barge_in);
+      continue;
+    }
     espeak_ng::throw_if_not_ok(status);
+    if (destination.is_recording_truncated) {
+      std::fprintf(stderr, "Too long to cache.\n");
+      continue;
+    }
+    if (disk_cache) {
+      disk_cache->insert(text_to_speak, voice, recording.samples);
+    }
+    cache.insert(text_to_speak, voice, std::move(recording));
   }
 
   {
@@ -119,6 +824,647 @@ int main() {
     auto const status = espeak_ng_Synchronize();
     espeak_ng::throw_if_not_ok(status);
   }
+  sink->finish();
+  std::fprintf(
+      stderr, "Cache hits: %llu, misses: %llu, evictions: %llu.\n",
+      static_cast<unsigned long long>(cache.hits()),
+      static_cast<unsigned long long>(cache.misses()),
+      static_cast<unsigned long long>(cache.evictions()));
+  if (prompt) {
+    std::fprintf(
+        stderr, "Template frames and values synthesised: %llu.\n",
+        static_cast<unsigned long long>(renderer.syntheses()));
+  }
+  if (disk_cache) {
+    std::fprintf(
+        stderr,
+        "Cache file hits: %llu, misses: %llu, rejections: %llu.\n",
+        static_cast<unsigned long long>(disk_cache->hits()),
+        static_cast<unsigned long long>(disk_cache->misses()),
+        static_cast<unsigned long long>(disk_cache->rejections()));
+  }
+}
+
+/** \brief Cancels the job being spoken when a connection arrives.
+ *
+ *  This is barge-in: a new client interrupts the previous one
+ *  instead of waiting for everything it asked for to be spoken.
+ *  The pending connection is left for the speaking thread to accept.
+ */
+class barge_in_watcher {
+public:
+  /** \brief Watches `listening`, not owned, for `token`. */
+  barge_in_watcher(int listening, cancellation_token& token)
+      : listening{listening}, token{token},
+        watching_thread{[this]() { run(); }} {}
+
+  ~barge_in_watcher() {
+    is_stopping.store(true, std::memory_order_relaxed);
+    watching_thread.join();
+  }
+
+private:
+  void run() {
+    constexpr std::chrono::milliseconds poll_interval{10};
+    while (!is_stopping.load(std::memory_order_relaxed)) {
+      // Noted before waiting, so that a connection accepted meanwhile
+      // cannot cancel the job it started.
+      auto const job = token.job();
+      if (posix::wait_until_readable(listening, poll_interval)) {
+        token.cancel(job);
+        // The connection stays readable until accepted.
+        std::this_thread::sleep_for(poll_interval);
+      }
+    }
+  }
+
+  int const listening;
+  cancellation_token& token;
+  std::atomic<bool> is_stopping{false};
+  /** \brief Started last, after everything it uses. */
+  std::thread watching_thread;
+};
+
+/** \brief Prints how long the workers of `pool` took per voice. */
+void print_load_times(espeak_ng::worker_pool const& pool) {
+  for (auto const& loaded : pool.get_load_times()) {
+    std::fprintf(
+        stderr, "Loaded voice \"%s\" in at most %.3f ms.\n",
+        loaded.voice_name.c_str(),
+        std::chrono::duration<double, std::milli>(loaded.duration)
+            .count());
+  }
+}
+
+/** \brief Plays texts synthesised by `options.worker_count` processes.
+ *
+ *  Texts are synthesised concurrently
+ *  but played back, or written, in the order given.
+ */
+void play_with_workers(program_options const& options) {
+  // Fork before SDL2 or the metrics reporter start any thread.
+  std::fprintf(
+      stderr, "Starting %zu eSpeak NG workers.\n",
+      options.worker_count);
+  espeak_ng::worker_pool pool{
+      options.worker_count, 4u,
+      worker_ring_capacity(options, options.worker_count),
+      options.preloaded_voices, worker_cpus(options)};
+  print_load_times(pool);
+  auto const metrics_reporter = make_metrics_reporter(options);
+
+  auto const sink = make_sink(options, pool.get_sample_rate());
+  auto const play = [&sink](short const* samples, std::size_t count) {
+    sink->write(samples, count);
+  };
+  // Each text ends an utterance, which is not held back.
+  auto const play_next = [&]() {
+    pool.collect(play);
+    sink->flush();
+  };
+  for (auto const& text_to_speak : options.texts) {
+    if (pool.is_full()) {
+      play_next();
+    }
+    pool.submit(text_to_speak);
+  }
+  while (pool.in_flight() > 0u) {
+    play_next();
+  }
+  sink->finish();
+}
+
+/** \brief Speaks the document at `options.document_path`.
+ *
+ *  Its segments, see \ref espeak_ng::split_document,
+ *  are synthesised by `options.worker_count` processes,
+ *  or one per core if not given,
+ *  and played back, or written, as one stream.
+ *  Every voice of `options.speakers` is loaded by the workers
+ *  when they start, instead of by whichever job needs it first.
+ */
+void speak_document(program_options const& options) {
+  std::ifstream file{options.document_path, std::ios::binary};
+  if (!file) {
+    throw std::runtime_error(
+        "Unable to open document: " + options.document_path);
+  }
+  std::string const document{
+      std::istreambuf_iterator<char>{file},
+      std::istreambuf_iterator<char>{}};
+  auto const segments =
+      espeak_ng::split_document(document, options.speakers);
+
+  auto worker_count = options.worker_count;
+  if (worker_count == 0u) {
+    worker_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+  auto voice_names = options.preloaded_voices;
+  for (auto const& speaker : options.speakers) {
+    auto const& voice_name = speaker.second.voice_name;
+    if (std::find(voice_names.begin(), voice_names.end(), voice_name) ==
+        voice_names.end()) {
+      voice_names.push_back(voice_name);
+    }
+  }
+  // Fork before SDL2 or the metrics reporter start any thread.
+  std::fprintf(
+      stderr, "Starting %zu eSpeak NG workers for %zu segments.\n",
+      worker_count, segments.size());
+  espeak_ng::worker_pool pool{
+      worker_count, 4u, worker_ring_capacity(options, worker_count),
+      voice_names, worker_cpus(options)};
+  print_load_times(pool);
+  auto const metrics_reporter = make_metrics_reporter(options);
+
+  auto const sink = make_sink(options, pool.get_sample_rate());
+  espeak_ng::event_timeline timeline;
+  auto const sample_count = espeak_ng::render_document(
+      pool, segments, *sink,
+      options.is_printing_events ? &timeline : nullptr);
+  sink->finish();
+  event_printer{document}.on_events(timeline, 0u);
+  std::fprintf(
+      stderr, "Spoke %.3f s of audio.\n",
+      static_cast<double>(sample_count) / pool.get_sample_rate());
+}
+
+/** \brief One line of a batch manifest. */
+struct batch_item {
+  /** \brief Names the output file, `id.wav`. */
+  std::string id;
+  /** \brief Voice to synthesise `text` with. */
+  std::string voice_name;
+  std::string text;
+};
+
+/** \brief Reads the manifest at `path`.
+ *
+ *  Each line is an id, a voice name and a text, separated by tabs.
+ *  Empty lines and lines starting with `#` are skipped.
+ *
+ *  \exception std::runtime_error
+ *  If the file cannot be read or a line does not have three fields.
+ */
+std::vector<batch_item> read_batch_manifest(std::string const& path) {
+  std::ifstream manifest{path};
+  if (!manifest) {
+    throw std::runtime_error("Unable to open manifest: " + path);
+  }
+  std::vector<batch_item> items;
+  std::string line;
+  for (std::size_t line_number = 1u; std::getline(manifest, line);
+       ++line_number) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty() || line.front() == '#') {
+      continue;
+    }
+    auto const first_tab = line.find('\t');
+    auto const second_tab = first_tab == std::string::npos
+                                ? std::string::npos
+                                : line.find('\t', first_tab + 1u);
+    if (second_tab == std::string::npos || first_tab == 0u) {
+      throw std::runtime_error(
+          path + ":" + std::to_string(line_number) +
+          ": expected id, voice and text separated by tabs");
+    }
+    items.push_back(batch_item{
+        line.substr(0u, first_tab),
+        line.substr(first_tab + 1u, second_tab - first_tab - 1u),
+        line.substr(second_tab + 1u)});
+  }
+  return items;
+}
+
+/** \brief Counts samples on their way to another sink. */
+class counting_sink final : public audio::sink {
+public:
+  explicit counting_sink(std::unique_ptr<audio::sink> output)
+      : output{std::move(output)} {}
+
+  void write(short const* samples, std::size_t sample_count) override {
+    this->sample_count += sample_count;
+    output->write(samples, sample_count);
+  }
+
+  void finish() override { output->finish(); }
+
+  /** \brief Samples given to \ref write. */
+  std::uint64_t sample_count{0u};
+
+private:
+  std::unique_ptr<audio::sink> const output;
+};
+
+/** \brief Renders each item of the manifest to its own WAV file.
+ *
+ *  eSpeak NG is initialised once for the whole manifest,
+ *  every voice in it is loaded before the first item,
+ *  and the voice is only changed when it differs from the last item,
+ *  so that short prompts do not pay for set-up again each time.
+ *  Throughput is reported once all items are written.
+ */
+void render_batch(program_options const& options) {
+  auto const items = read_batch_manifest(options.batch_path);
+  auto const metrics_reporter = make_metrics_reporter(options);
+
+  std::fprintf(stderr, "Starting eSpeak NG service.\n");
+  espeak_ng::startup_timer startup;
+  espeak_ng::quick_start const started{
+      options.startup_manifest, startup};
+  espeak_ng::throw_if_not_ok(espeak_ng_InitializeOutput(
+      ENOUTPUT_MODE_SYNCHRONOUS, 0, nullptr));
+  auto const sample_rate = espeak_ng_GetSampleRate();
+  startup.end_phase("initialise output");
+
+  // Load every voice used before rendering anything,
+  // so that a misspelt voice is found before, not during, the batch.
+  auto voice_names = options.preloaded_voices;
+  for (auto const& item : items) {
+    if (std::find(
+            voice_names.begin(), voice_names.end(), item.voice_name) ==
+        voice_names.end()) {
+      voice_names.push_back(item.voice_name);
+    }
+  }
+  espeak_ng::voice_pool voices{&started.get_voices()};
+  voices.preload(voice_names);
+  voices.write_report(stderr);
+  startup.end_phase("load voices");
+  startup.write_report(stderr);
+
+  std::fprintf(
+      stderr, "Rendering %zu utterances to \"%s\".\n", items.size(),
+      options.output_directory.c_str());
+  auto const start = std::chrono::steady_clock::now();
+  std::uint64_t sample_count = 0u;
+  espeak_ng::synthesis_options const voice;
+  for (auto const& item : items) {
+    voices.select(item.voice_name);
+    auto counted =
+        std::make_unique<counting_sink>(audio::make_file_sink(
+            options.output_directory + "/" + item.id + ".wav",
+            sample_rate, options.output_conversion));
+    auto const& counter = *counted;
+    // Chunks are gathered into blocks by a direct call,
+    // so that counting and converting are virtual once per block.
+    audio::coalescing_sink sink{
+        std::move(counted), audio::block_sample_count};
+    basic_synthesis_destination<audio::coalescing_sink> destination{
+        &sink, nullptr};
+    espeak_ng::throw_if_not_ok(
+        synthesise_to(item.text, voice.flags, destination));
+    sink.finish();
+    sample_count += counter.sample_count;
+  }
+  auto const elapsed = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+
+  auto const audio_seconds =
+      static_cast<double>(sample_count) / sample_rate;
+  std::fprintf(
+      stderr,
+      "Rendered %zu utterances, %llu samples, %.3f s of audio "
+      "in %.3f s.\n",
+      items.size(), static_cast<unsigned long long>(sample_count),
+      audio_seconds, elapsed);
+  if (elapsed > 0.0) {
+    std::fprintf(
+        stderr, "Utterances/s: %.1f, samples/s: %.0f.\n",
+        items.size() / elapsed, sample_count / elapsed);
+  }
+  if (audio_seconds > 0.0) {
+    // Below 1 means faster than real time.
+    std::fprintf(
+        stderr, "Real-time factor: %.4f.\n", elapsed / audio_seconds);
+  }
+}
+
+/** \brief Streams speech to HTTP clients until killed.
+ *
+ *  Synthesis is done by an \ref espeak_ng::engine thread,
+ *  with the samples sent to each client while being synthesised.
+ */
+void serve(program_options const& options) {
+  auto const metrics_reporter = make_metrics_reporter(options);
+  std::fprintf(stderr, "Starting eSpeak NG engine.\n");
+  espeak_ng::engine speech{64u, options.preloaded_voices};
+  for (auto const& loaded : speech.get_load_times()) {
+    std::fprintf(
+        stderr, "Loaded voice \"%s\" in %.3f ms.\n",
+        loaded.voice_name.c_str(),
+        std::chrono::duration<double, std::milli>(loaded.duration)
+            .count());
+  }
+  auto const& address = options.serve_address;
+  auto const separator = address.rfind(':');
+  auto const host = separator == std::string::npos
+                        ? std::string{}
+                        : address.substr(0u, separator);
+  auto const port = separator == std::string::npos
+                        ? address
+                        : address.substr(separator + 1u);
+  constexpr std::size_t max_in_flight = 16u;
+  // Each response holds up to this unsent and as much being sent.
+  auto high_water_bytes = std::size_t{256u} << 10;
+  if (options.memory_budget != 0u) {
+    high_water_bytes = std::max(
+        options.memory_budget / (2u * max_in_flight),
+        std::size_t{16u} << 10);
+  }
+  espeak_ng::streaming_server server{
+      speech, host, port, max_in_flight, high_water_bytes};
+  std::fprintf(
+      stderr, "Serving speech on \"%s\" at %d Hz.\n", address.c_str(),
+      speech.get_sample_rate());
+  server.run();
+}
+
+/** \brief Throws if `options` are not meant to be used together.
+ *
+ *  \exception std::invalid_argument
+ *  If more than one source of text is given,
+ *  or an option is given that the source chosen would ignore.
+ */
+void check_combinations(program_options const& options) {
+  auto const is_playing_directly =
+      options.is_reading_stdin || !options.socket_path.empty();
+  std::vector<std::string> sources;
+  for (auto const& [name, is_given] :
+       {std::pair{"--serve", !options.serve_address.empty()},
+        std::pair{"--batch", !options.batch_path.empty()},
+        std::pair{"--document", !options.document_path.empty()},
+        std::pair{"--stdin", options.is_reading_stdin},
+        std::pair{"--socket", !options.socket_path.empty()}}) {
+    if (is_given) {
+      sources.emplace_back(name);
+    }
+  }
+  if (sources.size() > 1u) {
+    throw std::invalid_argument(
+        sources[0] + " cannot be combined with " + sources[1]);
+  }
+  if (options.worker_count > 0u && !sources.empty() &&
+      options.document_path.empty()) {
+    throw std::invalid_argument(
+        "--workers cannot be combined with " + sources[0]);
+  }
+  if (!options.template_pattern.empty() &&
+      (sources.empty() ? options.worker_count > 0u
+                       : !is_playing_directly)) {
+    throw std::invalid_argument(
+        "--template cannot be combined with " +
+        (sources.empty() ? std::string{"--workers"} : sources[0]));
+  }
+}
+
+/** \brief Reads `argv` into options, as described for \ref main.
+ *
+ *  \exception std::invalid_argument
+ *  If a value is malformed or the options cannot be combined,
+ *  see \ref check_combinations.
+ *  \exception std::runtime_error
+ *  If `--speakers` is not given `name=voice` pairs.
+ */
+program_options parse_options(int argc, char* argv[]) {
+  program_options options;
+  for (int index = 1; index < argc; ++index) {
+    auto const argument = std::string{argv[index]};
+    if (argument == "--workers" && index + 1 < argc) {
+      options.worker_count =
+          boni::parse_number<std::size_t>(argument, argv[++index]);
+    } else if (argument == "--cache-bytes" && index + 1 < argc) {
+      options.cache_bytes =
+          boni::parse_number<std::size_t>(argument, argv[++index]);
+    } else if (argument == "--cache-file" && index + 1 < argc) {
+      options.cache_file = argv[++index];
+    } else if (argument == "--startup-cache" && index + 1 < argc) {
+      options.startup_manifest = argv[++index];
+    } else if (argument == "--voices" && index + 1 < argc) {
+      std::string_view names{argv[++index]};
+      while (!names.empty()) {
+        auto const comma = std::min(names.find(','), names.size());
+        if (comma > 0u) {
+          options.preloaded_voices.emplace_back(
+              names.substr(0u, comma));
+        }
+        names.remove_prefix(std::min(comma + 1u, names.size()));
+      }
+    } else if (argument == "--speakers" && index + 1 < argc) {
+      std::string_view pairs{argv[++index]};
+      while (!pairs.empty()) {
+        auto const comma = std::min(pairs.find(','), pairs.size());
+        auto const pair = pairs.substr(0u, comma);
+        auto const equals = pair.find('=');
+        if (equals == std::string_view::npos) {
+          throw std::runtime_error(
+              "Expected name=voice for --speakers");
+        }
+        options.speakers[std::string{pair.substr(0u, equals)}]
+            .voice_name = pair.substr(equals + 1u);
+        pairs.remove_prefix(std::min(comma + 1u, pairs.size()));
+      }
+    } else if (argument == "--document" && index + 1 < argc) {
+      options.document_path = argv[++index];
+    } else if (argument == "--template" && index + 1 < argc) {
+      options.template_pattern = argv[++index];
+    } else if (argument == "--normalise") {
+      options.is_normalising = true;
+    } else if (argument == "--events") {
+      options.is_printing_events = true;
+    } else if (argument == "--stdin") {
+      options.is_reading_stdin = true;
+    } else if (argument == "--socket" && index + 1 < argc) {
+      options.socket_path = argv[++index];
+    } else if (argument == "--output" && index + 1 < argc) {
+      options.output_path = argv[++index];
+    } else if (argument == "--output-format" && index + 1 < argc) {
+      options.output_conversion.format =
+          audio::parse_sample_format(argv[++index]);
+    } else if (argument == "--output-rate" && index + 1 < argc) {
+      options.output_conversion.output_rate =
+          boni::parse_number<int>(argument, argv[++index]);
+      if (options.output_conversion.output_rate <= 0) {
+        throw std::invalid_argument("--output-rate must be positive");
+      }
+    } else if (argument == "--gain" && index + 1 < argc) {
+      options.output_conversion.gain =
+          boni::parse_number<float>(argument, argv[++index]);
+    } else if (argument == "--serve" && index + 1 < argc) {
+      options.serve_address = argv[++index];
+    } else if (argument == "--batch" && index + 1 < argc) {
+      options.batch_path = argv[++index];
+    } else if (argument == "--output-directory" && index + 1 < argc) {
+      options.output_directory = argv[++index];
+    } else if (argument == "--latency" && index + 1 < argc) {
+      options.target_latency_ms =
+          boni::parse_number<std::size_t>(argument, argv[++index]);
+    } else if (argument == "--realtime" && index + 1 < argc) {
+      options.realtime_priority =
+          boni::parse_number<int>(argument, argv[++index]);
+      if (options.realtime_priority < 1 ||
+          options.realtime_priority > 99) {
+        throw std::invalid_argument(
+            "--realtime priority must be from 1 to 99");
+      }
+    } else if (argument == "--memory-budget" && index + 1 < argc) {
+      options.memory_budget =
+          boni::parse_number<std::size_t>(argument, argv[++index]);
+    } else if (argument == "--stats-interval" && index + 1 < argc) {
+      options.stats_interval_ms =
+          boni::parse_number<std::size_t>(argument, argv[++index]);
+    } else if (argument == "--statsd" && index + 1 < argc) {
+      options.statsd_address = argv[++index];
+    } else {
+      options.texts.push_back(argument);
+    }
+  }
+  if (options.texts.empty()) {
+    options.texts.push_back("Hello world.");
+  }
+  check_combinations(options);
+  return options;
+}
+
+/** \brief Speaks the texts given as arguments, or "Hello world.".
+ *
+ *  Usage:
+ *  `espeak-ng-example [--workers count | --stdin | --socket path]
+ *  [--cache-bytes size] [--cache-file prefix] [--output path]
+ *  [--events] [--normalise] [--template pattern] [text...]`,
+ *  or `espeak-ng-example --batch manifest [--output-directory path]`,
+ *  or `espeak-ng-example --serve [host:]port`,
+ *  or `espeak-ng-example --document path [--speakers name=voice,...]
+ *  [--workers count] [--output path] [--events]`,
+ *  either optionally followed by
+ *  `[--voices name,...] [--stats-interval milliseconds]
+ *  [--statsd host:port] [--output-format format] [--output-rate hz]
+ *  [--gain factor] [--latency milliseconds]
+ *  [--realtime priority] [--memory-budget bytes]
+ *  [--startup-cache path]`
+ *
+ *  With `--workers`, synthesis is done by that many worker processes.
+ *  Otherwise, repeated texts are played from a cache of `size` bytes,
+ *  and from the files starting with `prefix` if given.
+ *  With `--stdin` or `--socket`, text is read from standard input
+ *  or from connections to a Unix socket, one after another,
+ *  and each sentence is spoken as soon as it has been read.
+ *  A new connection to the socket interrupts the one being spoken.
+ *  With `--output`, samples are written to the file at `path`
+ *  instead of being played, and no audio device is used.
+ *  With `--normalise`, texts are normalised and cut into chunks
+ *  before synthesis and caching.
+ *  With `--template`, each text gives the `|`-separated values
+ *  of the `{}` slots of `pattern`;
+ *  the rest of `pattern` is synthesised once and reused.
+ *  With `--events`, the sample offsets of words, sentences and marks
+ *  are printed as they are synthesised.
+ *  With `--serve`, speech is streamed to HTTP clients,
+ *  as described by \ref espeak_ng::streaming_server.
+ *  With `--batch`, each line of the manifest is rendered to its own
+ *  WAV file in the output directory, without using an audio device.
+ *  Files are written as 16-bit samples at the synthesis rate unless
+ *  `--output-format` gives `f32`, `mulaw` or `alaw` instead,
+ *  `--output-rate` gives another rate to resample to,
+ *  or `--gain` gives a factor to scale samples by.
+ *  With `--latency`, the audio device period is sized
+ *  for that output latency instead of about 186 ms,
+ *  and the latency obtained is reported at the end.
+ *  With `--realtime`, the audio thread asks for `SCHED_FIFO`
+ *  at `priority` and gets the last CPU, with worker processes
+ *  pinned to the others, and what it obtained is reported at the end.
+ *  With `--memory-budget`, samples buffered for slow consumers,
+ *  that is for playback by worker processes or for HTTP clients,
+ *  are bounded to about that many bytes in all,
+ *  with synthesis pausing when they are full,
+ *  and texts are not recorded for the cache past that size.
+ *  The peak of buffered samples and resident memory
+ *  is printed at the end either way.
+ *  With `--document`, the paragraphs of the file at `path`
+ *  are synthesised concurrently by the workers, one per core
+ *  unless `--workers` is given, and spoken as one stream.
+ *  Paragraphs and lines starting with `name:`,
+ *  for a name given in `--speakers`, are spoken with that voice.
+ *  With `--voices`, those voices are loaded, and timed, at start-up.
+ *  With `--startup-cache`, the data path and installed voices
+ *  are kept in the manifest at `path` between runs,
+ *  so that voices are loaded by file without scanning them all.
+ *  The time taken by each phase of start-up is printed either way.
+ *  With `--stats-interval` or `--statsd`, metrics of the synthesis
+ *  callback and audio buffer, including those of worker processes,
+ *  are periodically written to `stderr`
+ *  or sent to a StatsD server, and once more at the end.
+ *  Malformed values and options that cannot be combined,
+ *  such as `--workers` with `--stdin`, are reported
+ *  and exit with failure before anything is started.
+ *  Errors while running are printed and exit with failure too.
+ */
+int main(int argc, char* argv[]) {
+  program_options options;
+  try {
+    options = parse_options(argc, argv);
+  } catch (std::exception const& error) {
+    std::fprintf(stderr, "%s\n", error.what());
+    return EXIT_FAILURE;
+  }
+
+  try {
+    if (!options.serve_address.empty()) {
+      serve(options);
+    } else if (!options.batch_path.empty()) {
+      render_batch(options);
+    } else if (!options.document_path.empty()) {
+      speak_document(options);
+    } else if (options.is_reading_stdin) {
+      play_directly(sentence_reader{STDIN_FILENO}, options);
+    } else if (!options.socket_path.empty()) {
+      auto const listening =
+          posix::listen_on_unix_socket(options.socket_path);
+      cancellation_token barge_in;
+      barge_in_watcher watcher{listening, barge_in};
+      posix::file_descriptor connection;
+      std::optional<sentence_reader> read_sentence;
+      play_directly(
+          [&]() -> std::optional<std::string> {
+            for (;;) {
+              if (read_sentence &&
+                  posix::wait_until_readable(
+                      listening, std::chrono::milliseconds{0})) {
+                // A newer client takes over.
+                read_sentence.reset();
+              }
+              if (!read_sentence) {
+                connection = posix::accept_connection(listening);
+                // An idle client is still taken over from.
+                read_sentence.emplace(connection, listening);
+              }
+              if (auto sentence = (*read_sentence)()) {
+                return sentence;
+              }
+              read_sentence.reset();
+            }
+          },
+          options, &barge_in);
+    } else if (options.worker_count > 0u) {
+      play_with_workers(options);
+    } else {
+      std::size_t next_index = 0u;
+      play_directly(
+          [&]() -> std::optional<std::string> {
+            if (next_index == options.texts.size()) {
+              return std::nullopt;
+            }
+            return options.texts[next_index++];
+          },
+          options);
+    }
+  } catch (std::exception const& error) {
+    std::fprintf(stderr, "%s\n", error.what());
+    return EXIT_FAILURE;
+  }
+  print_memory_usage();
   std::fprintf(stderr, "Exiting.\n");
-  SDL_Delay(1500);
 }
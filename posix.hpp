@@ -0,0 +1,547 @@
+#pragma once
+
+// Local dependencies.
+#include "boni.hpp"
+
+// External dependencies.
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Standard C++ libraries.
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+// Standard C libraries.
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+/** \brief RAII wrappers for POSIX functions.
+ *
+ *  As with the other wrapper namespaces,
+ *  only what the example needs is wrapped.
+ *  Unlike eSpeak NG and SDL2, POSIX reports errors through `errno`.
+ *
+ *  ```cpp
+ *  {
+ *    auto const ends = posix::make_pipe();
+ *    posix::write_all(ends.write_end, "Hi", 2u);
+ *    char received[2];
+ *    posix::read_all(ends.read_end, received, 2u);
+ *    // Closes both file descriptors automatically.
+ *  }
+ *  ```
+ */
+namespace posix {
+
+/** \brief Throw `std::runtime_error`
+ *  if the given `is_throwing` condition is `true`.
+ *
+ *  If `is_throwing` indicates an error,
+ *  the message corresponding to the current `errno`
+ *  is written to `stderr`.
+ *  An exception is then thrown after the message is written.
+ */
+inline void throw_if(const bool is_throwing) {
+  if (is_throwing) {
+    std::fprintf(stderr, "%s\n", std::strerror(errno));
+    throw std::runtime_error("POSIX error");
+  }
+}
+
+/** \brief Calls `close`, discarding the result.
+ *
+ *  This is an implementation detail for
+ *  making RAII for `posix::file_descriptor`.
+ *  Retrying `close` after `EINTR` is not safe on Linux,
+ *  so there is nothing useful to do with the result.
+ */
+inline void close_file_descriptor(int file_descriptor) {
+  ::close(file_descriptor);
+}
+
+/** \brief Callable taking a file descriptor and closing it. */
+using file_descriptor_deleter =
+    boni::nullable_deleter<int, close_file_descriptor, -1>;
+
+/** \brief Represents an open file descriptor.
+ *
+ *  Closes the descriptor when going out of scope.
+ *  A default constructed instance holds `-1`.
+ */
+using file_descriptor = boni::auto_handle<file_descriptor_deleter>;
+
+/** \brief The two ends of a pipe created by \ref make_pipe. */
+struct pipe_ends {
+  /** \brief Data written to \ref write_end is read from here. */
+  file_descriptor read_end;
+  /** \brief Data written here is read from \ref read_end. */
+  file_descriptor write_end;
+};
+
+/** \brief Calls `pipe`.
+ *
+ *  \exception std::runtime_error
+ *  If the pipe cannot be created.
+ */
+inline pipe_ends make_pipe() {
+  int ends[2];
+  throw_if(0 != ::pipe(ends));
+  return pipe_ends{file_descriptor{ends[0]}, file_descriptor{ends[1]}};
+}
+
+/** \brief Adds `O_NONBLOCK` to the status flags of `file_descriptor`.
+ *
+ *  \exception std::runtime_error
+ *  If the flags cannot be changed.
+ */
+inline void set_non_blocking(int file_descriptor) {
+  auto const flags = ::fcntl(file_descriptor, F_GETFL);
+  throw_if(flags == -1);
+  throw_if(-1 == ::fcntl(file_descriptor, F_SETFL, flags | O_NONBLOCK));
+}
+
+/** \brief Writes exactly `size` bytes, retrying short writes.
+ *
+ *  \exception std::runtime_error
+ *  If writing fails, including if the other end has been closed
+ *  and `SIGPIPE` is ignored.
+ */
+inline void
+write_all(int file_descriptor, void const* data, std::size_t size) {
+  auto bytes = static_cast<char const*>(data);
+  while (size > 0u) {
+    auto const written = ::write(file_descriptor, bytes, size);
+    if (written == -1 && errno == EINTR) {
+      continue;
+    }
+    throw_if(written == -1);
+    bytes += written;
+    size -= static_cast<std::size_t>(written);
+  }
+}
+
+/** \brief Reads exactly `size` bytes, retrying short reads.
+ *
+ *  \return `false` if end of file is reached before reading anything,
+ *  so that a closed pipe can be told apart from an error.
+ *  \exception std::runtime_error
+ *  If reading fails, or end of file is reached part way.
+ */
+inline bool
+read_all(int file_descriptor, void* data, std::size_t size) {
+  auto bytes = static_cast<char*>(data);
+  auto const requested = size;
+  while (size > 0u) {
+    auto const read = ::read(file_descriptor, bytes, size);
+    if (read == -1 && errno == EINTR) {
+      continue;
+    }
+    throw_if(read == -1);
+    if (read == 0) {
+      if (size == requested) {
+        return false;
+      }
+      throw std::runtime_error("Unexpected end of file");
+    }
+    bytes += read;
+    size -= static_cast<std::size_t>(read);
+  }
+  return true;
+}
+
+/** \brief Callable unmapping memory mapped by `mmap`.
+ *
+ *  Unlike most deleters, `munmap` needs the length of the mapping,
+ *  so the deleter is stateful and remembers it.
+ *  This is an implementation detail for `posix::memory_map`.
+ */
+class memory_map_deleter {
+public:
+  /** \brief The start of the mapped region. */
+  using handle_type = void*;
+  using pointer = handle_type;
+
+  /** \brief Length of the mapping, as given to `mmap`. */
+  std::size_t length{0u};
+
+  /** \brief Calls `munmap` unless the pointer is `nullptr`. */
+  void operator()(pointer address_to_unmap) {
+    if (address_to_unmap != nullptr) {
+      ::munmap(address_to_unmap, length);
+    }
+  }
+};
+
+/** \brief Represents a region of memory mapped with `mmap`.
+ *
+ *  Unmaps the region when going out of scope.
+ *  The length is available from `get_deleter().length`.
+ */
+using memory_map = boni::auto_handle<memory_map_deleter>;
+
+/** \brief Calls `mmap`, with the address left to the system.
+ *
+ *  \exception std::runtime_error
+ *  If the mapping fails.
+ */
+inline memory_map map_memory(
+    std::size_t length, int protection, int flags,
+    int file_descriptor = -1, off_t offset = 0) {
+  auto const address = ::mmap(
+      nullptr, length, protection, flags, file_descriptor, offset);
+  throw_if(address == MAP_FAILED);
+  return memory_map{address, memory_map_deleter{length}};
+}
+
+/** \brief Returns the size in bytes of an open file.
+ *
+ *  \exception std::runtime_error
+ *  If `fstat` fails.
+ */
+inline std::size_t file_size(int file_descriptor) {
+  struct stat status;
+  throw_if(0 != ::fstat(file_descriptor, &status));
+  return static_cast<std::size_t>(status.st_size);
+}
+
+/** \brief Holds an exclusive `flock` on a file while in scope.
+ *
+ *  `flock` locks are per open file description,
+ *  so this serialises different processes and different opens,
+ *  but not threads sharing one descriptor.
+ */
+class exclusive_file_lock {
+public:
+  /** \brief Waits until the lock is acquired.
+   *
+   *  \exception std::runtime_error
+   *  If locking fails.
+   */
+  explicit exclusive_file_lock(int file_descriptor)
+      : file_descriptor{file_descriptor} {
+    while (-1 == ::flock(file_descriptor, LOCK_EX)) {
+      throw_if(errno != EINTR);
+    }
+  }
+
+  exclusive_file_lock(exclusive_file_lock const&) = delete;
+  exclusive_file_lock& operator=(exclusive_file_lock const&) = delete;
+
+  /** \brief Releases the lock. */
+  ~exclusive_file_lock() { ::flock(file_descriptor, LOCK_UN); }
+
+private:
+  /** \brief The locked file. Not owned. */
+  int const file_descriptor;
+};
+
+/** \brief Holds a shared `flock` on a file while in scope.
+ *
+ *  Shared locks exclude \ref exclusive_file_lock but not each other,
+ *  with the same per open file description caveat.
+ */
+class shared_file_lock {
+public:
+  /** \brief Waits until no exclusive lock is held.
+   *
+   *  \exception std::runtime_error
+   *  If locking fails.
+   */
+  explicit shared_file_lock(int file_descriptor)
+      : file_descriptor{file_descriptor} {
+    while (-1 == ::flock(file_descriptor, LOCK_SH)) {
+      throw_if(errno != EINTR);
+    }
+  }
+
+  shared_file_lock(shared_file_lock const&) = delete;
+  shared_file_lock& operator=(shared_file_lock const&) = delete;
+
+  /** \brief Releases the lock. */
+  ~shared_file_lock() { ::flock(file_descriptor, LOCK_UN); }
+
+private:
+  /** \brief The locked file. Not owned. */
+  int const file_descriptor;
+};
+
+/** \brief Creates a Unix domain stream socket listening at `path`.
+ *
+ *  An existing file at `path` is removed first,
+ *  as is usual for sockets left behind by a previous run.
+ *
+ *  \exception std::runtime_error
+ *  If the path is too long or the socket cannot be set up.
+ */
+inline file_descriptor listen_on_unix_socket(std::string const& path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error("Unix socket path too long");
+  }
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1u);
+  auto const socket_descriptor = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  throw_if(socket_descriptor == -1);
+  file_descriptor listening{socket_descriptor};
+  ::unlink(path.c_str());
+  throw_if(
+      0 != ::bind(
+               listening, reinterpret_cast<sockaddr const*>(&address),
+               sizeof(address)));
+  throw_if(0 != ::listen(listening, SOMAXCONN));
+  return listening;
+}
+
+/** \brief Waits for and accepts a connection on `listening`.
+ *
+ *  \exception std::runtime_error
+ *  If accepting fails.
+ */
+inline file_descriptor accept_connection(int listening) {
+  for (;;) {
+    auto const connection = ::accept(listening, nullptr, nullptr);
+    if (connection == -1 && errno == EINTR) {
+      continue;
+    }
+    throw_if(connection == -1);
+    return file_descriptor{connection};
+  }
+}
+
+/** \brief Waits up to `timeout` for `file_descriptor` to be readable.
+ *
+ *  For a listening socket,
+ *  readable means a connection is waiting to be accepted.
+ *
+ *  \return Whether it is readable.
+ *  Being interrupted by a signal counts as not readable.
+ *  \exception std::runtime_error
+ *  If polling fails otherwise.
+ */
+inline bool wait_until_readable(
+    int file_descriptor, std::chrono::milliseconds timeout) {
+  pollfd polled{};
+  polled.fd = file_descriptor;
+  polled.events = POLLIN;
+  auto const ready =
+      ::poll(&polled, 1u, static_cast<int>(timeout.count()));
+  if (ready == -1 && errno == EINTR) {
+    return false;
+  }
+  throw_if(ready == -1);
+  return ready == 1;
+}
+
+/** \brief Waits until `file_descriptor` or `interrupt` is readable.
+ *
+ *  A hung-up `file_descriptor` counts as readable,
+ *  since reading it then gives end of file.
+ *
+ *  \return Whether `interrupt` is readable,
+ *  with `file_descriptor` possibly readable too.
+ *  \exception std::runtime_error
+ *  If polling fails.
+ */
+inline bool wait_until_readable_or(int file_descriptor, int interrupt) {
+  pollfd polled[2]{};
+  polled[0].fd = file_descriptor;
+  polled[0].events = POLLIN;
+  polled[1].fd = interrupt;
+  polled[1].events = POLLIN;
+  for (;;) {
+    auto const ready = ::poll(polled, 2u, -1);
+    if (ready == -1 && errno == EINTR) {
+      continue;
+    }
+    throw_if(ready == -1);
+    return (polled[1].revents & POLLIN) != 0;
+  }
+}
+
+/** \brief Calls `read` once, retrying on `EINTR`.
+ *
+ *  \return The number of bytes read, `0` at end of file.
+ *  \exception std::runtime_error
+ *  If reading fails.
+ */
+inline std::size_t
+read_some(int file_descriptor, void* data, std::size_t size) {
+  for (;;) {
+    auto const read = ::read(file_descriptor, data, size);
+    if (read == -1 && errno == EINTR) {
+      continue;
+    }
+    throw_if(read == -1);
+    return static_cast<std::size_t>(read);
+  }
+}
+
+/** \brief Creates a socket of `socket_type` connected to `host`.
+ *
+ *  The first address `host` resolves to with `port` is used.
+ *
+ *  \exception std::runtime_error
+ *  If the host cannot be resolved or the socket cannot be set up.
+ */
+inline file_descriptor connect_socket(
+    std::string const& host, std::string const& port, int socket_type) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = socket_type;
+  addrinfo* addresses = nullptr;
+  auto const status =
+      ::getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+  if (status != 0) {
+    std::fprintf(stderr, "%s\n", ::gai_strerror(status));
+    throw std::runtime_error("Unable to resolve " + host);
+  }
+  std::unique_ptr<addrinfo, decltype(&::freeaddrinfo)> owned_addresses{
+      addresses, ::freeaddrinfo};
+  auto const socket_descriptor = ::socket(
+      addresses->ai_family, addresses->ai_socktype,
+      addresses->ai_protocol);
+  throw_if(socket_descriptor == -1);
+  file_descriptor connected{socket_descriptor};
+  throw_if(
+      0 != ::connect(
+               connected, addresses->ai_addr, addresses->ai_addrlen));
+  return connected;
+}
+
+/** \brief Creates a UDP socket connected to `host` and `port`.
+ *
+ *  \exception std::runtime_error
+ *  As for \ref connect_socket.
+ */
+inline file_descriptor
+connect_udp_socket(std::string const& host, std::string const& port) {
+  return connect_socket(host, port, SOCK_DGRAM);
+}
+
+/** \brief Creates a TCP socket connected to `host` and `port`.
+ *
+ *  The socket is blocking.
+ *
+ *  \exception std::runtime_error
+ *  As for \ref connect_socket, including if nothing listens there.
+ */
+inline file_descriptor
+connect_tcp_socket(std::string const& host, std::string const& port) {
+  return connect_socket(host, port, SOCK_STREAM);
+}
+
+/** \brief Creates a TCP socket listening on `host` and `port`.
+ *
+ *  An empty `host` listens on all addresses.
+ *  The socket is non-blocking, for use with \ref make_epoll,
+ *  and the address is reusable at once after a restart.
+ *
+ *  \exception std::runtime_error
+ *  If the address cannot be resolved or the socket cannot be set up.
+ */
+inline file_descriptor
+listen_on_tcp_port(std::string const& host, std::string const& port) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo* addresses = nullptr;
+  auto const status = ::getaddrinfo(
+      host.empty() ? nullptr : host.c_str(), port.c_str(), &hints,
+      &addresses);
+  if (status != 0) {
+    std::fprintf(stderr, "%s\n", ::gai_strerror(status));
+    throw std::runtime_error("Unable to resolve " + host);
+  }
+  std::unique_ptr<addrinfo, decltype(&::freeaddrinfo)> owned_addresses{
+      addresses, ::freeaddrinfo};
+  auto const socket_descriptor = ::socket(
+      addresses->ai_family, addresses->ai_socktype | SOCK_NONBLOCK,
+      addresses->ai_protocol);
+  throw_if(socket_descriptor == -1);
+  file_descriptor listening{socket_descriptor};
+  int const is_reusing = 1;
+  throw_if(
+      0 != ::setsockopt(
+               listening, SOL_SOCKET, SO_REUSEADDR, &is_reusing,
+               sizeof(is_reusing)));
+  throw_if(
+      0 != ::bind(
+               listening, addresses->ai_addr, addresses->ai_addrlen));
+  throw_if(0 != ::listen(listening, SOMAXCONN));
+  return listening;
+}
+
+/** \brief Calls `epoll_create1`.
+ *
+ *  \exception std::runtime_error
+ *  If the instance cannot be created.
+ */
+inline file_descriptor make_epoll() {
+  auto const instance = ::epoll_create1(EPOLL_CLOEXEC);
+  throw_if(instance == -1);
+  return file_descriptor{instance};
+}
+
+/** \brief Restricts the calling thread to `cpu`.
+ *
+ *  \return Whether the affinity was set.
+ *  Unlike most functions here, failure is not thrown nor written,
+ *  so that this can be called from an audio callback.
+ *  Threads and processes started afterwards inherit the affinity.
+ */
+inline bool pin_to_cpu(int cpu) {
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    return false;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  return 0 == ::sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+/** \brief Gives the calling thread `SCHED_FIFO` at `priority`.
+ *
+ *  \return Whether the policy was set,
+ *  which usually needs `CAP_SYS_NICE` or an `RLIMIT_RTPRIO` limit.
+ *  As for \ref pin_to_cpu, failure is not thrown nor written.
+ */
+inline bool set_fifo_priority(int priority) {
+  sched_param parameters{};
+  parameters.sched_priority = priority;
+  return 0 == ::pthread_setschedparam(
+                   ::pthread_self(), SCHED_FIFO, &parameters);
+}
+
+/** \brief Calls `mlock`, keeping the pages of `data` in memory.
+ *
+ *  \return Whether they were locked,
+ *  which fails beyond the `RLIMIT_MEMLOCK` limit when unprivileged.
+ *  As for \ref pin_to_cpu, failure is not thrown nor written.
+ */
+inline bool lock_in_memory(void const* data, std::size_t size) {
+  return 0 == ::mlock(data, size);
+}
+
+/** \brief Calls `munlock`, undoing \ref lock_in_memory. */
+inline void unlock_from_memory(void const* data, std::size_t size) {
+  ::munlock(data, size);
+}
+
+} // namespace posix
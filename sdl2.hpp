@@ -2,16 +2,33 @@
 
 // Local dependencies.
 #include "boni.hpp"
+#include "instrumentation.hpp"
+#include "posix.hpp"
 
 // External dependencies.
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_audio.h>
+#include <SDL2/SDL_mutex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 // Standard C++ libraries.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
 
 // Standard C libraries.
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 
@@ -94,6 +111,39 @@ public:
   ~service() { SDL_Quit(); }
 };
 
+/** \brief Provides RAII for one SDL2 subsystem.
+ *
+ *  Unlike \ref service, this can be started long after SDL2,
+ *  or without it, and only stops its own subsystems,
+ *  so that a program can start, say, audio only once it is needed.
+ *  SDL2 counts the users of each subsystem,
+ *  so several of these can be alive at once.
+ */
+class subsystem {
+public:
+  /** \brief Calls `SDL_InitSubSystem` with `subsystem_flags`.
+   *
+   *  If `SDL_MAIN_HANDLED` is defined when this header is included,
+   *  calls `SDL_SetMainReady` first.
+   */
+  explicit subsystem(Uint32 subsystem_flags)
+      : subsystem_flags{subsystem_flags} {
+#ifdef SDL_MAIN_HANDLED
+    SDL_SetMainReady();
+#endif
+    throw_if(0 != SDL_InitSubSystem(subsystem_flags));
+  }
+
+  subsystem(subsystem const&) = delete;
+  subsystem& operator=(subsystem const&) = delete;
+
+  /** \brief Calls `SDL_QuitSubSystem`. */
+  ~subsystem() { SDL_QuitSubSystem(subsystem_flags); }
+
+private:
+  Uint32 const subsystem_flags;
+};
+
 /** \brief Callable taking an audio device ID and closes the device.
  *
  *  This is an implementation detail
@@ -108,4 +158,909 @@ using audio_device_deleter =
  */
 using audio_device = boni::auto_handle<audio_device_deleter>;
 
+/** \brief Callable taking a semaphore and destroying it.
+ *
+ *  This is an implementation detail
+ *  for making RAII for `sdl2::semaphore`.
+ */
+using semaphore_deleter =
+    boni::handle_deleter<SDL_sem*, SDL_DestroySemaphore>;
+
+/** \brief Represents SDL semaphores.
+ *
+ *  Destroys the managed semaphore when going out of scope.
+ */
+using semaphore = boni::auto_handle<semaphore_deleter>;
+
+/** \brief Audio device fed from a lock-free ring buffer.
+ *
+ *  The device is opened with an `SDL_AudioSpec::callback`
+ *  that drains \ref buffer,
+ *  instead of having samples pushed with `SDL_QueueAudio`.
+ *  Pushing takes the audio lock of SDL and copies into its own queue,
+ *  so every push from a producer can stall on the audio thread,
+ *  and vice versa.
+ *  Here, a producer only ever touches the ring buffer.
+ *
+ *  Only signed 16-bit native-endian samples are supported,
+ *  since that is what eSpeak NG produces.
+ *  If the buffer runs dry, the rest of the device period is silenced.
+ *  Running dry only counts as an underrun
+ *  between the first \ref push and the end of a \ref drain.
+ *
+ *  The device may be allowed to choose its own period,
+ *  as `SDL_AudioSpec::samples`,
+ *  in which case the ring buffer is sized from the period obtained.
+ *  The time from a \ref push after silence
+ *  to the audio thread taking the samples is measured,
+ *  as part of the latency until they are heard.
+ *  The jitter of the callbacks and the silence of each underrun
+ *  are recorded in the `instrumentation` metrics of the audio thread.
+ *  The audio thread can be given real-time scheduling,
+ *  see \ref request_realtime.
+ *
+ *  ```cpp
+ *  SDL_AudioSpec required_audio_spec;
+ *  SDL_zero(required_audio_spec);
+ *  required_audio_spec.freq = 22050;
+ *  required_audio_spec.format = AUDIO_S16SYS;
+ *  required_audio_spec.channels = 1u;
+ *  required_audio_spec.samples = 4096u;
+ *  sdl2::buffered_audio_device playback{required_audio_spec, 1u << 16};
+ *  SDL_PauseAudioDevice(playback.device, 0);
+ *  playback.push(samples, sample_count);
+ *  // Returns once the samples have been played.
+ *  playback.drain().wait();
+ *  ```
+ */
+class buffered_audio_device {
+public:
+  /** \brief The type of samples accepted. */
+  using sample_type = Sint16;
+
+  /** \brief Opens the default audio device.
+   *
+   *  \param required_audio_spec
+   *  The specification to request.
+   *  Its `callback` and `userdata` are overwritten.
+   *  \param buffer_capacity
+   *  Minimum number of samples the ring buffer can hold.
+   *  \param allowed_changes
+   *  As for `SDL_OpenAudioDevice`.
+   *  Only `SDL_AUDIO_ALLOW_SAMPLES_CHANGE` is supported,
+   *  since samples are pushed in the format and rate required.
+   *  \param buffer_periods
+   *  Minimum number of device periods the ring buffer can hold.
+   *  \exception std::runtime_error
+   *  If the device cannot be opened.
+   *
+   *  The device starts paused, as with `SDL_OpenAudioDevice`.
+   *  The audio subsystem must have been started.
+   */
+  buffered_audio_device(
+      SDL_AudioSpec required_audio_spec, std::size_t buffer_capacity,
+      int allowed_changes = 0, std::size_t buffer_periods = 0u)
+      : buffered_audio_device{
+            open(required_audio_spec, allowed_changes, this),
+            buffer_capacity, buffer_periods} {}
+
+  // The audio thread refers to `this`.
+  buffered_audio_device(buffered_audio_device const&) = delete;
+  buffered_audio_device&
+  operator=(buffered_audio_device const&) = delete;
+
+  /** \brief Closes the device, then unlocks the memory locked by
+   *  \ref request_realtime.
+   *
+   *  Samples never played stop counting as buffered.
+   */
+  ~buffered_audio_device() {
+    // Members declared after `device` are destroyed before it,
+    // and `fill` uses them, so the callback is stopped first.
+    // Closing waits for the audio thread to leave `fill`.
+    device.reset();
+    // The audio thread is gone, so this can take its place
+    // as the consumer.
+    release_buffered(buffer.discard());
+    if (is_memory_locked) {
+      posix::unlock_from_memory(this, sizeof(*this));
+      posix::unlock_from_memory(
+          buffer.data(), buffer.capacity() * sizeof(sample_type));
+    }
+  }
+
+  /** \brief How the audio thread is to be scheduled. */
+  struct realtime_settings {
+    /** \brief `SCHED_FIFO` priority, from `1` to `99`. */
+    int priority{10};
+    /** \brief CPU to pin the audio thread to, or `-1` for any. */
+    int cpu{-1};
+  };
+
+  /** \brief What \ref request_realtime obtained so far. */
+  struct realtime_status {
+    /** \brief Whether the audio thread has acted on the request. */
+    bool is_applied;
+    /** \brief Whether `SCHED_FIFO` was set directly. */
+    bool is_fifo;
+    /** \brief Whether real-time scheduling was given by RealtimeKit. */
+    bool is_rtkit;
+    /** \brief Whether the audio thread was pinned to its CPU. */
+    bool is_pinned;
+    /** \brief Whether what the callback touches is locked in memory. */
+    bool is_memory_locked;
+  };
+
+  /** \brief Asks for the audio thread to be scheduled in real time.
+   *
+   *  \par Purpose
+   *  Synthesis keeping every core busy can hold the audio thread
+   *  back past the end of a period, which is heard as an underrun.
+   *  Here, the audio thread, which is what feeds the device,
+   *  moves itself to `SCHED_FIFO` on its next callback,
+   *  or asks RealtimeKit through SDL2 where it may not do so itself,
+   *  and pins itself to `settings.cpu` if given,
+   *  so that other work can be kept off that CPU.
+   *  The ring buffer and this object,
+   *  being most of what the callback touches,
+   *  are locked in memory first,
+   *  so that the callback does not wait on page faults.
+   *
+   *  Each step is only attempted, since they need privileges
+   *  or limits the user may not have,
+   *  and playback works the same without them.
+   *  See \ref get_realtime_status for what was obtained.
+   *  Asking again with the same settings does nothing.
+   *  Must only be called from the thread calling \ref push.
+   */
+  void request_realtime(realtime_settings settings) {
+    if (is_realtime_requested &&
+        settings.priority == requested_realtime.priority &&
+        settings.cpu == requested_realtime.cpu) {
+      return;
+    }
+    is_realtime_requested = true;
+    requested_realtime = settings;
+    if (!is_memory_locked) {
+      lock_memory();
+    }
+    realtime_priority.store(
+        settings.priority, std::memory_order_relaxed);
+    realtime_cpu.store(settings.cpu, std::memory_order_relaxed);
+    realtime_flags.fetch_and(
+        memory_locked_flag, std::memory_order_relaxed);
+    is_realtime_pending.store(true, std::memory_order_release);
+  }
+
+  /** \brief What the last \ref request_realtime obtained so far. */
+  realtime_status get_realtime_status() const {
+    auto const flags = realtime_flags.load(std::memory_order_acquire);
+    return realtime_status{
+        (flags & applied_flag) != 0u, (flags & fifo_flag) != 0u,
+        (flags & rtkit_flag) != 0u, (flags & pinned_flag) != 0u,
+        (flags & memory_locked_flag) != 0u};
+  }
+
+  /** \brief Copies all the given samples into \ref buffer.
+   *
+   *  If the buffer is full,
+   *  blocks until the audio thread has taken some samples,
+   *  without polling.
+   *  The device must therefore be unpaused
+   *  if more than a buffer worth of samples is pushed.
+   *  Must only be called from one thread at a time.
+   *
+   *  A \ref drain in progress ends,
+   *  and its future becomes ready without waiting for playback.
+   */
+  void push(sample_type const* samples, std::size_t sample_count) {
+    abandon_drain();
+    if (!playing.load(std::memory_order_acquire)) {
+      start_time_ns.store(now_ns(), std::memory_order_relaxed);
+    }
+    playing.store(true, std::memory_order_release);
+    for (;;) {
+      auto const written = buffer.write(samples, sample_count);
+      instrumentation::global_registry().buffered_pcm_bytes.add(
+          written * sizeof(sample_type));
+      samples += written;
+      sample_count -= written;
+      if (sample_count == 0u) {
+        return;
+      }
+      wait_for_room();
+    }
+  }
+
+  /** \brief Returns a future that is ready when playback has finished.
+   *
+   *  That is, when every sample pushed so far has been
+   *  handed to the device
+   *  and the device has asked for another period after that,
+   *  meaning the period containing the last sample has been played.
+   *  If nothing has been pushed, the future is ready immediately.
+   *  Pushing more samples ends the drain early instead.
+   *  Called again during a drain, it returns the same future.
+   *
+   *  The device must be unpaused for the future to become ready.
+   */
+  std::shared_future<void> drain() {
+    if (draining.load(std::memory_order_acquire)) {
+      return last_drain;
+    }
+    if (last_drain.valid()) {
+      // The audio thread may still be fulfilling it.
+      last_drain.wait();
+    }
+    drained = std::promise<void>{};
+    last_drain = drained.get_future().share();
+    if (!playing.load(std::memory_order_acquire)) {
+      drained.set_value();
+    } else {
+      draining.store(true, std::memory_order_release);
+    }
+    return last_drain;
+  }
+
+  /** \brief Returns a future that is ready once playback has stopped.
+   *
+   *  The audio thread drops every sample pushed so far
+   *  and plays silence from its next period on,
+   *  so the future is ready at most one period after the call.
+   *  The period already handed to the device still plays.
+   *
+   *  The same restrictions as for \ref drain apply,
+   *  and a drain in progress ends as for \ref push.
+   */
+  std::future<void> discard() {
+    assert(!discarding.load(std::memory_order_relaxed));
+    abandon_drain();
+    discarded = std::promise<void>{};
+    auto result = discarded.get_future();
+    if (!playing.load(std::memory_order_acquire)) {
+      discarded.set_value();
+    } else {
+      discarding.store(true, std::memory_order_release);
+    }
+    return result;
+  }
+
+  /** \brief Duration of one device period, as obtained. */
+  std::chrono::nanoseconds period() const {
+    return std::chrono::nanoseconds{
+        std::int64_t{obtained_audio_spec.samples} * 1000000000 /
+        obtained_audio_spec.freq};
+  }
+
+  /** \brief Number of times the buffer ran dry while playing. */
+  std::uint64_t underruns() const { return buffer.underruns(); }
+
+  /** \brief Samples of silence played in place of late samples. */
+  std::uint64_t late_samples() const {
+    return late_sample_count.load(std::memory_order_relaxed);
+  }
+
+  /** \brief Number of times playback started after silence. */
+  std::uint64_t starts() const {
+    return start_count.load(std::memory_order_relaxed);
+  }
+
+  /** \brief Longest time from a start to the samples being taken.
+   *
+   *  The samples are heard about a \ref period later,
+   *  plus whatever latency the system adds after SDL.
+   */
+  std::chrono::nanoseconds max_start_latency() const {
+    return std::chrono::nanoseconds{
+        max_start_latency_ns.load(std::memory_order_relaxed)};
+  }
+
+  /** \brief Mean time from a start to the samples being taken. */
+  std::chrono::nanoseconds mean_start_latency() const {
+    auto const count = starts();
+    return std::chrono::nanoseconds{
+        count == 0u ? 0u
+                    : total_start_latency_ns.load(
+                          std::memory_order_relaxed) /
+                          count};
+  }
+
+  /** \brief The specification SDL2 opened the device with. */
+  SDL_AudioSpec const obtained_audio_spec;
+
+  /** \brief Samples waiting to be played. */
+  boni::spsc_ring_buffer<sample_type> buffer;
+
+  /** \brief The opened device.
+   *
+   *  It is closed, and its callback stopped, first thing
+   *  in the destructor, before any state the callback uses is gone.
+   */
+  audio_device device;
+
+private:
+  /** \brief A device opened but not yet given its ring buffer. */
+  struct opened_device {
+    audio_device device;
+    SDL_AudioSpec obtained_audio_spec;
+  };
+
+  /** \brief Opens a paused device calling back with `self`. */
+  static opened_device open(
+      SDL_AudioSpec required_audio_spec, int allowed_changes,
+      buffered_audio_device* self) {
+    assert(required_audio_spec.format == AUDIO_S16SYS);
+    assert((allowed_changes & ~SDL_AUDIO_ALLOW_SAMPLES_CHANGE) == 0);
+    required_audio_spec.callback = fill;
+    required_audio_spec.userdata = self;
+    opened_device result;
+    SDL_zero(result.obtained_audio_spec);
+    result.device = audio_device{SDL_OpenAudioDevice(
+        nullptr, 0, &required_audio_spec, &result.obtained_audio_spec,
+        allowed_changes)};
+    throw_if(nullptr == result.device.get());
+    return result;
+  }
+
+  /** \brief Takes over `opened`, which stays paused until then. */
+  buffered_audio_device(
+      opened_device opened, std::size_t buffer_capacity,
+      std::size_t buffer_periods)
+      : obtained_audio_spec{opened.obtained_audio_spec},
+        buffer{std::max(
+            buffer_capacity,
+            buffer_periods * opened.obtained_audio_spec.samples)},
+        device{std::move(opened.device)},
+        room{SDL_CreateSemaphore(0u)} {
+    throw_if(nullptr == room.get());
+  }
+
+  static std::uint64_t now_ns() {
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+  }
+
+  /** \brief Time of the first \ref push since silence, or `0`. */
+  std::atomic<std::uint64_t> start_time_ns{0u};
+  std::atomic<std::uint64_t> start_count{0u};
+  std::atomic<std::uint64_t> total_start_latency_ns{0u};
+  std::atomic<std::uint64_t> max_start_latency_ns{0u};
+
+  std::atomic<std::uint64_t> late_sample_count{0u};
+
+  /** \brief Posted by the audio thread after taking samples,
+   *  if \ref is_waiting_for_room is set.
+   */
+  semaphore room;
+  /** \brief Whether the producer may be waiting on \ref room. */
+  std::atomic<bool> is_waiting_for_room{false};
+
+  /** \brief Whether samples have been pushed since the last drain. */
+  std::atomic<bool> playing{false};
+  /** \brief Whether \ref drained is waiting to be fulfilled.
+   *
+   *  Whichever thread clears it fulfils \ref drained.
+   */
+  std::atomic<bool> draining{false};
+  /** \brief Fulfilled by the audio thread once draining is done,
+   *  or by the producer ending it early.
+   */
+  std::promise<void> drained;
+  /** \brief The future of \ref drained, if any. */
+  std::shared_future<void> last_drain;
+  /** \brief Whether \ref discarded is waiting to be fulfilled. */
+  std::atomic<bool> discarding{false};
+  /** \brief Fulfilled by the audio thread once samples are dropped. */
+  std::promise<void> discarded;
+
+  /** \brief Bits of \ref realtime_flags, for \ref realtime_status. */
+  static constexpr unsigned applied_flag = 1u;
+  static constexpr unsigned fifo_flag = 2u;
+  static constexpr unsigned rtkit_flag = 4u;
+  static constexpr unsigned pinned_flag = 8u;
+  static constexpr unsigned memory_locked_flag = 16u;
+
+  /** \brief Settings of the last \ref request_realtime.
+   *
+   *  These are only accessed by the producer.
+   */
+  realtime_settings requested_realtime;
+  bool is_realtime_requested{false};
+  bool is_memory_locked{false};
+  /** \brief Copies of \ref requested_realtime for the audio thread. */
+  std::atomic<int> realtime_priority{0};
+  std::atomic<int> realtime_cpu{-1};
+  /** \brief Whether the audio thread has yet to act on a request. */
+  std::atomic<bool> is_realtime_pending{false};
+  /** \brief What was obtained, as a combination of the flags. */
+  std::atomic<unsigned> realtime_flags{0u};
+  /** \brief Time of the previous callback while playing, or `0`.
+   *
+   *  Only accessed by the audio thread.
+   */
+  std::uint64_t last_fill_ns{0u};
+
+  /** \brief `SDL_AudioCallback` draining \ref buffer into `stream`. */
+  static void fill(void* userdata, Uint8* stream, int length) {
+    auto& self = *static_cast<buffered_audio_device*>(userdata);
+    auto const samples = reinterpret_cast<sample_type*>(stream);
+    auto const sample_count =
+        static_cast<std::size_t>(length) / sizeof(sample_type);
+    if (self.is_realtime_pending.load(std::memory_order_acquire)) {
+      self.apply_realtime();
+    }
+    auto& metrics = instrumentation::local_metrics();
+    self.record_jitter(metrics, sample_count);
+    if (self.discarding.load(std::memory_order_acquire)) {
+      self.release_buffered(self.buffer.discard());
+      self.wake_producer();
+      std::fill(samples, samples + sample_count, sample_type{0});
+      self.playing.store(false, std::memory_order_relaxed);
+      self.discarding.store(false, std::memory_order_relaxed);
+      self.discarded.set_value();
+      return;
+    }
+    if (!self.playing.load(std::memory_order_acquire)) {
+      std::fill(samples, samples + sample_count, sample_type{0});
+      return;
+    }
+    auto const is_draining =
+        self.draining.load(std::memory_order_acquire);
+    // When draining, the buffer emptying is expected.
+    // Do not count it as an underrun.
+    auto const read = self.buffer.read(
+        samples, is_draining
+                     ? std::min(sample_count, self.buffer.size())
+                     : sample_count);
+    std::fill(samples + read, samples + sample_count, sample_type{0});
+    self.release_buffered(read);
+    if (read > 0u) {
+      self.wake_producer();
+    }
+    if (read < sample_count && !is_draining) {
+      metrics.underrun_samples.record(sample_count - read);
+      self.late_sample_count.fetch_add(
+          sample_count - read, std::memory_order_relaxed);
+    }
+    if (read > 0u) {
+      self.record_start();
+    }
+    if (is_draining && read == 0u) {
+      // The previous period, with the last samples if any,
+      // has been played for SDL to ask for this one.
+      // Stop playing first, so that a push ending the drain
+      // after this is not undone.
+      self.playing.store(false, std::memory_order_relaxed);
+      auto expected = true;
+      if (self.draining.compare_exchange_strong(
+              expected, false, std::memory_order_acq_rel)) {
+        self.drained.set_value();
+      } else {
+        // A push ended the drain first, and is playing.
+        self.playing.store(true, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /** \brief Blocks until the audio thread takes samples, if needed.
+   *
+   *  Must only be called from the producer.
+   */
+  void wait_for_room() {
+    is_waiting_for_room.store(true, std::memory_order_relaxed);
+    // Either the room made is seen here,
+    // or the audio thread sees the flag after making it.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (buffer.size() < buffer.capacity()) {
+      return;
+    }
+    SDL_SemWait(room);
+  }
+
+  /** \brief Wakes a producer in \ref wait_for_room, if any.
+   *
+   *  Must only be called from the audio thread,
+   *  after taking samples from \ref buffer.
+   *  A stale flag only makes a later wait return early.
+   */
+  void wake_producer() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (is_waiting_for_room.exchange(
+            false, std::memory_order_relaxed)) {
+      // This does not block, unlike signalling a condition variable,
+      // which needs its mutex.
+      SDL_SemPost(room);
+    }
+  }
+
+  /** \brief Stops counting `sample_count` samples as buffered. */
+  static void release_buffered(std::size_t sample_count) {
+    if (sample_count > 0u) {
+      instrumentation::global_registry().buffered_pcm_bytes.subtract(
+          sample_count * sizeof(sample_type));
+    }
+  }
+
+  /** \brief Locks this and the ring buffer storage, or neither. */
+  void lock_memory() {
+    auto const* const storage = buffer.data();
+    auto const storage_size = buffer.capacity() * sizeof(sample_type);
+    if (!posix::lock_in_memory(this, sizeof(*this))) {
+      return;
+    }
+    if (!posix::lock_in_memory(storage, storage_size)) {
+      posix::unlock_from_memory(this, sizeof(*this));
+      return;
+    }
+    is_memory_locked = true;
+    realtime_flags.fetch_or(
+        memory_locked_flag, std::memory_order_relaxed);
+  }
+
+  /** \brief Acts on \ref request_realtime, on the audio thread. */
+  void apply_realtime() {
+    is_realtime_pending.store(false, std::memory_order_relaxed);
+    auto const priority =
+        realtime_priority.load(std::memory_order_relaxed);
+    auto const cpu = realtime_cpu.load(std::memory_order_relaxed);
+    auto flags = applied_flag;
+    if (cpu >= 0 && posix::pin_to_cpu(cpu)) {
+      flags |= pinned_flag;
+    }
+    if (posix::set_fifo_priority(priority)) {
+      flags |= fifo_flag;
+    }
+#if defined(__linux__) && SDL_VERSION_ATLEAST(2, 0, 18)
+    // RealtimeKit picks the priority, within the limit it allows.
+    else if (
+        0 == SDL_LinuxSetThreadPriorityAndPolicy(
+                 static_cast<Sint64>(::syscall(SYS_gettid)),
+                 SDL_THREAD_PRIORITY_TIME_CRITICAL, SCHED_FIFO)) {
+      flags |= rtkit_flag;
+    }
+#endif
+    realtime_flags.fetch_or(flags, std::memory_order_release);
+  }
+
+  /** \brief Records how late or early this callback is.
+   *
+   *  Only callbacks while playing are compared,
+   *  since a paused device is not called back at all.
+   */
+  void record_jitter(
+      instrumentation::thread_metrics& metrics,
+      std::size_t sample_count) {
+    if (!playing.load(std::memory_order_relaxed)) {
+      last_fill_ns = 0u;
+      return;
+    }
+    auto const now = now_ns();
+    if (last_fill_ns != 0u) {
+      auto const interval = now - last_fill_ns;
+      auto const expected = static_cast<std::uint64_t>(
+          sample_count * std::uint64_t{1000000000} /
+          static_cast<std::uint64_t>(obtained_audio_spec.freq));
+      metrics.device_jitter_ns.record(
+          interval > expected ? interval - expected
+                              : expected - interval);
+    }
+    last_fill_ns = now;
+  }
+
+  /** \brief Ends a drain in progress, from the producer side. */
+  void abandon_drain() {
+    auto expected = true;
+    if (draining.compare_exchange_strong(
+            expected, false, std::memory_order_acq_rel)) {
+      drained.set_value();
+    }
+  }
+
+  /** \brief Measures the latency of a start, if one is pending. */
+  void record_start() {
+    auto const start_ns =
+        start_time_ns.exchange(0u, std::memory_order_relaxed);
+    if (start_ns == 0u) {
+      return;
+    }
+    auto const latency_ns = now_ns() - start_ns;
+    start_count.fetch_add(1u, std::memory_order_relaxed);
+    total_start_latency_ns.fetch_add(
+        latency_ns, std::memory_order_relaxed);
+    if (latency_ns >
+        max_start_latency_ns.load(std::memory_order_relaxed)) {
+      // Only the audio thread writes the maximum.
+      max_start_latency_ns.store(
+          latency_ns, std::memory_order_relaxed);
+    }
+  }
+};
+
+/** \brief Keeps \ref buffered_audio_device instances open for reuse.
+ *
+ *  \par Purpose
+ *  Starting the audio subsystem and opening a device
+ *  takes tens of milliseconds and connects to the sound server.
+ *  A program that may never play anything should not pay for that
+ *  up front, and one that plays now and then should not pay for it
+ *  on every utterance, nor keep the device running when idle.
+ *  This starts the audio subsystem with the first device opened,
+ *  and stops it again once the last device is closed.
+ *
+ *  \par Leases
+ *  \ref acquire lends out a device opened with the given settings,
+ *  reusing a released one if one matches.
+ *  Destroying the \ref lease releases the device back to the pool,
+ *  which drains it and keeps it open, still unpaused,
+ *  since a device that has drained only plays silence.
+ *  A background thread closes released devices
+ *  once they have drained and not been reused for `idle_timeout`.
+ *  At most `max_idle_count` released devices are kept.
+ *
+ *  \par Usage
+ *  Leases must not outlive the pool.
+ *  ```cpp
+ *  sdl2::device_pool pool{std::chrono::seconds{30}};
+ *  {
+ *    // Opens the audio subsystem and a device.
+ *    auto playback = pool.acquire(required_audio_spec, 1u << 16);
+ *    SDL_PauseAudioDevice(playback->device, 0);
+ *    playback->push(samples, sample_count);
+ *  }
+ *  // Reuses the same device, even if it is still playing.
+ *  auto playback = pool.acquire(required_audio_spec, 1u << 16);
+ *  ```
+ */
+class device_pool {
+public:
+  /** \brief Settings a device was acquired with. */
+  struct settings {
+    SDL_AudioSpec required_audio_spec;
+    std::size_t buffer_capacity;
+    int allowed_changes;
+    std::size_t buffer_periods;
+
+    /** \brief Whether a device opened for `other` suits these. */
+    bool matches(settings const& other) const {
+      auto const& spec = required_audio_spec;
+      auto const& other_spec = other.required_audio_spec;
+      return spec.freq == other_spec.freq &&
+             spec.format == other_spec.format &&
+             spec.channels == other_spec.channels &&
+             spec.samples == other_spec.samples &&
+             buffer_capacity == other.buffer_capacity &&
+             allowed_changes == other.allowed_changes &&
+             buffer_periods == other.buffer_periods;
+    }
+  };
+
+  /** \brief Releases a device back to its pool when destroyed. */
+  class releaser {
+  public:
+    releaser() = default;
+    releaser(device_pool& pool, settings const& opened_with)
+        : pool{&pool}, opened_with{opened_with} {}
+
+    void operator()(buffered_audio_device* device) const {
+      pool->release(opened_with, device);
+    }
+
+  private:
+    device_pool* pool{nullptr};
+    settings opened_with{};
+  };
+
+  /** \brief A device lent out by \ref acquire. */
+  using lease = std::unique_ptr<buffered_audio_device, releaser>;
+
+  /** \brief Starts the thread closing idle devices. */
+  explicit device_pool(
+      std::chrono::milliseconds idle_timeout,
+      std::size_t max_idle_count = 2u)
+      : idle_timeout{idle_timeout}, max_idle_count{max_idle_count},
+        closer{[this] { close_idle_devices(); }} {}
+
+  device_pool(device_pool const&) = delete;
+  device_pool& operator=(device_pool const&) = delete;
+
+  /** \brief Closes every released device. */
+  ~device_pool() {
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      is_stopping = true;
+    }
+    changed.notify_one();
+    closer.join();
+    std::lock_guard<std::mutex> lock{mutex};
+    while (!idle.empty()) {
+      close(idle.back().device);
+      idle.pop_back();
+    }
+  }
+
+  /** \brief Lends out a device opened as by the constructor of
+   *  \ref buffered_audio_device.
+   *
+   *  A released device opened with the same arguments is reused,
+   *  as it was left, even if it is still playing.
+   *  Otherwise a new one is opened, paused,
+   *  starting the audio subsystem if no device is open.
+   *
+   *  \exception std::runtime_error
+   *  If the audio subsystem or the device cannot be started.
+   */
+  lease acquire(
+      SDL_AudioSpec const& required_audio_spec,
+      std::size_t buffer_capacity, int allowed_changes = 0,
+      std::size_t buffer_periods = 0u) {
+    settings const wanted{
+        required_audio_spec, buffer_capacity, allowed_changes,
+        buffer_periods};
+    std::lock_guard<std::mutex> lock{mutex};
+    if (auto reused = take_idle(wanted)) {
+      return reused;
+    }
+    if (!audio) {
+      audio.emplace(SDL_INIT_AUDIO);
+    }
+    try {
+      auto const opened = new buffered_audio_device{
+          required_audio_spec, buffer_capacity, allowed_changes,
+          buffer_periods};
+      ++open_count_now;
+      ++open_count;
+      return lease{opened, releaser{*this, wanted}};
+    } catch (...) {
+      stop_audio_if_unused();
+      throw;
+    }
+  }
+
+  /** \brief Lends out a released device as \ref acquire would,
+   *  or returns an empty lease instead of opening one.
+   *
+   *  This lets a user finish, or silence, what it played last
+   *  without opening a device for nothing.
+   */
+  lease reclaim(
+      SDL_AudioSpec const& required_audio_spec,
+      std::size_t buffer_capacity, int allowed_changes = 0,
+      std::size_t buffer_periods = 0u) {
+    std::lock_guard<std::mutex> lock{mutex};
+    return take_idle(settings{
+        required_audio_spec, buffer_capacity, allowed_changes,
+        buffer_periods});
+  }
+
+  /** \brief Number of devices opened so far. */
+  std::uint64_t opens() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return open_count;
+  }
+
+  /** \brief Number of times a released device was lent out again. */
+  std::uint64_t reuses() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return reuse_count;
+  }
+
+  /** \brief Number of devices closed after being idle. */
+  std::uint64_t idle_closes() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return idle_close_count;
+  }
+
+private:
+  /** \brief A released device. */
+  struct idle_device {
+    buffered_audio_device* device;
+    settings opened_with;
+    /** \brief Ready once the device has played everything. */
+    std::shared_future<void> drained;
+    std::chrono::steady_clock::time_point released_at;
+  };
+
+  /** \brief Lends out a released device matching `wanted`, if any.
+   *
+   *  The lock must be held.
+   */
+  lease take_idle(settings const& wanted) {
+    for (auto position = idle.begin(); position != idle.end();
+         ++position) {
+      if (position->opened_with.matches(wanted)) {
+        auto const reused = position->device;
+        idle.erase(position);
+        ++reuse_count;
+        return lease{reused, releaser{*this, wanted}};
+      }
+    }
+    return lease{nullptr, releaser{}};
+  }
+
+  /** \brief Takes back a device from a \ref lease. */
+  void release(
+      settings const& opened_with, buffered_audio_device* device) {
+    auto drained = device->drain();
+    std::unique_lock<std::mutex> lock{mutex};
+    idle.push_back(idle_device{
+        device, opened_with, std::move(drained),
+        std::chrono::steady_clock::now()});
+    if (idle.size() > max_idle_count) {
+      // The oldest is the least likely to be wanted again.
+      close(idle.front().device);
+      idle.erase(idle.begin());
+    }
+    lock.unlock();
+    changed.notify_one();
+  }
+
+  /** \brief Body of \ref closer. */
+  void close_idle_devices() {
+    std::unique_lock<std::mutex> lock{mutex};
+    while (!is_stopping) {
+      if (idle.empty()) {
+        changed.wait(lock);
+        continue;
+      }
+      auto const now = std::chrono::steady_clock::now();
+      auto next_check = now + idle_timeout;
+      for (auto position = idle.begin(); position != idle.end();) {
+        auto const expiry = position->released_at + idle_timeout;
+        auto const is_drained =
+            position->drained.wait_for(std::chrono::seconds{0}) ==
+            std::future_status::ready;
+        if (expiry <= now && is_drained) {
+          close(position->device);
+          position = idle.erase(position);
+          ++idle_close_count;
+          continue;
+        }
+        // A device still playing is looked at again a period later.
+        next_check = std::min(
+            next_check,
+            is_drained ? expiry : now + position->device->period());
+        ++position;
+      }
+      changed.wait_until(lock, next_check);
+    }
+  }
+
+  /** \brief Closes `device`. The lock must be held. */
+  void close(buffered_audio_device* device) {
+    delete device;
+    --open_count_now;
+    stop_audio_if_unused();
+  }
+
+  /** \brief Stops the audio subsystem if no device is open.
+   *
+   *  The lock must be held.
+   */
+  void stop_audio_if_unused() {
+    if (open_count_now == 0u) {
+      audio.reset();
+    }
+  }
+
+  std::chrono::milliseconds const idle_timeout;
+  std::size_t const max_idle_count;
+  /** \brief Guards all other members. */
+  mutable std::mutex mutex;
+  std::condition_variable changed;
+  /** \brief Started with the first device opened. */
+  std::optional<subsystem> audio;
+  /** \brief Released devices, oldest first. */
+  std::vector<idle_device> idle;
+  /** \brief Devices open, lent out or idle. */
+  std::size_t open_count_now{0u};
+  std::uint64_t open_count{0u};
+  std::uint64_t reuse_count{0u};
+  std::uint64_t idle_close_count{0u};
+  bool is_stopping{false};
+  /** \brief Closes idle devices. Started last. */
+  std::thread closer;
+};
+
 } // namespace sdl2
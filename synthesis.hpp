@@ -0,0 +1,256 @@
+#pragma once
+
+// Local dependencies.
+#include "audio.hpp"
+#include "espeak-ng.hpp"
+#include "instrumentation.hpp"
+
+// External dependencies.
+#include <espeak-ng/espeak_ng.h>
+
+// Standard C++ libraries.
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <type_traits>
+
+// Standard C libraries.
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+/** \brief Lets another thread stop the utterance being synthesised.
+ *
+ *  \par Jobs
+ *  The synthesising thread calls \ref begin_job before each utterance.
+ *  A thread wanting to interrupt notes the \ref job it means to stop
+ *  and later passes it to \ref cancel,
+ *  which does nothing if a newer job has begun since.
+ *  That way, a decision made about one utterance
+ *  cannot cancel the next by arriving late.
+ *
+ *  \par Usage
+ *  ```cpp
+ *  // Interrupting thread.
+ *  auto const job = token.job();
+ *  if (is_interrupting()) {
+ *    token.cancel(job);
+ *  }
+ *  // Synthesising thread.
+ *  token.begin_job();
+ *  synthesise(text, synthesis_destination{&sink, nullptr, nullptr,
+ *                                         &token});
+ *  if (token.is_cancelled()) {
+ *    sink.discard_pending();
+ *  }
+ *  ```
+ */
+class cancellation_token {
+public:
+  /** \brief Starts a job which is not cancelled.
+   *
+   *  \return Its id.
+   */
+  std::uint64_t begin_job() {
+    return current_job.fetch_add(1u, std::memory_order_acq_rel) + 1u;
+  }
+
+  /** \brief Id of the latest job begun, `0` before the first. */
+  std::uint64_t job() const {
+    return current_job.load(std::memory_order_acquire);
+  }
+
+  /** \brief Cancels `job` if it is still the latest.
+   *
+   *  May be called from any thread.
+   */
+  void cancel(std::uint64_t job) {
+    if (job == 0u || job != this->job()) {
+      return;
+    }
+    cancel_time_ns.store(
+        instrumentation::now_ns(), std::memory_order_relaxed);
+    cancelled_job.store(job, std::memory_order_release);
+  }
+
+  /** \brief Whether the latest job has been cancelled. */
+  bool is_cancelled() const {
+    return cancelled_job.load(std::memory_order_acquire) == job();
+  }
+
+  /** \brief When the latest job was cancelled, by \ref now_ns.
+   *
+   *  Only meaningful if \ref is_cancelled.
+   */
+  std::uint64_t cancelled_at_ns() const {
+    return cancel_time_ns.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<std::uint64_t> current_job{0u};
+  /** \brief Starts different from \ref current_job. */
+  std::atomic<std::uint64_t> cancelled_job{~std::uint64_t{0u}};
+  std::atomic<std::uint64_t> cancel_time_ns{0u};
+};
+
+/** \brief Where \ref synthesis_callback sends one synthesis.
+ *
+ *  A pointer to this is given as the `user_data` of the synthesis.
+ *
+ *  \tparam sink_type_t
+ *  The type of the sink, needing `write(short const*, std::size_t)`
+ *  and `flush()`.
+ *  It is either \ref audio::sink, to take any sink,
+ *  or a concrete type whose calls are resolved at compile time.
+ */
+template <typename sink_type_t> struct basic_synthesis_destination {
+  /** \brief The type of \ref sink. */
+  using sink_type = sink_type_t;
+  /** \brief Receives the samples, if not `nullptr`. */
+  sink_type* sink{nullptr};
+  /** \brief Records the samples and events, if not `nullptr`. */
+  espeak_ng::synthesis_output* recording{nullptr};
+  /** \brief Given the events of \ref recording as they arrive.
+   *
+   *  Only used if \ref recording is not `nullptr`.
+   */
+  espeak_ng::event_subscriber* subscriber{nullptr};
+  /** \brief Stops the synthesis once cancelled, if not `nullptr`. */
+  cancellation_token const* cancellation{nullptr};
+  /** \brief Most samples \ref recording keeps.
+   *
+   *  Samples past it still go to \ref sink,
+   *  but are not recorded and \ref is_recording_truncated is set,
+   *  so that a long text does not grow the recording without bound.
+   */
+  std::size_t recording_limit{SIZE_MAX};
+  /** \brief Whether samples were left out of \ref recording. */
+  bool is_recording_truncated{false};
+};
+
+/** \brief Destination taking any \ref audio::sink. */
+using synthesis_destination = basic_synthesis_destination<audio::sink>;
+
+/** \brief The synthesis callback for destinations of `sink_type`.
+ *
+ *  \par Purpose
+ *  Each instantiation is a separate function usable as a C callback,
+ *  in the way `boni::nullable_deleter` makes a separate deleter
+ *  for each function pointer it is given.
+ *  With `sink_type` a concrete sink, the `user_data` is cast back
+ *  to a \ref basic_synthesis_destination of that type,
+ *  so writing to the sink is a direct call the compiler can inline,
+ *  instead of a virtual call per chunk.
+ *  A polymorphic `sink_type` must be `final` for that to hold,
+ *  unless it is abstract, as \ref audio::sink is,
+ *  in which case any sink is called virtually.
+ *
+ *  \param wav
+ *  Speech data produced (since last callback?)
+ *  It is `nullptr` if the synthesis has been completed (and paused?)
+ *  \param numsamples
+ *  Length, possibly zero, of the array pointed to by `wav`.
+ *  \param events
+ *  A `type`-`0`-terminated array of `espeak_EVENT` items
+ *  indicating word and sentences events,
+ *  the occurance of mark and audio elements within the text.
+ *  \return `0` if synthesis should continue, `1` to abort.
+ *
+ *  The `user_data` must point to a
+ *  `basic_synthesis_destination<sink_type>`,
+ *  which \ref synthesise_to makes sure of.
+ */
+template <typename sink_type>
+int synthesis_callback(
+    short* wav, int numsamples, espeak_EVENT* events) {
+  static_assert(
+      !std::is_polymorphic<sink_type>::value ||
+          std::is_final<sink_type>::value ||
+          std::is_abstract<sink_type>::value,
+      "A concrete sink that can be derived from is called virtually.");
+  assert(events != nullptr); // Pre-condition.
+
+  auto& metrics = instrumentation::local_metrics();
+  metrics.record_callback(instrumentation::now_ns());
+  // Every event, including the terminator, has the same `user_data`.
+  auto& destination =
+      *static_cast<basic_synthesis_destination<sink_type>*>(
+          events->user_data);
+  if (destination.cancellation &&
+      destination.cancellation->is_cancelled()) {
+    // Nothing of this chunk is wanted any more.
+    return 1;
+  }
+  auto const first_new_event =
+      destination.recording ? destination.recording->timeline.size()
+                            : 0u;
+  auto const sample_rate = espeak_ng_GetSampleRate();
+  for (; events->type != espeakEVENT_LIST_TERMINATED; ++events) {
+    metrics.record_event(events->type);
+    if (destination.recording) {
+      destination.recording->timeline.append(*events, sample_rate);
+    }
+  }
+  if (destination.subscriber && destination.recording &&
+      destination.recording->timeline.size() > first_new_event) {
+    destination.subscriber->on_events(
+        destination.recording->timeline, first_new_event);
+  }
+  if (wav == nullptr) {
+    // Synthesis has completed, so nothing more is coming to wait for.
+    if (destination.sink) {
+      destination.sink->flush();
+    }
+    return 0;
+  }
+  if (numsamples != 0) {
+    metrics.samples_per_chunk.record(
+        static_cast<std::uint64_t>(numsamples));
+    if (destination.sink) {
+      auto const start_ns = instrumentation::now_ns();
+      destination.sink->write(
+          wav, static_cast<std::size_t>(numsamples));
+      metrics.sink_time_ns.record(instrumentation::now_ns() - start_ns);
+    }
+    if (destination.recording) {
+      auto& recorded = destination.recording->samples;
+      auto const room =
+          destination.recording_limit -
+          std::min(destination.recording_limit, recorded.size());
+      auto const count =
+          std::min(room, static_cast<std::size_t>(numsamples));
+      recorded.append(wav, count);
+      if (count < static_cast<std::size_t>(numsamples)) {
+        destination.is_recording_truncated = true;
+      }
+    }
+  }
+  return 0;
+}
+
+/** \brief The callback for any \ref audio::sink.
+ *
+ *  This is \ref synthesis_callback for \ref synthesis_destination,
+ *  for code setting the callback once itself.
+ */
+inline int
+SynthCallback(short* wav, int numsamples, espeak_EVENT* events) {
+  return synthesis_callback<audio::sink>(wav, numsamples, events);
+}
+
+/** \brief Synthesises `text` into `destination`.
+ *
+ *  The synthesis callback is set to the one for `sink_type` first,
+ *  so that the callback always matches the type of the `user_data`,
+ *  even when destinations of different types are used in turn.
+ *  Setting it only stores a pointer in eSpeak NG.
+ */
+template <typename sink_type>
+espeak_ng_STATUS synthesise_to(
+    std::string const& text, unsigned int flags,
+    basic_synthesis_destination<sink_type>& destination) {
+  espeak_SetSynthCallback(synthesis_callback<sink_type>);
+  return espeak_ng_Synthesize(
+      text.c_str(), text.size() + 1, 0, POS_CHARACTER, 0, flags,
+      nullptr, &destination);
+}
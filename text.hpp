@@ -0,0 +1,521 @@
+#pragma once
+
+// External dependencies.
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Standard C++ libraries.
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Standard C libraries.
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/** \brief Text processing done before handing text to eSpeak NG.
+ *
+ *  eSpeak NG accepts text of any length,
+ *  but only returns once all of it has been synthesised.
+ *  The utilities here cut text into pieces small enough
+ *  that audio for the first piece can start early.
+ */
+namespace text {
+
+/** \brief Splits text arriving in parts into sentences.
+ *
+ *  \par Purpose
+ *  When text arrives incrementally, say from a pipe or token by token,
+ *  waiting for all of it before synthesis
+ *  delays the first audio by the time taken for the whole text.
+ *  This splits the text at sentence boundaries as soon as seen,
+ *  so that each sentence can be synthesised, and played,
+ *  while the next is still arriving.
+ *
+ *  \par Boundaries
+ *  A sentence ends after `.`, `!` or `?`,
+ *  and any closing quotes or brackets after it,
+ *  if followed by white space.
+ *  The white space is required so that "3.14" is not split,
+ *  which means the end of a sentence is only known
+ *  once the next character has arrived, or on \ref finish.
+ *  A blank line, as between paragraphs, also ends a sentence.
+ *  A sentence longer than `maximum_length` bytes
+ *  is cut below that length at its last clause boundary,
+ *  a `,`, `;` or `:` followed by white space,
+ *  or failing that at its last white space,
+ *  so that one long run-on sentence cannot delay audio indefinitely
+ *  and is still cut where a speaker would pause.
+ *
+ *  \par Usage
+ *  ```cpp
+ *  text::sentence_splitter splitter;
+ *  while (auto const part = read_some()) {
+ *    splitter.append(*part);
+ *    while (auto const sentence = splitter.next_sentence()) {
+ *      speak(*sentence);
+ *    }
+ *  }
+ *  if (auto const rest = splitter.finish()) {
+ *    speak(*rest);
+ *  }
+ *  ```
+ */
+class sentence_splitter {
+public:
+  /** \brief Creates a splitter cutting sentences at `maximum_length`. */
+  explicit sentence_splitter(std::size_t maximum_length = 512u)
+      : maximum_length{maximum_length} {
+    assert(maximum_length > 0u);
+  }
+
+  /** \brief Adds text that arrived after all text appended so far. */
+  void append(std::string_view more_text) { pending += more_text; }
+
+  /** \brief Removes and returns the next complete sentence, if any.
+   *
+   *  White space around the sentence is not included.
+   */
+  std::optional<std::string> next_sentence() {
+    skip_leading_white_space();
+    for (; scanned < pending.size(); ++scanned) {
+      if (scanned + 1u >= pending.size()) {
+        break;
+      }
+      auto const current = pending[scanned];
+      auto const next = pending[scanned + 1u];
+      if (current == '\n' && next == '\n') {
+        return take(scanned);
+      }
+      if (is_terminator(current)) {
+        auto end = scanned + 1u;
+        while (end < pending.size() && is_closer(pending[end])) {
+          ++end;
+        }
+        if (end == pending.size()) {
+          // Have to wait for what comes after the closers.
+          break;
+        }
+        if (is_white_space(pending[end])) {
+          return take(end);
+        }
+      }
+    }
+    if (pending.size() > maximum_length) {
+      return take(cut_position());
+    }
+    return std::nullopt;
+  }
+
+  /** \brief Returns whatever remains, as the end of the text.
+   *
+   *  \return No value if only white space remains.
+   *  The splitter is empty afterwards and can be reused.
+   */
+  std::optional<std::string> finish() {
+    skip_leading_white_space();
+    if (pending.empty()) {
+      return std::nullopt;
+    }
+    return take(pending.size());
+  }
+
+private:
+  static bool is_terminator(char character) {
+    return character == '.' || character == '!' || character == '?';
+  }
+
+  static bool is_closer(char character) {
+    return character == '"' || character == '\'' || character == ')' ||
+           character == ']';
+  }
+
+  static bool is_white_space(char character) {
+    return character == ' ' || character == '\t' || character == '\n' ||
+           character == '\r' || character == '\f' || character == '\v';
+  }
+
+  /** \brief Drops white space that would start the next sentence. */
+  void skip_leading_white_space() {
+    std::size_t start = 0u;
+    while (start < pending.size() && is_white_space(pending[start])) {
+      ++start;
+    }
+    pending.erase(0u, start);
+    scanned = scanned > start ? scanned - start : 0u;
+  }
+
+  static bool is_clause_end(char character) {
+    return character == ',' || character == ';' || character == ':';
+  }
+
+  /** \brief Where to cut a sentence that is too long.
+   *
+   *  The last clause boundary within `maximum_length`,
+   *  the last white space within it,
+   *  or, failing those, the last UTF-8 character boundary within it.
+   */
+  std::size_t cut_position() const {
+    for (auto position = maximum_length; position > 1u; --position) {
+      if (is_white_space(pending[position]) &&
+          is_clause_end(pending[position - 1u])) {
+        return position;
+      }
+    }
+    for (auto position = maximum_length; position > 0u; --position) {
+      if (is_white_space(pending[position])) {
+        return position;
+      }
+    }
+    auto position = maximum_length;
+    // Continuation bytes of UTF-8 are of the form `10xxxxxx`.
+    while (position > 1u &&
+           (static_cast<unsigned char>(pending[position]) & 0xc0u) ==
+               0x80u) {
+      --position;
+    }
+    return position;
+  }
+
+  /** \brief Removes and returns the first `length` bytes,
+   *  without trailing white space.
+   */
+  std::string take(std::size_t length) {
+    auto sentence = pending.substr(0u, length);
+    pending.erase(0u, length);
+    scanned = 0u;
+    while (!sentence.empty() && is_white_space(sentence.back())) {
+      sentence.pop_back();
+    }
+    return sentence;
+  }
+
+  /** \brief Sentences longer than this are cut. */
+  std::size_t const maximum_length;
+  /** \brief Text appended but not yet returned. */
+  std::string pending;
+  /** \brief Bytes of `pending` known not to end a sentence. */
+  std::size_t scanned{0u};
+};
+
+/** \brief Length of the longest prefix of `text` that is ASCII.
+ *
+ *  Most text given to a speech synthesiser is ASCII,
+ *  so this checks 16 bytes at a time where SSE2 is available,
+ *  or 8 at a time otherwise,
+ *  and only the rest needs decoding byte by byte.
+ */
+inline std::size_t ascii_prefix_length(std::string_view text) {
+  std::size_t position = 0u;
+#if defined(__SSE2__)
+  for (; position + 16u <= text.size(); position += 16u) {
+    auto const bytes = _mm_loadu_si128(
+        reinterpret_cast<__m128i const*>(text.data() + position));
+    // The mask has a bit set for each byte with its top bit set.
+    if (_mm_movemask_epi8(bytes) != 0) {
+      break;
+    }
+  }
+#else
+  for (; position + 8u <= text.size(); position += 8u) {
+    std::uint64_t bytes;
+    std::memcpy(&bytes, text.data() + position, sizeof(bytes));
+    if ((bytes & 0x8080808080808080u) != 0u) {
+      break;
+    }
+  }
+#endif
+  while (position < text.size() &&
+         (static_cast<unsigned char>(text[position]) & 0x80u) == 0u) {
+    ++position;
+  }
+  return position;
+}
+
+/** \brief Length of the valid UTF-8 sequence `text` starts with.
+ *
+ *  \return `0` if `text` is empty or starts with an invalid sequence:
+ *  a stray continuation byte, a truncated sequence,
+ *  an overlong encoding, a surrogate or a code point past U+10FFFF.
+ */
+inline std::size_t utf8_sequence_length(std::string_view text) {
+  if (text.empty()) {
+    return 0u;
+  }
+  auto const byte = [&text](std::size_t index) {
+    return static_cast<unsigned char>(text[index]);
+  };
+  auto const lead = byte(0u);
+  if (lead < 0x80u) {
+    return 1u;
+  }
+  std::size_t length = 0u;
+  unsigned char second_low = 0x80u;
+  unsigned char second_high = 0xbfu;
+  if (lead >= 0xc2u && lead <= 0xdfu) {
+    length = 2u;
+  } else if (lead >= 0xe0u && lead <= 0xefu) {
+    length = 3u;
+    if (lead == 0xe0u) {
+      second_low = 0xa0u; // Overlong below that.
+    } else if (lead == 0xedu) {
+      second_high = 0x9fu; // Surrogates above that.
+    }
+  } else if (lead >= 0xf0u && lead <= 0xf4u) {
+    length = 4u;
+    if (lead == 0xf0u) {
+      second_low = 0x90u; // Overlong below that.
+    } else if (lead == 0xf4u) {
+      second_high = 0x8fu; // Past U+10FFFF above that.
+    }
+  } else {
+    return 0u;
+  }
+  if (text.size() < length || byte(1u) < second_low ||
+      byte(1u) > second_high) {
+    return 0u;
+  }
+  for (std::size_t index = 2u; index < length; ++index) {
+    if ((byte(index) & 0xc0u) != 0x80u) {
+      return 0u;
+    }
+  }
+  return length;
+}
+
+/** \brief Whether `text` is entirely valid UTF-8. */
+inline bool is_valid_utf8(std::string_view text) {
+  while (!text.empty()) {
+    text.remove_prefix(ascii_prefix_length(text));
+    if (text.empty()) {
+      break;
+    }
+    auto const length = utf8_sequence_length(text);
+    if (length == 0u) {
+      return false;
+    }
+    text.remove_prefix(length);
+  }
+  return true;
+}
+
+/** \brief Prepares text for synthesis, once, before it is cached.
+ *
+ *  \par Purpose
+ *  Text given with `espeakCHARS_AUTO` has its encoding guessed
+ *  by eSpeak NG on every synthesis,
+ *  and texts differing only in spacing or in how a URL is written
+ *  are synthesised and cached separately.
+ *  Normalised text is always valid UTF-8,
+ *  so it can be given with `espeakCHARS_UTF8` instead,
+ *  and equivalent texts become the same cache key.
+ *
+ *  \par Normalisation
+ *  - Invalid UTF-8 sequences are replaced by U+FFFD.
+ *  - Runs of white space and control characters become one space,
+ *    and leading and trailing ones are removed.
+ *  - Common English abbreviations, such as "e.g.", are expanded.
+ *  - URLs and e-mail addresses are spelt out,
+ *    so that "www.example.com/a" is read as
+ *    "www dot example dot com slash a".
+ *
+ *  \par Memoisation
+ *  Only words that could be abbreviations, URLs or addresses,
+ *  those with a `.`, `/` or `@`, are looked up,
+ *  and their expansions are remembered,
+ *  so that repeated ones are not worked out again.
+ *  Up to `max_memo_size` expansions are remembered,
+ *  after which the memo is emptied and refilled.
+ *
+ *  ```cpp
+ *  text::normaliser normaliser;
+ *  auto const text = normaliser.normalise("See  www.example.com.");
+ *  // "See www dot example dot com."
+ *  ```
+ */
+class normaliser {
+public:
+  explicit normaliser(std::size_t max_memo_size = 4096u)
+      : max_memo_size{max_memo_size} {
+    seed_memo();
+  }
+
+  /** \brief Returns the normalised form of `text`. */
+  std::string normalise(std::string_view text) {
+    std::string result;
+    result.reserve(text.size());
+    std::string word;
+    auto const end_word = [&]() {
+      if (word.empty()) {
+        return;
+      }
+      if (!result.empty()) {
+        result.push_back(' ');
+      }
+      append_expansion(word, result);
+      word.clear();
+    };
+    while (!text.empty()) {
+      auto const ascii_length = ascii_prefix_length(text);
+      for (std::size_t index = 0u; index < ascii_length; ++index) {
+        auto const character = text[index];
+        if (is_separator(character)) {
+          end_word();
+        } else {
+          word.push_back(character);
+        }
+      }
+      text.remove_prefix(ascii_length);
+      if (text.empty()) {
+        break;
+      }
+      auto const length = utf8_sequence_length(text);
+      if (length == 0u) {
+        word += "\xef\xbf\xbd"; // U+FFFD.
+        text.remove_prefix(1u);
+      } else {
+        word.append(text.data(), length);
+        text.remove_prefix(length);
+      }
+    }
+    end_word();
+    return result;
+  }
+
+  /** \brief Number of words whose expansion was remembered. */
+  std::uint64_t hits() const { return hit_count; }
+
+  /** \brief Number of words whose expansion was worked out. */
+  std::uint64_t misses() const { return miss_count; }
+
+private:
+  /** \brief White space and other ASCII control characters. */
+  static bool is_separator(char character) {
+    auto const code = static_cast<unsigned char>(character);
+    return code <= 0x20u || code == 0x7fu;
+  }
+
+  /** \brief Punctuation that may follow a word in a sentence. */
+  static bool is_trailing_punctuation(char character) {
+    return character == '.' || character == ',' || character == ';' ||
+           character == ':' || character == '!' || character == '?' ||
+           character == ')' || character == '"' || character == '\'';
+  }
+
+  void seed_memo() {
+    static constexpr char const* abbreviations[][2] = {
+        {"e.g.", "for example"}, {"i.e.", "that is"},
+        {"etc.", "et cetera"},   {"vs.", "versus"},
+        {"approx.", "approximately"}, {"Mr.", "Mister"},
+        {"Mrs.", "Missus"},      {"Dr.", "Doctor"},
+    };
+    for (auto const& abbreviation : abbreviations) {
+      memo.emplace(abbreviation[0], abbreviation[1]);
+    }
+  }
+
+  /** \brief Appends the expansion of `word`, with no spaces. */
+  void append_expansion(std::string const& word, std::string& output) {
+    if (word.find_first_of("./@") == std::string::npos) {
+      output += word;
+      return;
+    }
+    if (auto const found = memo.find(word); found != memo.end()) {
+      ++hit_count;
+      output += found->second;
+      return;
+    }
+    ++miss_count;
+    auto expansion = expand(word);
+    if (memo.size() >= max_memo_size) {
+      memo.clear();
+      seed_memo();
+    }
+    output += expansion;
+    memo.emplace(word, std::move(expansion));
+  }
+
+  /** \brief Works out the expansion of a word not in the memo. */
+  std::string expand(std::string_view word) const {
+    // Keep sentence punctuation after a URL or address.
+    auto body_length = word.size();
+    while (body_length > 0u &&
+           is_trailing_punctuation(word[body_length - 1u])) {
+      --body_length;
+    }
+    // An abbreviation followed by other punctuation.
+    for (auto length = word.size(); length-- > body_length;) {
+      auto const found = memo.find(std::string{word.substr(0u, length)});
+      if (found != memo.end()) {
+        return found->second + std::string{word.substr(length)};
+      }
+    }
+    auto const body = word.substr(0u, body_length);
+    auto const trailing = word.substr(body_length);
+    auto const at_sign = body.find('@');
+    auto const is_address =
+        at_sign != std::string_view::npos && at_sign > 0u &&
+        body.find('.', at_sign) != std::string_view::npos;
+    auto url = body;
+    for (auto const scheme : {"https://", "http://"}) {
+      if (url.substr(0u, std::strlen(scheme)) == scheme) {
+        url.remove_prefix(std::strlen(scheme));
+      }
+    }
+    auto const is_url = url.size() != body.size() ||
+                        url.substr(0u, 4u) == "www.";
+    if (!is_address && !is_url) {
+      return std::string{word};
+    }
+    while (!url.empty() && url.back() == '/') {
+      url.remove_suffix(1u);
+    }
+    std::string spelt;
+    for (auto const character : url) {
+      switch (character) {
+      case '.':
+        spelt += " dot ";
+        break;
+      case '/':
+        spelt += " slash ";
+        break;
+      case '@':
+        spelt += " at ";
+        break;
+      case '-':
+        spelt += " dash ";
+        break;
+      case '_':
+        spelt += " underscore ";
+        break;
+      default:
+        spelt.push_back(character);
+        break;
+      }
+    }
+    // Symbols next to each other leave double spaces.
+    std::string collapsed;
+    for (auto const character : spelt) {
+      if (character != ' ' ||
+          (!collapsed.empty() && collapsed.back() != ' ')) {
+        collapsed.push_back(character);
+      }
+    }
+    while (!collapsed.empty() && collapsed.back() == ' ') {
+      collapsed.pop_back();
+    }
+    return collapsed + std::string{trailing};
+  }
+
+  std::size_t const max_memo_size;
+  /** \brief Expansions by word, including punctuation around it. */
+  std::unordered_map<std::string, std::string> memo;
+  std::uint64_t hit_count{0u};
+  std::uint64_t miss_count{0u};
+};
+
+} // namespace text